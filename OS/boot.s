@@ -1,11 +1,14 @@
 ; GRUB Handling
 BITS 32
 
+MB_MAGIC	equ 0x1BADB002
+MB_FLAGS	equ 0x00000003	; page-align modules, provide memory map
+
 section .multiboot
 align 4
-	dd 0x1BADB002
-	dd 0x00000000
-	dd -(0x1BADB002 + 0x00000000)
+	dd MB_MAGIC
+	dd MB_FLAGS
+	dd -(MB_MAGIC + MB_FLAGS)
 
 section .text
 global _start
@@ -15,7 +18,9 @@ _start:
 	; Set up stack
 	mov esp, stack_top
 
-	; Call kernel
+	; Call kernel with kmain(magic, multiboot info)
+	push ebx
+	push eax
 	call kmain
 
 .hang:
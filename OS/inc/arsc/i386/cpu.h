@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+// interrupts off, returning the previous EFLAGS for irq_restore
+static inline uint32_t irq_save(void) {
+	uint32_t flags;
+	__asm__ volatile ("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+	return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+	if (flags & 0x200u) __asm__ volatile ("sti" : : : "memory");
+}
+
+static inline void cpu_halt(void) {
+	__asm__ volatile ("hlt");
+}
+
+// enable interrupts and halt until the next one arrives, atomically
+static inline void cpu_wait_for_interrupt(void) {
+	__asm__ volatile ("sti; hlt; cli" : : : "memory");
+}
+
+// time stamp counter, cycles since reset
+static inline uint64_t cpu_rdtsc(void) {
+	uint32_t lo, hi;
+	__asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
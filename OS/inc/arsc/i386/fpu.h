@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+// x87/SSE registers are switched lazily: CR0.TS is set whenever a task
+// other than the register owner runs, and the first FPU instruction it
+// executes traps to #NM, which swaps the state in
+
+#define FPU_STATE_SIZE 512	// fxsave area, fnsave needs 108 of it
+
+typedef struct {
+	uint8_t data[FPU_STATE_SIZE];
+} __attribute__((aligned(16))) fpu_state_t;
+
+struct task;
+
+// after idt_init, before the first task runs
+void fpu_init(void);
+
+// scheduler hook, called with interrupts off just before switching to next
+void fpu_switch(struct task* next);
+
+// task is going away, drop it as the register owner
+void fpu_forget(struct task* t);
+
+// nonzero if SSE is usable (CR4.OSFXSR set)
+int fpu_has_sse(void);
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+
+#define IDT_VECTORS 48	// 32 exceptions + 16 remapped IRQs
+
+// register snapshot built by isr_common in isr.asm
+typedef struct {
+	uint32_t edi, esi, ebp, esp_dummy, ebx, edx, ecx, eax;	// pushad
+	uint32_t vector;
+	uint32_t err;
+	uint32_t eip, cs, eflags;				// pushed by the CPU
+} int_frame_t;
+
+typedef void (*int_handler_t)(int_frame_t* f);
+
+void idt_init(void);
+
+// exceptions by vector, hardware interrupts by IRQ line
+void idt_set_handler(int vector, int_handler_t fn);
+void irq_set_handler(int irq, int_handler_t fn);
+
+// nonzero while an IRQ handler is running
+int irq_in_handler(void);
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+
+// hardware IRQs are remapped above the CPU exception vectors
+#define PIC_IRQ_BASE 32
+#define PIC_IRQ_COUNT 16
+
+void pic_init(void);
+void pic_eoi(int irq);
+void pic_mask(int irq);
+void pic_unmask(int irq);
+int pic_is_spurious(int irq);
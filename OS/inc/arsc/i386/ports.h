@@ -21,3 +21,26 @@ static inline uint16_t inw(uint16_t port) {
 	return ret;
 }
 
+static inline void outl(uint16_t port, uint32_t val) {
+	__asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+	uint32_t ret;
+	__asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+	return ret;
+}
+
+// small delay for old hardware between port writes
+static inline void io_wait(void) {
+	outb(0x80, 0);
+}
+
+// string I/O, count is in 16-bit words
+static inline void insw(uint16_t port, void* buf, uint32_t count) {
+	__asm__ volatile ("cld; rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buf, uint32_t count) {
+	__asm__ volatile ("cld; rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
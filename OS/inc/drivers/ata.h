@@ -4,5 +4,26 @@
 
 #define ATA_SECTOR_SIZE 512
 
+// finds the IDE controller and sets up bus master DMA, call once after
+// pic_init and pmm_init. without it every transfer uses PIO
+void ata_init(void);
+int ata_dma_active(void);
+
+// DMA when available, PIO otherwise. a DMA transfer started by a task
+// sleeps until IRQ14 instead of spinning. these serialize on the channel
+// and are what the filesystem should use
+int ata_read28_n(uint32_t lba, uint32_t count, uint8_t* out);
+int ata_write28_n(uint32_t lba, uint32_t count, const uint8_t* in);
+int ata_sync(void);
+
+// raw PIO, no locking
 int ata_pio_read28(uint32_t lba, uint8_t* out512);
 int ata_pio_write28(uint32_t lba, const uint8_t* in512);
+
+// count consecutive sectors, split into commands of at most 256. writes
+// land in the drive's cache, call ata_flush once the batch is complete
+int ata_pio_read28_n(uint32_t lba, uint32_t count, uint8_t* out);
+int ata_pio_write28_n(uint32_t lba, uint32_t count, const uint8_t* in);
+
+// CACHE FLUSH, returns once everything written so far is on the media
+int ata_flush(void);
@@ -21,4 +21,14 @@ typedef struct {
 	char ch;
 } key_event_t;
 
+// installs the IRQ1 handler, keys are queued from then on
+void keyboard_init(void);
+
+// nonzero if a key was waiting, never blocks
 int keyboard_try_get_key(key_event_t* ev);
+
+// blocks the calling task until a key arrives
+void keyboard_get_key(key_event_t* ev);
+
+// keys lost because the queue was full
+uint32_t keyboard_dropped(void);
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+
+#define PCI_REG_VENDOR		0x00
+#define PCI_REG_COMMAND		0x04
+#define PCI_REG_CLASS		0x08	// revision, prog if, subclass, class
+#define PCI_REG_HEADER		0x0C
+#define PCI_REG_BAR0		0x10
+#define PCI_REG_BAR4		0x20
+#define PCI_REG_IRQ		0x3C
+
+#define PCI_CMD_IO		0x0001
+#define PCI_CMD_MEMORY		0x0002
+#define PCI_CMD_BUS_MASTER	0x0004
+
+typedef struct {
+	uint8_t bus, dev, fn;
+	uint8_t class_code, subclass, prog_if;
+	uint16_t vendor, device;
+} pci_device_t;
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off);
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint32_t v);
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off);
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint16_t v);
+
+// first function with this class/subclass, nonzero if found
+int pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* out);
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+
+#define PIT_HZ 1000	// one tick per millisecond
+
+void pit_init(uint32_t hz);
+uint32_t pit_ticks(void);
+uint32_t pit_ms_to_ticks(uint32_t ms);
+
+// tickless idle: replace the periodic tick with a single interrupt
+// `ticks` from now, or none at all for PIT_NO_DEADLINE. the ticks missed
+// while stopped are added back from the TSC on exit
+#define PIT_NO_DEADLINE 0xFFFFFFFFu
+void pit_enter_tickless(uint32_t ticks);
+void pit_exit_tickless(void);
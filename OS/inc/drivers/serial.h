@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// COM1 at 115200 8N1. output is queued and sent from the transmit
+// interrupt, a writer only waits on the wire once the queue is full
+void serial_init(void);
+int serial_present(void);
+
+// "\n" goes out as "\r\n". matches terminal_mirror_t, so it can be the
+// second console
+void serial_write(const char* s, size_t len);
+
+uint32_t serial_bytes_sent(void);
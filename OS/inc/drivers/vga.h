@@ -9,16 +9,36 @@
 #define OVERLAY_ROW1 (VGA_HEIGHT - 1)
 #define TEXT_WIDTH (VGA_WIDTH - 1)
 #define SCROLLBAR_COL (VGA_WIDTH - 1)
+// rows of history kept behind the view; newline cost does not depend on it
+#ifndef SCROLLBACK_ROWS
 #define SCROLLBACK_ROWS 300
+#endif
 
 void terminal_init(void);
 void terminal_clear(void);
 void terminal_clear_row(size_t row);
 void terminal_clear_text_area(void);
 void terminal_write(const char* s);
+void terminal_write_u32(uint32_t v);
+
+// output from terminal_write, terminal_putc and terminal_write_u32 is
+// offered to the sink first and goes no further if it returns nonzero.
+// a call with len 0 asks whether the calling task's output is captured
+typedef int (*terminal_sink_t)(const char* s, size_t len);
+void terminal_set_sink(terminal_sink_t sink);
+
+// gets a copy of whatever those calls put on the screen, e.g. a serial
+// console
+typedef void (*terminal_mirror_t)(const char* s, size_t len);
+void terminal_set_mirror(terminal_mirror_t mirror);
+
+// output between begin and end reaches the screen in one flush
+void terminal_batch_begin(void);
+void terminal_batch_end(void);
 void terminal_write_at(size_t row, size_t col, const char* s);
 void terminal_putc(char c);
 void terminal_putc_at(size_t row, size_t col, char c);
+void terminal_move_rows(size_t dst, size_t src, size_t count);
 
 size_t terminal_get_buffer_row(void);
 size_t terminal_get_view_top(void);
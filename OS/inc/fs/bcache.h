@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+// sector cache between the filesystem and the disk driver. writes are
+// held dirty until bcache_sync, and a write that matches what is cached
+// costs nothing
+
+#define BCACHE_BUFS 256		// 128 KiB of sectors
+
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t writes;
+	uint32_t writes_unchanged;	// absorbed by the compare
+	uint32_t writebacks;		// sectors sent to the disk
+	uint32_t evictions;
+	uint32_t dirty;
+	uint32_t cached;
+} bcache_stats_t;
+
+void bcache_init(void);
+
+int bcache_read(uint32_t lba, uint32_t count, uint8_t* out);
+int bcache_write(uint32_t lba, uint32_t count, const uint8_t* in);
+
+// write back every dirty sector in LBA order and flush the drive cache
+int bcache_sync(void);
+
+void bcache_get_stats(bcache_stats_t* out);
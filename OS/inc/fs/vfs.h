@@ -1,5 +1,6 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 
 typedef void (*vfs_list_cb_t)(const char* name, int is_dir, void* user);
 
@@ -11,33 +12,95 @@ typedef enum {
 	VFS_ERR_IS_DIR,
 	VFS_ERR_NAME_INVALID,
 	VFS_ERR_NO_MEM,
-	VFS_ERR_BUSY
+	VFS_ERR_BUSY,
+	VFS_ERR_BAD_FD,
+	VFS_ERR_CORRUPT,	// checksum mismatch or a damaged image
+	VFS_ERR_FULL		// no room on the disk for the next image
 } vfs_status_t;
 
 void vfs_init(void);
 
+// names below may be paths: "a/b/c" from the working directory,
+// "/P/root/..." from the top, with "." and ".." anywhere
+
 // Working directory
 void vfs_pwd(char* out, size_t cap);
-vfs_status_t vfs_cd(const char* name);
+vfs_status_t vfs_cd(const char* path);
 
 // Directories
-vfs_status_t vfs_mkdir(const char* name);
+vfs_status_t vfs_mkdir(const char* path);
 
 // Files
-vfs_status_t vfs_fab(const char* filename);
+vfs_status_t vfs_fab(const char* path);
 vfs_status_t vfs_insp(const char* filename, const char** out_text);
 vfs_status_t vfs_carve(const char* filename, const char* text);
 
 vfs_status_t vfs_burn(const char* filename);
+
+// open handles with positional I/O. a write only touches the chunks it
+// covers and only journals the bytes it was given
+#define VFS_O_READ   0x01u
+#define VFS_O_WRITE  0x02u
+#define VFS_O_CREATE 0x04u	// fab the file if it is missing
+#define VFS_O_TRUNC  0x08u	// start out empty
+
+vfs_status_t vfs_open(const char* path, uint32_t mode, int* out_fd);
+vfs_status_t vfs_read(int fd, size_t off, void* buf, size_t len, size_t* out_read);
+vfs_status_t vfs_write(int fd, size_t off, const void* buf, size_t len);	// past the end zero fills
+vfs_status_t vfs_append(int fd, const void* buf, size_t len);
+vfs_status_t vfs_truncate(int fd, size_t size);
+vfs_status_t vfs_size(int fd, size_t* out_size);
+vfs_status_t vfs_close(int fd);
+
 vfs_status_t vfs_load(void);
-vfs_status_t vfs_save(void);
+vfs_status_t vfs_save(void);	// on the disk and flushed when it returns
+vfs_status_t vfs_sync(void);	// save if dirty, then make sure the cache is written back
+vfs_status_t vfs_checkpoint(void);	// full tree image now, vfs_save waits for a full journal
+
+// drop cached contents of files that are unchanged since the last
+// checkpoint, they are read back on the next access. want = 0 drops all,
+// returns bytes freed. pointers from vfs_insp are invalid afterwards
+size_t vfs_reclaim(size_t want);
 
 vfs_status_t vfs_learn(const char* filename);
 vfs_status_t vfs_is_learned(const char* filename, int* out_learned);
 
+// one object built from a file's contents, e.g. a compiled spell, kept on
+// the node in memory only. changing the contents or burning the file
+// hands it back to free_fn
+typedef void (*vfs_attach_free_t)(void* obj);
+
+vfs_status_t vfs_attach(const char* filename, void* obj, vfs_attach_free_t free_fn);
+vfs_status_t vfs_attached(const char* filename, void** out_obj);	// NOT_FOUND if none
+
 void vfs_shop(vfs_list_cb_t cb, void* user);
+
+typedef enum {
+	VFS_SEEK_NAME = 0,	// substring of a node name
+	VFS_SEEK_TEXT		// substring of a file's contents
+} vfs_seek_mode_t;
+
+typedef struct {
+	uint32_t nodes;		// in the name index
+	uint32_t candidates;	// left after the trigram filter
+	uint32_t read;		// files brought in from disk
+	uint32_t matches;
+} vfs_seek_stats_t;
+
+// search the whole tree, cb gets the full path of each match
+vfs_status_t vfs_seek(vfs_seek_mode_t mode, const char* query, vfs_list_cb_t cb, void* user, vfs_seek_stats_t* out_stats);
 int vfs_is_dirty(void);
 
+typedef struct {
+	uint32_t checkpoints;
+	uint32_t data_sectors_written;
+	uint32_t data_sectors_kept;	// unchanged on disk, not rewritten
+	uint32_t chunk_reads;
+	uint32_t crc_errors;
+} vfs_stats_t;
+
+void vfs_get_stats(vfs_stats_t* out);
+
 // Scripts
 typedef void (*vfs_spell_cb_t)(const char* name, void* user);
 
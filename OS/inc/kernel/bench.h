@@ -0,0 +1,15 @@
+#pragma once
+
+// times the str.c memory and search routines against plain byte loops,
+// TSC cycles per call for each size class
+void bench_mem(void);
+
+// the whole suite: memory routines, heap patterns, a yield ping-pong,
+// sector I/O, terminal output and, only when scratch is set, a save and
+// load of a synthetic tree that leaves the filesystem changed
+void bench_run(int scratch);
+
+// "bench" on the kernel command line starts this task: the suite on the
+// scratch disk, with "BENCH <key> <value> <unit>" lines on QEMU's debug
+// console
+void task_bench(void);
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+
+// background jobs started from the shell. each job runs in its own task
+// and its terminal output is held in a buffer until the shell task prints
+// it, whole lines at a time
+#define JOBS_MAX 8
+
+typedef void (*job_fn_t)(void* arg);
+
+// installs the terminal sink that captures job output
+void jobs_init(void);
+
+// runs fn(arg) in a new task. returns the job number, or -1 if every
+// job slot or task slot is in use
+int job_start(const char* label, job_fn_t fn, void* arg);
+
+int job_is_background(void);	// nonzero inside a job's task
+int job_cancelled(void);	// the current job was asked to stop
+int job_cancel_task(int task_id);	// nonzero if task_id runs a job
+
+// from the shell task only: print pending job output and report jobs
+// that finished since the last call
+void jobs_drain(void);
+void jobs_print(void);
+
+// waits for job num, or for every job when num is 0, printing output as
+// it arrives. returns 1 when done, 0 if Esc stopped the wait and -1 if num
+// is not a job
+int jobs_wait(int num);
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002u
+
+// multiboot_info_t.flags
+#define MULTIBOOT_INFO_MEMORY	0x00000001u
+#define MULTIBOOT_INFO_CMDLINE	0x00000004u
+#define MULTIBOOT_INFO_MMAP	0x00000040u
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1u
+
+typedef struct __attribute__((packed)) {
+	uint32_t flags;
+	uint32_t mem_lower;	// KiB below 1 MiB
+	uint32_t mem_upper;	// KiB above 1 MiB
+	uint32_t boot_device;
+	uint32_t cmdline;
+	uint32_t mods_count;
+	uint32_t mods_addr;
+	uint32_t syms[4];
+	uint32_t mmap_length;
+	uint32_t mmap_addr;
+} multiboot_info_t;
+
+// size does not include the size field itself
+typedef struct __attribute__((packed)) {
+	uint32_t size;
+	uint64_t addr;
+	uint64_t len;
+	uint32_t type;
+} multiboot_mmap_entry_t;
@@ -1,3 +1,45 @@
 #pragma once
+#include <stdint.h>
+#include "kernel/task.h"
+
+#define SCHED_LEVELS 4			// priority levels, 0 is highest
+#define SCHED_DEFAULT_PRIORITY 2
+#define SCHED_QUANTUM_DEFAULT 10	// timer ticks
+
 void schedule(void);
 void yield(void);
+
+// ready queue management, enqueue marks the task READY. dequeue also
+// takes a sleeping task off the sleep queue
+void sched_enqueue(task_t* t);
+void sched_dequeue(task_t* t);
+
+void sched_set_priority(task_t* t, int level);
+void sched_boost(task_t* t);	// lift an interactive task to the top level
+int sched_ready_count(void);
+
+// timer driven preemption
+void sched_set_quantum(uint32_t ticks);
+uint32_t sched_get_quantum(void);
+void sched_tick(uint32_t now);	// from the timer IRQ
+void sched_irq_exit(void);	// from the IRQ dispatcher, after EOI
+
+// park the current task until wake_tick, caller must schedule()
+void sched_sleep_until(task_t* t, uint32_t wake_tick);
+
+// block the current task until sched_wake, caller must schedule(). do the
+// wait-condition check and the block with interrupts off to avoid a lost
+// wakeup. sched_wake also ends a sched_sleep_until early, which makes a
+// sleep usable as a wait with a timeout
+void sched_block(task_t* t);
+void sched_wake(task_t* t);
+
+// accounting in TSC cycles. runtime includes the slice in progress
+uint64_t sched_task_runtime(const task_t* t);
+uint64_t sched_uptime_tsc(void);
+uint32_t sched_switch_count(void);
+
+// the idle task halts the CPU when nothing is runnable, with the timer
+// programmed for the next sleeper only
+void sched_set_idle(task_t* t);
+void task_idle(void);
@@ -1,2 +1,7 @@
 #pragma once
 void task_shell(void);
+
+// the lock shell commands run under, for tasks outside the shell that
+// touch the same state. the owner may take it again
+void shell_lock(void);
+void shell_unlock(void);
@@ -1,21 +1,51 @@
 #pragma once
 #include <stdint.h>
+#include "arsc/i386/fpu.h"
 
 typedef enum {
 	TASK_DEAD = 0,
 	TASK_READY,
 	TASK_RUNNING,
 	TASK_BLOCKED,
-	TASK_ZOMBIE
+	TASK_ZOMBIE,
+	TASK_SLEEPING
 } task_state_t;
 
+#define TASK_NAME_MAX 32
+
 typedef struct task {
 	uint32_t esp;
 	task_state_t state;
-	const char* name;
+	const char* name;	// points at name_buf
+	char name_buf[TASK_NAME_MAX];
 	void (*entry)(void);
+	void (*entry_arg)(void* arg);	// set instead of entry by task_create_arg
+	void* arg;
 	void* kstack_base;
 	uint32_t kstack_size;
+	int id;
+	uint32_t gen;	// counts spawns, tells apart tasks that reused a slot
+	uint8_t pinned;	// task_kill refuses it, see task_pin
+
+	// scheduling, see sched.c
+	uint8_t priority;	// current level, 0 is highest
+	uint8_t base_priority;	// level the task settles back to
+	uint8_t boost;		// runs left at the boosted level
+	uint8_t on_rq;
+	struct task* rq_next;
+	struct task* rq_prev;
+	uint32_t wake_tick;
+	struct task* sleep_next;
+
+	// accounting, updated on every switch
+	uint64_t run_tsc;	// cycles spent on the CPU
+	uint32_t switches_in;
+	uint32_t vol_switches;	// gave up the CPU itself
+	uint32_t invol_switches; // preempted at the end of a slice
+
+	// lazily saved x87/SSE registers, see fpu.c
+	uint8_t fpu_used;
+	fpu_state_t fpu;
 } task_t;
 
 // Cap right now for tracked tasks
@@ -23,15 +53,18 @@ typedef struct task {
 
 void task_init(void);
 int task_create(void (*entry)(void), const char* name);
+int task_create_arg(void (*entry)(void* arg), void* arg, const char* name);
 int task_kill(int id);
+void task_pin(int id, int pinned);
 int task_current_id(void);
 task_t* task_at(int id);
 
 void task_wraith(void); // task reaper
 void task_exit(void) __attribute__((noreturn));
-void task_delay(volatile uint32_t loops);
+void task_sleep_ms(uint32_t ms);
 
 char task_state_char(task_state_t s);
 void task_print_to_console(void);
+void task_print_top(uint32_t sample_ms);
 int hb_instance_index(const char* hb_name, int my_id);
 
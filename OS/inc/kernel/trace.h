@@ -0,0 +1,72 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// fixed ring of timestamped binary events. recording is off until
+// trace_set_mask turns a type on, and a type that is off costs a load and
+// a branch at its trace point
+typedef enum {
+	TRACE_NONE = 0,
+	TRACE_SWITCH,		// a = task out, b = task in, c = 1 if preempted
+	TRACE_DISK,		// a = lba, b = sectors | TRACE_DISK_* flags, c = cycles
+	TRACE_VFS_PHASE,	// a = TRACE_VFS_* op, b = phase, c = cycles in the phase
+	TRACE_HEAP_SLOW,	// a = bytes carved, b = 1 if frames came from the PMM, c = cycles
+	TRACE_TYPE_COUNT
+} trace_type_t;
+
+#define TRACE_BIT(type) (1u << (type))
+#define TRACE_ALL (TRACE_BIT(TRACE_SWITCH) | TRACE_BIT(TRACE_DISK) | \
+	TRACE_BIT(TRACE_VFS_PHASE) | TRACE_BIT(TRACE_HEAP_SLOW))
+
+#define TRACE_DISK_WRITE 0x80000000u
+#define TRACE_DISK_DMA   0x40000000u
+
+// TRACE_VFS_PHASE ops, the phases are listed where they are recorded
+#define TRACE_VFS_CHECKPOINT 1u
+#define TRACE_VFS_LOAD 2u
+#define TRACE_VFS_SYNC 3u
+
+#define TRACE_RECORDS 4096	// power of two
+
+typedef struct {
+	uint64_t tsc;
+	uint32_t a;
+	uint32_t b;
+	uint32_t c;
+	uint16_t type;
+	uint16_t task;	// current task id, 0xFFFF before the first switch
+} trace_event_t;
+
+extern uint32_t g_trace_mask;
+
+void trace_record(trace_type_t type, uint32_t a, uint32_t b, uint32_t c);
+
+static inline int trace_on(trace_type_t type) {
+	return (g_trace_mask >> type) & 1u;
+}
+
+static inline void trace(trace_type_t type, uint32_t a, uint32_t b, uint32_t c) {
+	if (trace_on(type)) trace_record(type, a, b, c);
+}
+
+// cycles since t0 for the c field, saturated
+static inline uint32_t trace_cycles_since(uint64_t t0, uint64_t now) {
+	uint64_t d = now - t0;
+	return (d > 0xFFFFFFFFull) ? 0xFFFFFFFFu : (uint32_t)d;
+}
+
+void trace_set_mask(uint32_t mask);
+void trace_clear(void);
+
+// events are numbered from the first one recorded. a reader keeps a
+// cursor; trace_read copies out what follows it and moves it on, skipping
+// anything the ring already overwrote and adding that to *lost
+uint32_t trace_oldest(void);
+uint32_t trace_head(void);
+uint32_t trace_read(uint32_t* cursor, trace_event_t* out, uint32_t max, uint32_t* lost);
+
+const char* trace_type_name(uint32_t type);
+
+// one text line, "<tsc> <task> <type> <a> <b> <c>\n" with the numbers in
+// hex. returns its length
+size_t trace_format(const trace_event_t* e, char* out, size_t cap);
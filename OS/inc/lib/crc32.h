@@ -0,0 +1,9 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE 802.3, reflected, as used by zip and ethernet)
+uint32_t crc32(const void* p, size_t n);
+
+// chain pieces: crc32_update(crc32_update(0, a, na), b, nb) == crc32(ab)
+uint32_t crc32_update(uint32_t crc, const void* p, size_t n);
@@ -0,0 +1,6 @@
+#pragma once
+#include <stdint.h>
+
+// n / d without libgcc, a freestanding build has no 64-bit divide.
+// the remainder goes to rem when it is not 0, d == 0 gives 0 and n
+uint64_t udiv64(uint64_t n, uint64_t d, uint64_t* rem);
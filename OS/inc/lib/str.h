@@ -11,6 +11,7 @@ int kstrncmp(const char* a, const char* b, size_t n);
 void* kmemset(void* dst, int v, size_t n);
 void* kmemcpy(void* dst, const void* src, size_t n);
 void* kmemmove(void* dst, const void* src, size_t n);
+int kmemcmp(const void* a, const void* b, size_t n);
 const char* kstrstr(const char* haystack, const char* needle);
 size_t kstrnlen(const char* s, size_t max);
 void kstrncpy0(char* dst, const char* src, size_t dst_cap);
@@ -2,6 +2,39 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// who asked for the memory, for heapstat
+typedef enum {
+	HEAP_TAG_OTHER = 0,
+	HEAP_TAG_VFS,
+	HEAP_TAG_SCRIBE,
+	HEAP_TAG_SHELL,
+	HEAP_TAG_COUNT
+} heap_tag_t;
+
+typedef struct {
+	uint32_t live_blocks;
+	uint32_t live_bytes;
+	uint32_t free_blocks;
+	uint32_t free_bytes;
+	uint32_t largest_free;
+	uint32_t high_water;	// peak of live_bytes
+	uint32_t carved_bytes;	// bytes taken out of PMM chunks so far
+	uint32_t chunks;
+	uint32_t guard_faults;
+	uintptr_t last_fault;
+	uint32_t tag_allocs[HEAP_TAG_COUNT];
+	uint32_t tag_live_bytes[HEAP_TAG_COUNT];
+} heap_stats_t;
+
 void heap_init(void);
 void* kmalloc(size_t bytes);
+void* kmalloc_tagged(size_t bytes, heap_tag_t tag);
 void kfree(void* ptr);
+
+void heap_get_stats(heap_stats_t* out);
+const char* heap_tag_name(heap_tag_t tag);
+
+// guard mode pads new blocks with a canary that kfree checks, and poisons
+// memory on alloc/free
+void heap_set_guard(int on);
+int heap_guard_enabled(void);
@@ -0,0 +1,15 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel/multiboot.h"
+
+#define PMM_FRAME_SIZE 4096u
+
+void pmm_init(uint32_t magic, const multiboot_info_t* mbi);
+
+// contiguous run of frames, returns 0 when none is available
+uintptr_t pmm_alloc_frames(size_t count);
+void pmm_free_frames(uintptr_t addr, size_t count);
+
+size_t pmm_total_count(void);
+size_t pmm_free_count(void);
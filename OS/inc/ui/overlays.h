@@ -1,7 +1,8 @@
 #pragma once
 #include <stdint.h>
 
-void overlays_redraw(void);
+void overlays_redraw(void);	// repaint both rows on the next refresh
+void overlays_refresh(void);
 
 // Heartbeat management
 void overlays_hb_tick(int hb_kind, int task_id, uint32_t counter);
@@ -11,3 +12,5 @@ void overlays_hb_remove(int task_id);
 void task_heartbeat0(void);
 void task_heartbeat1(void);
 
+// composes the overlay rows at a fixed rate
+void task_overlay(void);
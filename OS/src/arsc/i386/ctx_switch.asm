@@ -2,16 +2,29 @@ BITS 32
 GLOBAL ctx_switch
 
 ; ctx_switch(uint32_t* old_esp, uint32_t new_esp)
+;
+; only the registers the cdecl ABI makes the callee preserve are saved.
+; the caller's C code already treats eax/ecx/edx and EFLAGS as clobbered,
+; and the scheduler always switches with interrupts off, so each task gets
+; its own IF back from its irq_restore.
+;
+; preemption takes the same path: isr_common has already pushed the full
+; interrupted register set and iret frame onto the task's stack, so when
+; the task is switched back in it unwinds through isr_dispatch and iretd.
 ctx_switch:
 	mov eax, [esp + 4]	; eax = old_esp pointer
 	mov edx, [esp + 8]	; edx = new_esp
 
-	pushfd			; save EFLAGS
-	pushad			; save general regs
+	push ebp
+	push ebx
+	push esi
+	push edi
 
 	mov [eax], esp		; *old_esp = current context pointer
 	mov esp, edx		; switch to new task's context
 
-	popad			; restore regs of new task
-	popfd			; restore flags of new task
+	pop edi
+	pop esi
+	pop ebx
+	pop ebp
 	ret			; return into new task
@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include "arsc/i386/fpu.h"
+#include "arsc/i386/idt.h"
+#include "kernel/task.h"
+
+#define CR0_MP (1u << 1)
+#define CR0_EM (1u << 2)
+#define CR0_TS (1u << 3)
+#define CR0_NE (1u << 5)
+#define CR4_OSFXSR (1u << 9)
+#define CR4_OSXMMEXCPT (1u << 10)
+
+#define CPUID_FXSR (1u << 24)
+#define CPUID_SSE (1u << 25)
+
+#define VEC_NM 7	// device not available
+
+static task_t* g_owner = 0;	// whose state is in the registers
+static int g_has_fxsr = 0;
+static int g_has_sse = 0;
+static int g_ts_set = 0;
+static fpu_state_t g_clean;	// state right after fninit, for first use
+
+static inline uint32_t read_cr0(void) {
+	uint32_t v;
+	__asm__ volatile ("mov %%cr0, %0" : "=r"(v));
+	return v;
+}
+
+static inline void write_cr0(uint32_t v) {
+	__asm__ volatile ("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+	uint32_t v;
+	__asm__ volatile ("mov %%cr4, %0" : "=r"(v));
+	return v;
+}
+
+static inline void write_cr4(uint32_t v) {
+	__asm__ volatile ("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static inline uint32_t cpuid_edx(uint32_t leaf) {
+	uint32_t a, b, c, d;
+	__asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf));
+	return d;
+}
+
+static void set_ts(void) {
+	if (g_ts_set) return;
+	write_cr0(read_cr0() | CR0_TS);
+	g_ts_set = 1;
+}
+
+static void clear_ts(void) {
+	if (!g_ts_set) return;
+	__asm__ volatile ("clts" : : : "memory");
+	g_ts_set = 0;
+}
+
+static void save(fpu_state_t* s) {
+	if (g_has_fxsr) __asm__ volatile ("fxsave %0" : "=m"(*s));
+	else __asm__ volatile ("fnsave %0; fwait" : "=m"(*s));
+}
+
+static void restore(const fpu_state_t* s) {
+	if (g_has_fxsr) __asm__ volatile ("fxrstor %0" : : "m"(*s));
+	else __asm__ volatile ("frstor %0" : : "m"(*s));
+}
+
+static void fpu_nm(int_frame_t* f) {
+	(void)f;
+	clear_ts();
+
+	task_t* cur = task_at(task_current_id());
+	if (cur == g_owner) return;
+
+	if (g_owner) save(&g_owner->fpu);
+	restore((cur && cur->fpu_used) ? &cur->fpu : &g_clean);
+	if (cur) cur->fpu_used = 1;
+	g_owner = cur;
+}
+
+void fpu_init(void) {
+	uint32_t edx = cpuid_edx(1);
+	g_has_fxsr = (edx & CPUID_FXSR) != 0;
+	g_has_sse = g_has_fxsr && (edx & CPUID_SSE) != 0;
+
+	uint32_t cr0 = read_cr0();
+	cr0 &= ~(CR0_EM | CR0_TS);
+	cr0 |= CR0_MP | CR0_NE;
+	write_cr0(cr0);
+	g_ts_set = 0;
+
+	if (g_has_fxsr) {
+		uint32_t cr4 = read_cr4() | CR4_OSFXSR;
+		if (g_has_sse) cr4 |= CR4_OSXMMEXCPT;
+		write_cr4(cr4);
+	}
+
+	__asm__ volatile ("fninit");
+	save(&g_clean);
+	if (!g_has_fxsr) restore(&g_clean);	// fnsave reinitialises the FPU
+
+	g_owner = 0;
+	idt_set_handler(VEC_NM, fpu_nm);
+	set_ts();
+}
+
+void fpu_switch(task_t* next) {
+	if (next == g_owner) clear_ts();
+	else set_ts();
+}
+
+void fpu_forget(task_t* t) {
+	if (g_owner == t) g_owner = 0;
+}
+
+int fpu_has_sse(void) {
+	return g_has_sse;
+}
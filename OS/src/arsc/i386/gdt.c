@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include "arsc/i386/gdt.h"
+
+// flat ring 0 segments. the multiboot spec leaves GRUB's GDT undefined,
+// so install our own before any interrupt gate refers to a selector
+
+typedef struct __attribute__((packed)) {
+	uint16_t limit_low;
+	uint16_t base_low;
+	uint8_t base_mid;
+	uint8_t access;
+	uint8_t gran;
+	uint8_t base_high;
+} gdt_entry_t;
+
+typedef struct __attribute__((packed)) {
+	uint16_t limit;
+	uint32_t base;
+} gdt_ptr_t;
+
+static gdt_entry_t g_gdt[3];
+
+static void gdt_set(int i, uint8_t access) {
+	g_gdt[i].limit_low = 0xFFFF;
+	g_gdt[i].base_low = 0;
+	g_gdt[i].base_mid = 0;
+	g_gdt[i].access = access;
+	g_gdt[i].gran = 0xCF; // 4 KiB granularity, 32-bit, limit 0xF
+	g_gdt[i].base_high = 0;
+}
+
+void gdt_init(void) {
+	g_gdt[0] = (gdt_entry_t){ 0, 0, 0, 0, 0, 0 };
+	gdt_set(1, 0x9A); // code: present, ring 0, exec/read
+	gdt_set(2, 0x92); // data: present, ring 0, read/write
+
+	gdt_ptr_t gp = { sizeof(g_gdt) - 1, (uint32_t)&g_gdt[0] };
+
+	__asm__ volatile (
+		"lgdt %0\n\t"
+		"ljmp %1, $1f\n"
+		"1:\n\t"
+		"movw %2, %%ax\n\t"
+		"movw %%ax, %%ds\n\t"
+		"movw %%ax, %%es\n\t"
+		"movw %%ax, %%fs\n\t"
+		"movw %%ax, %%gs\n\t"
+		"movw %%ax, %%ss\n\t"
+		:
+		: "m"(gp), "i"(GDT_KERNEL_CODE), "i"(GDT_KERNEL_DATA)
+		: "eax", "memory");
+}
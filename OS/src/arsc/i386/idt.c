@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include "arsc/i386/idt.h"
+#include "arsc/i386/gdt.h"
+#include "arsc/i386/pic.h"
+#include "drivers/vga.h"
+#include "kernel/sched.h"
+
+typedef struct __attribute__((packed)) {
+	uint16_t off_low;
+	uint16_t sel;
+	uint8_t zero;
+	uint8_t type_attr;
+	uint16_t off_high;
+} idt_entry_t;
+
+typedef struct __attribute__((packed)) {
+	uint16_t limit;
+	uint32_t base;
+} idt_ptr_t;
+
+#define IDT_INT_GATE 0x8E // present, ring 0, 32-bit interrupt gate
+
+extern uint32_t isr_stub_table[IDT_VECTORS];
+
+static idt_entry_t g_idt[IDT_VECTORS];
+static int_handler_t g_handlers[IDT_VECTORS];
+static volatile int g_irq_depth = 0;
+
+void isr_dispatch(int_frame_t* f);
+
+static void write_hex(uint32_t v) {
+	static const char digits[] = "0123456789ABCDEF";
+	terminal_write("0x");
+	for (int s = 28; s >= 0; s -= 4) terminal_putc(digits[(v >> s) & 0xF]);
+}
+
+__attribute__((noreturn))
+static void panic_exception(int_frame_t* f) {
+	terminal_write("\nKernel panic: exception ");
+	terminal_write_u32(f->vector);
+	terminal_write(" err ");
+	write_hex(f->err);
+	terminal_write(" at eip ");
+	write_hex(f->eip);
+	terminal_putc('\n');
+	for (;;) __asm__ volatile ("cli; hlt");
+}
+
+void isr_dispatch(int_frame_t* f) {
+	int vector = (int)f->vector;
+
+	if (vector < PIC_IRQ_BASE) {
+		if (g_handlers[vector]) g_handlers[vector](f);
+		else panic_exception(f);
+		return;
+	}
+
+	int irq = vector - PIC_IRQ_BASE;
+	if (pic_is_spurious(irq)) return;
+
+	g_irq_depth++;
+	if (g_handlers[vector]) g_handlers[vector](f);
+	pic_eoi(irq);
+	g_irq_depth--;
+
+	// safe point to switch away from the interrupted task
+	sched_irq_exit();
+}
+
+void idt_init(void) {
+	for (int i = 0; i < IDT_VECTORS; i++) {
+		uint32_t off = isr_stub_table[i];
+		g_idt[i].off_low = (uint16_t)(off & 0xFFFF);
+		g_idt[i].sel = GDT_KERNEL_CODE;
+		g_idt[i].zero = 0;
+		g_idt[i].type_attr = IDT_INT_GATE;
+		g_idt[i].off_high = (uint16_t)(off >> 16);
+		g_handlers[i] = 0;
+	}
+
+	idt_ptr_t ip = { sizeof(g_idt) - 1, (uint32_t)&g_idt[0] };
+	__asm__ volatile ("lidt %0" : : "m"(ip) : "memory");
+}
+
+void idt_set_handler(int vector, int_handler_t fn) {
+	if (vector < 0 || vector >= IDT_VECTORS) return;
+	g_handlers[vector] = fn;
+}
+
+void irq_set_handler(int irq, int_handler_t fn) {
+	if (irq < 0 || irq >= PIC_IRQ_COUNT) return;
+	g_handlers[PIC_IRQ_BASE + irq] = fn;
+}
+
+int irq_in_handler(void) {
+	return g_irq_depth != 0;
+}
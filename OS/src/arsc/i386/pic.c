@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include "arsc/i386/pic.h"
+#include "arsc/i386/ports.h"
+
+#define PIC1_CMD	0x20
+#define PIC1_DATA	0x21
+#define PIC2_CMD	0xA0
+#define PIC2_DATA	0xA1
+
+#define PIC_EOI		0x20
+#define PIC_READ_ISR	0x0B
+
+#define ICW1_INIT	0x10
+#define ICW1_ICW4	0x01
+#define ICW4_8086	0x01
+
+void pic_init(void) {
+	outb(PIC1_CMD, ICW1_INIT | ICW1_ICW4); io_wait();
+	outb(PIC2_CMD, ICW1_INIT | ICW1_ICW4); io_wait();
+	outb(PIC1_DATA, PIC_IRQ_BASE); io_wait();	// master vector offset
+	outb(PIC2_DATA, PIC_IRQ_BASE + 8); io_wait();	// slave vector offset
+	outb(PIC1_DATA, 4); io_wait();			// slave on IRQ2
+	outb(PIC2_DATA, 2); io_wait();			// cascade identity
+	outb(PIC1_DATA, ICW4_8086); io_wait();
+	outb(PIC2_DATA, ICW4_8086); io_wait();
+
+	// everything masked except the cascade, drivers unmask what they use
+	outb(PIC1_DATA, 0xFB);
+	outb(PIC2_DATA, 0xFF);
+}
+
+void pic_eoi(int irq) {
+	if (irq >= 8) outb(PIC2_CMD, PIC_EOI);
+	outb(PIC1_CMD, PIC_EOI);
+}
+
+void pic_mask(int irq) {
+	uint16_t port = (irq < 8) ? PIC1_DATA : PIC2_DATA;
+	outb(port, (uint8_t)(inb(port) | (1u << (irq & 7))));
+}
+
+void pic_unmask(int irq) {
+	uint16_t port = (irq < 8) ? PIC1_DATA : PIC2_DATA;
+	outb(port, (uint8_t)(inb(port) & ~(1u << (irq & 7))));
+}
+
+// IRQ7/IRQ15 can fire without a real request, check the in-service bit
+int pic_is_spurious(int irq) {
+	if (irq == 7) {
+		outb(PIC1_CMD, PIC_READ_ISR);
+		return (inb(PIC1_CMD) & 0x80) == 0;
+	}
+	if (irq == 15) {
+		outb(PIC2_CMD, PIC_READ_ISR);
+		if ((inb(PIC2_CMD) & 0x80) == 0) {
+			// the master still saw the cascade
+			outb(PIC1_CMD, PIC_EOI);
+			return 1;
+		}
+	}
+	return 0;
+}
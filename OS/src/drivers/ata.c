@@ -1,7 +1,16 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "drivers/ata.h"
+#include "drivers/pci.h"
+#include "drivers/pit.h"
 #include "arsc/i386/ports.h"
+#include "arsc/i386/cpu.h"
+#include "arsc/i386/idt.h"
+#include "arsc/i386/pic.h"
+#include "kernel/sched.h"
+#include "kernel/task.h"
+#include "kernel/trace.h"
+#include "mm/pmm.h"
 
 #define ATA_IO_BASE	0x1F0
 #define ATA_CTL_BASE	0x3F6
@@ -22,8 +31,52 @@
 #define ATA_SR_DRQ  0x08
 #define ATA_SR_ERR  0x01
 
+#define ATA_CTL_SRST 0x04	// device control, software reset
+
 #define ATA_CMD_READ_SECTORS  0x20
 #define ATA_CMD_WRITE_SECTORS 0x30
+#define ATA_CMD_CACHE_FLUSH   0xE7
+#define ATA_CMD_READ_DMA      0xC8
+#define ATA_CMD_WRITE_DMA     0xCA
+
+#define ATA_LBA28_MAX 0x0FFFFFFFu
+#define ATA_MAX_SECTORS_PER_CMD 256u
+
+// bus master IDE, registers relative to BAR4 (primary channel)
+#define BM_REG_CMD	0x00
+#define BM_REG_STATUS	0x02
+#define BM_REG_PRDT	0x04
+
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08	// device to memory
+#define BM_SR_ERR	0x02
+#define BM_SR_IRQ	0x04
+
+#define ATA_IRQ 14
+#define ATA_DMA_TIMEOUT_MS 2000
+#define ATA_DMA_POLL_SPINS 10000000
+
+// physical region descriptor, one contiguous piece of the transfer. a
+// region must not cross a 64 KiB boundary and a count of 0 means 64 KiB
+typedef struct __attribute__((packed)) {
+	uint32_t addr;
+	uint16_t bytes;
+	uint16_t flags;
+} ata_prd_t;
+
+#define PRD_EOT 0x8000
+#define ATA_PRD_MAX (PMM_FRAME_SIZE / sizeof(ata_prd_t))
+
+static uint16_t g_bm_base = 0;
+static ata_prd_t* g_prdt = 0;
+static int g_dma = 0;
+
+static volatile int g_dma_done = 0;
+static volatile uint8_t g_dma_status = 0;
+static task_t* volatile g_dma_waiter = 0;
+
+// one request on the channel at a time
+static volatile int g_busy = 0;
 
 static void io_wait_400ns(void) {
 	(void)inb(ATA_CTL_BASE);
@@ -55,52 +108,302 @@ static void ata_select_lba28(uint32_t lba) {
 	io_wait_400ns();
 }
 
-int ata_pio_read28(uint32_t lba, uint8_t* out512) {
-	if (!out512) return 1;
-	if (lba > 0x0FFFFFFF) return 2;
+static int ata_wait_done(void) {
+	if (ata_wait_not_busy() != 0) return 1;
+	uint8_t st = inb(ATA_IO_BASE + ATA_REG_STATUS);
+	if (st & ATA_SR_ERR) return 2;
+	if (st & ATA_SR_DF)  return 3;
+	return 0;
+}
 
-	if (ata_wait_not_busy() != 0) return 3;
-	ata_select_lba28(lba);
+static int ata_check_range(uint32_t lba, uint32_t count) {
+	if (count == 0) return 1;
+	if (lba > ATA_LBA28_MAX || count - 1u > ATA_LBA28_MAX - lba) return 1;
+	return 0;
+}
 
-	outb(ATA_IO_BASE + ATA_REG_SECCOUNT, 1);
+// one command for up to 256 sectors, a SECCOUNT of 0 means 256
+static void ata_issue(uint32_t lba, uint32_t count, uint8_t cmd) {
+	ata_select_lba28(lba);
+	outb(ATA_IO_BASE + ATA_REG_SECCOUNT, (uint8_t)(count & 0xFF));
 	outb(ATA_IO_BASE + ATA_REG_LBA0, (uint8_t)(lba & 0xFF));
 	outb(ATA_IO_BASE + ATA_REG_LBA1, (uint8_t)((lba >> 8) & 0xFF));
 	outb(ATA_IO_BASE + ATA_REG_LBA2, (uint8_t)((lba >> 16) & 0xFF));
-	outb(ATA_IO_BASE + ATA_REG_COMMAND, ATA_CMD_READ_SECTORS);
+	outb(ATA_IO_BASE + ATA_REG_COMMAND, cmd);
+}
+
+// one TRACE_DISK event per call, with its latency
+static void trace_disk(uint32_t lba, uint32_t count, uint32_t flags, uint64_t t0) {
+	if (trace_on(TRACE_DISK)) trace_record(TRACE_DISK, lba, count | flags, trace_cycles_since(t0, cpu_rdtsc()));
+}
+
+static int pio_read(uint32_t lba, uint32_t count, uint8_t* out) {
+	if (!out) return 1;
+	if (ata_check_range(lba, count) != 0) return 2;
+
+	while (count > 0) {
+		uint32_t n = (count > ATA_MAX_SECTORS_PER_CMD) ? ATA_MAX_SECTORS_PER_CMD : count;
+
+		if (ata_wait_not_busy() != 0) return 3;
+		ata_issue(lba, n, ATA_CMD_READ_SECTORS);
 
-	if (ata_wait_drq() != 0) return 4;
+		for (uint32_t s = 0; s < n; s++) {
+			if (ata_wait_drq() != 0) return 4;
+			insw(ATA_IO_BASE + ATA_REG_DATA, out, ATA_SECTOR_SIZE / 2);
+			out += ATA_SECTOR_SIZE;
+		}
 
-	for (int i = 0; i < 256; i++) {
-		uint16_t w = inw(ATA_IO_BASE + ATA_REG_DATA);
-		out512[i * 2 + 0] = (uint8_t)(w & 0xFF);
-		out512[i * 2 + 1] = (uint8_t)((w >> 8) & 0xFF);
+		lba += n;
+		count -= n;
 	}
 	return 0;
 }
 
+static int pio_write(uint32_t lba, uint32_t count, const uint8_t* in) {
+	if (!in) return 1;
+	if (ata_check_range(lba, count) != 0) return 2;
+
+	while (count > 0) {
+		uint32_t n = (count > ATA_MAX_SECTORS_PER_CMD) ? ATA_MAX_SECTORS_PER_CMD : count;
+
+		if (ata_wait_not_busy() != 0) return 3;
+		ata_issue(lba, n, ATA_CMD_WRITE_SECTORS);
+
+		for (uint32_t s = 0; s < n; s++) {
+			if (ata_wait_drq() != 0) return 4;
+			outsw(ATA_IO_BASE + ATA_REG_DATA, in, ATA_SECTOR_SIZE / 2);
+			in += ATA_SECTOR_SIZE;
+		}
+
+		if (ata_wait_done() != 0) return 5;
+
+		lba += n;
+		count -= n;
+	}
+	return 0;
+}
+
+int ata_pio_read28_n(uint32_t lba, uint32_t count, uint8_t* out) {
+	uint64_t t0 = cpu_rdtsc();
+	int rc = pio_read(lba, count, out);
+	trace_disk(lba, count, 0, t0);
+	return rc;
+}
+
+int ata_pio_write28_n(uint32_t lba, uint32_t count, const uint8_t* in) {
+	uint64_t t0 = cpu_rdtsc();
+	int rc = pio_write(lba, count, in);
+	trace_disk(lba, count, TRACE_DISK_WRITE, t0);
+	return rc;
+}
+
+int ata_pio_read28(uint32_t lba, uint8_t* out512) {
+	return ata_pio_read28_n(lba, 1, out512);
+}
+
 int ata_pio_write28(uint32_t lba, const uint8_t* in512) {
-	if (!in512) return 1;
-	if (lba > 0x0FFFFFFF) return 2;
+	return ata_pio_write28_n(lba, 1, in512);
+}
 
+int ata_flush(void) {
 	if (ata_wait_not_busy() != 0) return 3;
-	ata_select_lba28(lba);
+	outb(ATA_IO_BASE + ATA_REG_HDDEVSEL, 0xE0);
+	io_wait_400ns();
+	outb(ATA_IO_BASE + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+	if (ata_wait_done() != 0) return 5;
+	return 0;
+}
 
-	outb(ATA_IO_BASE + ATA_REG_SECCOUNT, 1);
-	outb(ATA_IO_BASE + ATA_REG_LBA0, (uint8_t)(lba & 0xFF));
-	outb(ATA_IO_BASE + ATA_REG_LBA1, (uint8_t)((lba >> 8) & 0xFF));
-	outb(ATA_IO_BASE + ATA_REG_LBA2, (uint8_t)((lba >> 16) & 0xFF));
-	outb(ATA_IO_BASE + ATA_REG_COMMAND, ATA_CMD_WRITE_SECTORS);
+static void ata_lock(void) {
+	for (;;) {
+		uint32_t f = irq_save();
+		if (!g_busy) {
+			g_busy = 1;
+			irq_restore(f);
+			return;
+		}
+		irq_restore(f);
+		yield();
+	}
+}
+
+static void ata_unlock(void) {
+	g_busy = 0;
+}
+
+static void ata_irq(int_frame_t* f) {
+	(void)f;
+	// reading status acknowledges the drive, PIO commands land here too
+	(void)inb(ATA_IO_BASE + ATA_REG_STATUS);
+	if (!g_bm_base) return;
+
+	uint8_t bm = inb(g_bm_base + BM_REG_STATUS);
+	if (!(bm & BM_SR_IRQ)) return;
+	outb(g_bm_base + BM_REG_STATUS, BM_SR_IRQ | BM_SR_ERR);	// write 1 to clear
+
+	g_dma_status = bm;
+	g_dma_done = 1;
+
+	task_t* t = g_dma_waiter;
+	if (t) {
+		g_dma_waiter = 0;
+		sched_wake(t);
+	}
+}
+
+// no paging, so buffer addresses are physical already
+static int build_prdt(uintptr_t addr, uint32_t bytes) {
+	if (addr & 1u) return 0;
+
+	uint32_t n = 0;
+	while (bytes > 0) {
+		if (n == ATA_PRD_MAX) return 0;
+		uint32_t room = 0x10000u - (addr & 0xFFFFu);
+		uint32_t len = (bytes < room) ? bytes : room;
 
-	if (ata_wait_drq() != 0) return 4;
+		g_prdt[n].addr = (uint32_t)addr;
+		g_prdt[n].bytes = (uint16_t)(len & 0xFFFF);
+		g_prdt[n].flags = 0;
 
-	for (int i = 0; i < 256; i++) {
-		uint16_t w = (uint16_t)in512[i * 2 + 0] | ((uint16_t)in512[i * 2 + 1] << 8);
-		outw(ATA_IO_BASE + ATA_REG_DATA, w);
+		addr += len;
+		bytes -= len;
+		n++;
 	}
+	g_prdt[n - 1].flags = PRD_EOT;
+	return 1;
+}
+
+// one command of at most 256 sectors. 1 means the buffer cannot be used
+// for DMA, anything above that is a controller or drive error
+static int ata_dma_xfer(uint32_t lba, uint32_t n, uint8_t* buf, int write) {
+	if (!build_prdt((uintptr_t)buf, n * ATA_SECTOR_SIZE)) return 1;
+	if (ata_wait_not_busy() != 0) return 3;
+
+	uint8_t dir = write ? 0 : BM_CMD_READ;
+	outb(g_bm_base + BM_REG_CMD, 0);
+	outl(g_bm_base + BM_REG_PRDT, (uint32_t)(uintptr_t)g_prdt);
+	outb(g_bm_base + BM_REG_STATUS, BM_SR_IRQ | BM_SR_ERR);
+	outb(g_bm_base + BM_REG_CMD, dir);
+
+	// sleep on IRQ14 when there is a task to put to sleep, otherwise
+	// (boot, interrupts off) poll the bus master status
+	uint32_t f = irq_save();
+	task_t* self = task_at(task_current_id());
+	int can_sleep = (f & 0x200u) && self && !irq_in_handler();
 
-	// Flush cache
-	outb(ATA_IO_BASE + ATA_REG_COMMAND, 0xE7);
+	g_dma_done = 0;
+	ata_issue(lba, n, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+	outb(g_bm_base + BM_REG_CMD, dir | BM_CMD_START);
 
-	if (ata_wait_not_busy() != 0) return 5;
+	if (can_sleep) {
+		g_dma_waiter = self;
+		sched_sleep_until(self, pit_ticks() + pit_ms_to_ticks(ATA_DMA_TIMEOUT_MS));
+		schedule();
+		g_dma_waiter = 0;
+	}
+	irq_restore(f);
+
+	for (int i = 0; !g_dma_done && i < ATA_DMA_POLL_SPINS; i++) {
+		uint8_t bm = inb(g_bm_base + BM_REG_STATUS);
+		if (bm & BM_SR_IRQ) {
+			outb(g_bm_base + BM_REG_STATUS, BM_SR_IRQ | BM_SR_ERR);
+			g_dma_status = bm;
+			g_dma_done = 1;
+		}
+	}
+
+	outb(g_bm_base + BM_REG_CMD, 0);
+	if (!g_dma_done) return 6;
+	if (g_dma_status & BM_SR_ERR) return 7;
+	if (ata_wait_done() != 0) return 5;
 	return 0;
 }
+
+// after a failed DMA command the drive may still be busy with it, stop the
+// engine and reset the channel before PIO takes over
+static void ata_reset_channel(void) {
+	outb(g_bm_base + BM_REG_CMD, 0);
+	outb(g_bm_base + BM_REG_STATUS, BM_SR_IRQ | BM_SR_ERR);
+
+	outb(ATA_CTL_BASE, ATA_CTL_SRST);
+	for (int i = 0; i < 16; i++) io_wait_400ns();	// SRST held at least 5 us
+	outb(ATA_CTL_BASE, 0);
+	for (int i = 0; i < 16; i++) io_wait_400ns();
+	(void)ata_wait_not_busy();
+}
+
+static int ata_xfer(uint32_t lba, uint32_t count, uint8_t* buf, int write) {
+	if (!buf) return 1;
+	if (ata_check_range(lba, count) != 0) return 2;
+
+	ata_lock();
+	int rc = 0;
+	while (count > 0 && rc == 0) {
+		uint32_t n = (count > ATA_MAX_SECTORS_PER_CMD) ? ATA_MAX_SECTORS_PER_CMD : count;
+
+		uint64_t t0 = cpu_rdtsc();
+		int dma_rc = g_dma ? ata_dma_xfer(lba, n, buf, write) : 1;
+		if (dma_rc == 0) {
+			trace_disk(lba, n, TRACE_DISK_DMA | (write ? TRACE_DISK_WRITE : 0), t0);
+		} else {
+			// a real failure turns DMA off for good, PIO carries on
+			if (dma_rc > 1) {
+				g_dma = 0;
+				ata_reset_channel();
+			}
+			rc = write ? ata_pio_write28_n(lba, n, buf) : ata_pio_read28_n(lba, n, buf);
+		}
+
+		lba += n;
+		count -= n;
+		buf += n * ATA_SECTOR_SIZE;
+	}
+	ata_unlock();
+	return rc;
+}
+
+int ata_read28_n(uint32_t lba, uint32_t count, uint8_t* out) {
+	return ata_xfer(lba, count, out, 0);
+}
+
+int ata_write28_n(uint32_t lba, uint32_t count, const uint8_t* in) {
+	// the buffer is only read, the cast is for the shared path
+	return ata_xfer(lba, count, (uint8_t*)in, 1);
+}
+
+int ata_sync(void) {
+	ata_lock();
+	int rc = ata_flush();
+	ata_unlock();
+	return rc;
+}
+
+void ata_init(void) {
+	irq_set_handler(ATA_IRQ, ata_irq);
+	pic_unmask(ATA_IRQ);
+	outb(ATA_CTL_BASE, 0);	// nIEN clear, let the drive interrupt
+
+	pci_device_t d;
+	if (!pci_find_class(0x01, 0x01, &d)) return;
+
+	// the primary channel has to be at the legacy ports and IRQ14, and the
+	// controller has to do bus mastering at all
+	if (d.prog_if & 0x01) return;
+	if (!(d.prog_if & 0x80)) return;
+
+	uint32_t bar4 = pci_read32(d.bus, d.dev, d.fn, PCI_REG_BAR4);
+	if (!(bar4 & 0x01)) return;
+
+	uint16_t cmd = pci_read16(d.bus, d.dev, d.fn, PCI_REG_COMMAND);
+	pci_write16(d.bus, d.dev, d.fn, PCI_REG_COMMAND, (uint16_t)(cmd | PCI_CMD_IO | PCI_CMD_BUS_MASTER));
+
+	g_prdt = (ata_prd_t*)pmm_alloc_frames(1);
+	if (!g_prdt) return;
+
+	g_bm_base = (uint16_t)(bar4 & 0xFFFC);
+	g_dma = 1;
+}
+
+int ata_dma_active(void) {
+	return g_dma;
+}
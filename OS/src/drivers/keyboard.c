@@ -1,6 +1,11 @@
 #include <stdint.h>
 #include "arsc/i386/ports.h"
+#include "arsc/i386/cpu.h"
+#include "arsc/i386/idt.h"
+#include "arsc/i386/pic.h"
 #include "drivers/keyboard.h"
+#include "kernel/sched.h"
+#include "kernel/task.h"
 
 static const char scancode_to_ascii[128] = {
 	0, 27, '1','2','3','4','5','6','7','8','9','0','-','=','\b',
@@ -26,11 +31,42 @@ static const char scancode_to_ascii_shift[128] = {
 
 static int shift_down = 0;
 
-int keyboard_try_get_key(key_event_t* ev) {
-	static int e0 = 0;
+// single producer (IRQ1) / single consumer ring. the producer only moves
+// head and the consumer only moves tail, so neither side needs a lock
+#define KBD_RING_SIZE 64	// power of two
+#define KBD_RING_MASK (KBD_RING_SIZE - 1)
 
-	if ((inb(0x64) & 0x01) == 0) return 0;
-	uint8_t sc = inb(0x60);
+static key_event_t g_ring[KBD_RING_SIZE];
+static volatile uint32_t g_head = 0;
+static volatile uint32_t g_tail = 0;
+static uint32_t g_dropped = 0;
+
+// task parked in keyboard_get_key, if any
+static task_t* volatile g_waiter = 0;
+
+static int ring_push(const key_event_t* ev) {
+	uint32_t head = g_head;
+	if (head - g_tail == KBD_RING_SIZE) {
+		g_dropped++;
+		return 0;
+	}
+	g_ring[head & KBD_RING_MASK] = *ev;
+	__asm__ volatile("" ::: "memory");	// slot is written before head moves
+	g_head = head + 1;
+	return 1;
+}
+
+static int ring_pop(key_event_t* ev) {
+	uint32_t tail = g_tail;
+	if (tail == g_head) return 0;
+	__asm__ volatile("" ::: "memory");
+	*ev = g_ring[tail & KBD_RING_MASK];
+	g_tail = tail + 1;
+	return 1;
+}
+
+static int decode_key(uint8_t sc, key_event_t* ev) {
+	static int e0 = 0;
 
 	if (sc == 0xE0) { e0 = 1; return 0; }
 
@@ -76,3 +112,63 @@ int keyboard_try_get_key(key_event_t* ev) {
 	return 1;
 }
 
+static void keyboard_irq(int_frame_t* f) {
+	(void)f;
+	if ((inb(0x64) & 0x01) == 0) return;
+	uint8_t sc = inb(0x60);
+
+	key_event_t ev = { KEY_NONE, 0 };
+	if (!decode_key(sc, &ev)) return;
+	if (!ring_push(&ev)) return;
+
+	// hand the key straight to a blocked reader, it is interactive
+	task_t* t = g_waiter;
+	if (t) {
+		g_waiter = 0;
+		sched_wake(t);
+		sched_boost(t);
+	}
+}
+
+void keyboard_init(void) {
+	g_head = g_tail = 0;
+	g_waiter = 0;
+
+	// drop anything the controller buffered before we took over
+	while (inb(0x64) & 0x01) (void)inb(0x60);
+
+	irq_set_handler(1, keyboard_irq);
+	pic_unmask(1);
+}
+
+int keyboard_try_get_key(key_event_t* ev) {
+	if (!ring_pop(ev)) return 0;
+
+	// whoever is reading input is interactive
+	sched_boost(task_at(task_current_id()));
+	return 1;
+}
+
+void keyboard_get_key(key_event_t* ev) {
+	task_t* self = task_at(task_current_id());
+
+	for (;;) {
+		// check and block with interrupts off so the IRQ cannot slip a
+		// key in between and leave us asleep
+		uint32_t f = irq_save();
+		if (ring_pop(ev)) {
+			irq_restore(f);
+			sched_boost(self);
+			return;
+		}
+		g_waiter = self;
+		sched_block(self);
+		schedule();
+		irq_restore(f);
+	}
+}
+
+uint32_t keyboard_dropped(void) {
+	return g_dropped;
+}
+
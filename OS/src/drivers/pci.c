@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include "drivers/pci.h"
+#include "arsc/i386/ports.h"
+
+// configuration mechanism #1
+#define PCI_CONFIG_ADDR 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+static uint32_t config_addr(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+	return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)(dev & 0x1F) << 11) |
+	       ((uint32_t)(fn & 0x07) << 8) | (off & 0xFC);
+}
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+	outl(PCI_CONFIG_ADDR, config_addr(bus, dev, fn, off));
+	return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint32_t v) {
+	outl(PCI_CONFIG_ADDR, config_addr(bus, dev, fn, off));
+	outl(PCI_CONFIG_DATA, v);
+}
+
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off) {
+	uint32_t v = pci_read32(bus, dev, fn, off);
+	return (uint16_t)(v >> ((off & 2u) * 8u));
+}
+
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t off, uint16_t v) {
+	uint32_t old = pci_read32(bus, dev, fn, off);
+	uint32_t shift = (off & 2u) * 8u;
+	old &= ~(0xFFFFu << shift);
+	old |= (uint32_t)v << shift;
+	pci_write32(bus, dev, fn, off, old);
+}
+
+int pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* out) {
+	for (uint32_t bus = 0; bus < 256; bus++) {
+		for (uint8_t dev = 0; dev < 32; dev++) {
+			for (uint8_t fn = 0; fn < 8; fn++) {
+				uint32_t id = pci_read32((uint8_t)bus, dev, fn, PCI_REG_VENDOR);
+				if ((id & 0xFFFF) == 0xFFFF) {
+					if (fn == 0) break;	// no device in this slot
+					continue;
+				}
+
+				uint32_t cls = pci_read32((uint8_t)bus, dev, fn, PCI_REG_CLASS);
+				if ((uint8_t)(cls >> 24) == class_code && (uint8_t)(cls >> 16) == subclass) {
+					if (out) {
+						out->bus = (uint8_t)bus;
+						out->dev = dev;
+						out->fn = fn;
+						out->class_code = class_code;
+						out->subclass = subclass;
+						out->prog_if = (uint8_t)(cls >> 8);
+						out->vendor = (uint16_t)(id & 0xFFFF);
+						out->device = (uint16_t)(id >> 16);
+					}
+					return 1;
+				}
+
+				// single function device, skip the other functions
+				if (fn == 0) {
+					uint32_t hdr = pci_read32((uint8_t)bus, dev, 0, PCI_REG_HEADER);
+					if (((hdr >> 16) & 0x80) == 0) break;
+				}
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdint.h>
+#include "drivers/pit.h"
+#include "arsc/i386/ports.h"
+#include "arsc/i386/idt.h"
+#include "arsc/i386/pic.h"
+#include "kernel/sched.h"
+#include "arsc/i386/cpu.h"
+#include "lib/div64.h"
+
+#define PIT_BASE_HZ	1193182u
+#define PIT_CH0		0x40
+#define PIT_CMD		0x43
+#define PIT_MODE_RATE	0x34	// channel 0, lo/hi byte, mode 2
+#define PIT_MODE_ONESHOT 0x30	// channel 0, lo/hi byte, mode 0
+#define PIT_LATCH_CH0	0x00
+#define PIT_CAL_TICKS	128	// ticks the TSC is measured over
+
+typedef enum {
+	PIT_PERIODIC = 0,
+	PIT_ONESHOT,
+	PIT_STOPPED
+} pit_mode_t;
+
+static volatile uint32_t g_ticks = 0;
+static uint32_t g_hz = PIT_HZ;
+static uint32_t g_div = PIT_BASE_HZ / PIT_HZ;
+
+static pit_mode_t g_mode = PIT_PERIODIC;
+static uint32_t g_oneshot_counts = 0;	// what the one-shot was loaded with
+static uint32_t g_frac_counts = 0;	// leftover below one tick
+
+// the PIT says nothing while stopped, so the TSC measures the gap. the
+// rate is measured against the first ticks after boot, until then idle
+// only ever takes one-shot hops
+static uint32_t g_tsc_per_tick = 0;
+static uint32_t g_cal_ticks = 0;
+static uint64_t g_cal_tsc = 0;
+static uint64_t g_stop_tsc = 0;
+static uint64_t g_frac_cycles = 0;
+
+static void program(uint8_t mode, uint32_t count) {
+	outb(PIT_CMD, mode);
+	outb(PIT_CH0, (uint8_t)(count & 0xFF));
+	outb(PIT_CH0, (uint8_t)((count >> 8) & 0xFF));
+}
+
+static uint32_t read_count(void) {
+	outb(PIT_CMD, PIT_LATCH_CH0);
+	uint32_t lo = inb(PIT_CH0);
+	uint32_t hi = inb(PIT_CH0);
+	return (hi << 8) | lo;
+}
+
+static void account_counts(uint32_t counts) {
+	counts += g_frac_counts;
+	g_ticks += counts / g_div;
+	g_frac_counts = counts % g_div;
+}
+
+// one-shot ticks are counted exactly too, so any run of them will do
+static void calibrate_tick(void) {
+	if (g_cal_tsc == 0) {
+		g_cal_tsc = cpu_rdtsc();
+		g_cal_ticks = g_ticks;
+		return;
+	}
+	uint32_t n = g_ticks - g_cal_ticks;
+	if (n >= PIT_CAL_TICKS) g_tsc_per_tick = (uint32_t)udiv64(cpu_rdtsc() - g_cal_tsc, n, 0);
+}
+
+static void pit_irq(int_frame_t* f) {
+	(void)f;
+	if (g_mode == PIT_ONESHOT) {
+		account_counts(g_oneshot_counts);
+		g_mode = PIT_PERIODIC;
+		program(PIT_MODE_RATE, g_div);
+	} else {
+		g_ticks++;
+	}
+	if (!g_tsc_per_tick) calibrate_tick();
+	sched_tick(g_ticks);
+}
+
+void pit_init(uint32_t hz) {
+	if (hz == 0) hz = PIT_HZ;
+	g_hz = hz;
+
+	uint32_t div = PIT_BASE_HZ / hz;
+	if (div == 0) div = 1;
+	if (div > 0xFFFF) div = 0xFFFF;
+	g_div = div;
+
+	g_mode = PIT_PERIODIC;
+	program(PIT_MODE_RATE, g_div);
+
+	irq_set_handler(0, pit_irq);
+	pic_unmask(0);
+}
+
+uint32_t pit_ticks(void) {
+	return g_ticks;
+}
+
+uint32_t pit_ms_to_ticks(uint32_t ms) {
+	// split to stay clear of 32-bit overflow for long sleeps
+	uint32_t t = (ms / 1000u) * g_hz + ((ms % 1000u) * g_hz + 999u) / 1000u;
+	return t ? t : 1u;
+}
+
+void pit_enter_tickless(uint32_t ticks) {
+	if (g_mode != PIT_PERIODIC || ticks <= 1) return;
+
+	if (ticks == PIT_NO_DEADLINE && g_tsc_per_tick) {
+		// nothing is due at all, only another IRQ can wake us
+		pic_mask(0);
+		g_stop_tsc = cpu_rdtsc();
+		g_mode = PIT_STOPPED;
+		return;
+	}
+
+	// the counter is 16 bits, longer waits take several hops
+	uint32_t max_ticks = 0xFFFFu / g_div;
+	if (ticks > max_ticks) ticks = max_ticks;
+	if (ticks <= 1) return;
+
+	g_oneshot_counts = ticks * g_div;
+	g_mode = PIT_ONESHOT;
+	program(PIT_MODE_ONESHOT, g_oneshot_counts);
+}
+
+void pit_exit_tickless(void) {
+	if (g_mode == PIT_ONESHOT) {
+		// woken early by some other interrupt, keep the time we slept
+		uint32_t left = read_count();
+		if (left > g_oneshot_counts) left = g_oneshot_counts;
+		account_counts(g_oneshot_counts - left);
+	} else if (g_mode == PIT_STOPPED) {
+		// catch up on the ticks that never fired
+		uint64_t missed = udiv64(cpu_rdtsc() - g_stop_tsc + g_frac_cycles, g_tsc_per_tick, &g_frac_cycles);
+		g_ticks += (uint32_t)missed;
+		pic_unmask(0);
+	} else {
+		return;
+	}
+
+	g_mode = PIT_PERIODIC;
+	program(PIT_MODE_RATE, g_div);
+}
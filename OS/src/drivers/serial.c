@@ -0,0 +1,112 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "drivers/serial.h"
+#include "arsc/i386/ports.h"
+#include "arsc/i386/cpu.h"
+#include "arsc/i386/idt.h"
+#include "arsc/i386/pic.h"
+
+#define COM1_BASE 0x3F8
+#define COM1_IRQ 4
+
+#define UART_DATA 0	// THR/RBR, divisor low with DLAB
+#define UART_IER  1	// divisor high with DLAB
+#define UART_FCR  2	// IIR on read
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+
+#define UART_IER_THRE 0x02
+#define UART_LSR_THRE 0x20
+#define UART_FIFO_DEPTH 16
+
+// filled by writers, emptied by the IRQ. both sides touch it only with
+// interrupts off, so plain indices are enough
+#define SERIAL_RING_SIZE 4096	// power of two
+#define SERIAL_RING_MASK (SERIAL_RING_SIZE - 1)
+
+static uint8_t g_ring[SERIAL_RING_SIZE];
+static uint32_t g_head = 0;
+static uint32_t g_tail = 0;
+static int g_present = 0;
+static int g_tx_irq = 0;	// THRE interrupt enabled
+static uint32_t g_sent = 0;
+
+// interrupts are off
+static void tx_fill(void) {
+	if (!(inb(COM1_BASE + UART_LSR) & UART_LSR_THRE)) return;
+	for (int i = 0; i < UART_FIFO_DEPTH && g_tail != g_head; i++) {
+		outb(COM1_BASE + UART_DATA, g_ring[g_tail++ & SERIAL_RING_MASK]);
+		g_sent++;
+	}
+}
+
+static void tx_irq_set(int on) {
+	if (g_tx_irq == on) return;
+	g_tx_irq = on;
+	outb(COM1_BASE + UART_IER, on ? UART_IER_THRE : 0);
+}
+
+static void serial_irq(int_frame_t* f) {
+	(void)f;
+	(void)inb(COM1_BASE + UART_FCR);	// IIR, acknowledges THRE
+	tx_fill();
+	if (g_tail == g_head) tx_irq_set(0);
+}
+
+void serial_init(void) {
+	outb(COM1_BASE + UART_IER, 0);
+	outb(COM1_BASE + UART_LCR, 0x80);	// DLAB
+	outb(COM1_BASE + UART_DATA, 1);		// 115200 baud
+	outb(COM1_BASE + UART_IER, 0);
+	outb(COM1_BASE + UART_LCR, 0x03);	// 8N1
+	outb(COM1_BASE + UART_FCR, 0xC7);	// FIFOs on and cleared
+
+	// loopback: a missing UART does not echo
+	outb(COM1_BASE + UART_MCR, 0x1E);
+	outb(COM1_BASE + UART_DATA, 0xAE);
+	if (inb(COM1_BASE + UART_DATA) != 0xAE) return;
+
+	outb(COM1_BASE + UART_MCR, 0x0B);	// DTR, RTS, OUT2 gates the IRQ
+	g_present = 1;
+	irq_set_handler(COM1_IRQ, serial_irq);
+	pic_unmask(COM1_IRQ);
+}
+
+int serial_present(void) {
+	return g_present;
+}
+
+// a full queue never drops a byte. a writer that had interrupts on lets
+// the IRQ make room, one that had them off polls the UART itself
+static void queue_byte(uint8_t c, uint32_t* f) {
+	while (g_head - g_tail == SERIAL_RING_SIZE) {
+		if (*f & 0x200u) {
+			tx_irq_set(1);
+			irq_restore(*f);
+			__asm__ volatile ("pause");
+			*f = irq_save();
+		} else {
+			tx_fill();
+		}
+	}
+	g_ring[g_head++ & SERIAL_RING_MASK] = c;
+}
+
+void serial_write(const char* s, size_t len) {
+	if (!g_present) return;
+
+	uint32_t f = irq_save();
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '\n') queue_byte('\r', &f);
+		queue_byte((uint8_t)s[i], &f);
+	}
+	// an idle transmitter gets the first bytes now, the IRQ sends the rest
+	tx_fill();
+	tx_irq_set(g_tail != g_head);
+	irq_restore(f);
+}
+
+uint32_t serial_bytes_sent(void) {
+	return g_sent;
+}
@@ -9,20 +9,54 @@ static size_t g_cursor_row = 0; // row in scrollback buffer
 static size_t g_cursor_col = 0;
 static uint8_t term_color = 0x0F;
 
+// the scrollback is a ring: logical row 0 is the oldest line and lives in
+// physical row g_ring_head, so a newline on a full buffer just moves the
+// head instead of shifting every row up
 static uint16_t g_textbuf[SCROLLBACK_ROWS][TEXT_WIDTH];
+static size_t g_ring_head = 0;
 static size_t g_head_row = 0; // row being written
 static size_t g_view_top = 0; // row currently displayed
 static int g_follow_tail = 1; // if 1, view tracks newest output
 
+// output lands in g_textbuf and marks its view row; a flush copies only
+// the marked rows to VGA memory and touches the scrollbar and cursor
+// ports only when they moved. writes inside a batch flush once at the end
+static uint32_t g_dirty_rows = 0;
+static int g_dirty_all = 0;
+static int g_batch = 0;
+static terminal_sink_t g_sink = 0;
+static terminal_mirror_t g_mirror = 0;
+static size_t g_marker_row = TERM_HEIGHT; // drawn scrollbar marker, none yet
+static uint16_t g_hw_cursor = 0xFFFF;
+
 static inline uint16_t vga_entry(char c, uint8_t color) {
 	return (uint16_t)c | ((uint16_t)color << 8);
 }
 
+static inline uint16_t* text_row(size_t row) {
+	size_t p = g_ring_head + row;
+	if (p >= SCROLLBACK_ROWS) p -= SCROLLBACK_ROWS;
+	return g_textbuf[p];
+}
+
+static void mark_row(size_t row) {
+	if (row < g_view_top || row - g_view_top >= TERM_HEIGHT) return;
+	g_dirty_rows |= 1u << (row - g_view_top);
+}
+
+static void set_view_top(size_t top) {
+	if (top == g_view_top) return;
+	g_view_top = top;
+	g_dirty_all = 1;
+}
+
 static void clear_textbuf_row(size_t row) {
 	if (row >= SCROLLBACK_ROWS) return;
+	uint16_t* cells = text_row(row);
 	for (size_t c = 0; c < TEXT_WIDTH; c++) {
-		g_textbuf[row][c] = vga_entry(' ', term_color);
+		cells[c] = vga_entry(' ', term_color);
 	}
+	mark_row(row);
 }
 
 static void sync_hw_cursor(void) {
@@ -43,23 +77,22 @@ static void advance_to_next_line(void) {
 		g_cursor_row++;
 		clear_textbuf_row(g_cursor_row);
 	} else {
-		// shift scrollback up by one row
-		for (size_t r = 1; r < SCROLLBACK_ROWS; r++) {
-			for (size_t c = 0; c < TEXT_WIDTH; c++) {
-				g_textbuf[r - 1][c] = g_textbuf[r][c];
-			}
-		}
-		clear_textbuf_row(SCROLLBACK_ROWS - 1);
+		// drop the oldest row and reuse it as the new last one
+		g_ring_head = (g_ring_head + 1 == SCROLLBACK_ROWS) ? 0 : g_ring_head + 1;
 		// cursor stays on last row
 		g_cursor_row = SCROLLBACK_ROWS - 1;
 
+		// logical rows all moved up one; a view that can follow them keeps
+		// showing the same lines, one pinned at the top does not
 		if (g_view_top > 0) g_view_top--;
+		else g_dirty_all = 1;
+		clear_textbuf_row(SCROLLBACK_ROWS - 1);
 	}
 
 	if (g_follow_tail) {
-		g_view_top = (g_cursor_row >= (TERM_HEIGHT - 1))
+		set_view_top((g_cursor_row >= (TERM_HEIGHT - 1))
 			? (g_cursor_row - (TERM_HEIGHT - 1))
-			: 0;
+			: 0);
 	}
 }
 
@@ -75,29 +108,79 @@ size_t terminal_get_col(void) { return g_cursor_col; }
 size_t terminal_get_buffer_row(void) { return g_cursor_row; }
 size_t terminal_get_view_top(void) { return g_view_top; }
 
-static void render_text_window(void) {
-	for (size_t vr = 0; vr < TERM_HEIGHT; vr++) {
-		size_t src = g_view_top + vr;
-		for (size_t c = 0; c < TEXT_WIDTH; c++) {
-			char ch = ' ';
-			if (src < SCROLLBACK_ROWS) {
-				ch = (char)(g_textbuf[src][c] & 0xFF);
-			}
-			VGA_MEMORY[vr * VGA_WIDTH + c] = vga_entry(ch, term_color);
+static void copy_row(size_t vr) {
+	size_t src = g_view_top + vr;
+	for (size_t c = 0; c < TEXT_WIDTH; c++) {
+		char ch = ' ';
+		if (src < SCROLLBACK_ROWS) {
+			ch = (char)(text_row(src)[c] & 0xFF);
 		}
-		// clear scroll bar col for this row
-		VGA_MEMORY[vr * VGA_WIDTH + SCROLLBAR_COL] = vga_entry(' ', term_color);
+		VGA_MEMORY[vr * VGA_WIDTH + c] = vga_entry(ch, term_color);
 	}
+}
 
-	// draw  scroll bar
+static void draw_scrollbar(int force) {
 	size_t max_top = (g_head_row >= TERM_HEIGHT) ? (g_head_row - TERM_HEIGHT + 1) : 0;
 	size_t marker_row = 0;
 	if (max_top > 0) marker_row = (g_view_top * TERM_HEIGHT) / (max_top + 1);
 	if (marker_row >= TERM_HEIGHT) marker_row = TERM_HEIGHT - 1;
+	if (!force && marker_row == g_marker_row) return;
+
+	if (force) {
+		for (size_t vr = 0; vr < TERM_HEIGHT; vr++) {
+			VGA_MEMORY[vr * VGA_WIDTH + SCROLLBAR_COL] = vga_entry(' ', term_color);
+		}
+	} else if (g_marker_row < TERM_HEIGHT) {
+		VGA_MEMORY[g_marker_row * VGA_WIDTH + SCROLLBAR_COL] = vga_entry(' ', term_color);
+	}
 	VGA_MEMORY[marker_row * VGA_WIDTH + SCROLLBAR_COL] = vga_entry('|', term_color);
+	g_marker_row = marker_row;
+}
+
+static void render_text_window(void) {
+	for (size_t vr = 0; vr < TERM_HEIGHT; vr++) copy_row(vr);
+	g_dirty_rows = 0;
+	g_dirty_all = 0;
+
+	draw_scrollbar(1);
 	sync_hw_cursor();
 }
 
+static void terminal_flush(void) {
+	if (g_dirty_all) {
+		render_text_window();
+		return;
+	}
+
+	while (g_dirty_rows) {
+		size_t vr = (size_t)__builtin_ctz(g_dirty_rows);
+		g_dirty_rows &= g_dirty_rows - 1;
+		copy_row(vr);
+	}
+	draw_scrollbar(0);
+	sync_hw_cursor();
+}
+
+void terminal_set_sink(terminal_sink_t sink) {
+	g_sink = sink;
+}
+
+void terminal_set_mirror(terminal_mirror_t mirror) {
+	g_mirror = mirror;
+}
+
+// captured output never reaches the screen, so it must not hold up the
+// flush of everyone else's either
+void terminal_batch_begin(void) {
+	if (g_sink && g_sink(0, 0)) return;
+	g_batch++;
+}
+
+void terminal_batch_end(void) {
+	if (g_sink && g_sink(0, 0)) return;
+	if (g_batch > 0 && --g_batch == 0) terminal_flush();
+}
+
 void terminal_set_cursor_pos(size_t row, size_t col) {
 	if (row >= TERM_HEIGHT) row = TERM_HEIGHT - 1;
 	if (col >= TEXT_WIDTH) col = TEXT_WIDTH - 1;
@@ -115,14 +198,12 @@ void terminal_ensure_row_visible(size_t row) {
 	if (row < g_view_top) {
 		g_view_top = row;
 		render_text_window();
-		sync_hw_cursor();
 		return;
 	}
 
 	if (row >= g_view_top + TERM_HEIGHT) {
 		g_view_top = row - (TERM_HEIGHT - 1);
 		render_text_window();
-		sync_hw_cursor();
 		return;
 	}
 }
@@ -131,7 +212,6 @@ void terminal_scroll_view_up(void) {
 	if (g_view_top > 0) g_view_top--;
 	g_follow_tail = 0;
 	render_text_window();
-	sync_hw_cursor();
 }
 
 void terminal_scroll_view_down(void) {
@@ -139,14 +219,12 @@ void terminal_scroll_view_down(void) {
 	if (g_view_top < max_top) g_view_top++;
 	if (g_view_top == max_top) g_follow_tail = 1;
 	render_text_window();
-	sync_hw_cursor();
 }
 
 void terminal_follow_tail(void) {
 	g_view_top = (g_head_row >= TERM_HEIGHT) ? (g_head_row - TERM_HEIGHT + 1) : 0;
 	g_follow_tail = 1;
 	render_text_window();
-	sync_hw_cursor();
 }
 
 int terminal_is_following_tail(void) {
@@ -160,6 +238,7 @@ void terminal_clear(void) {
 		}
 	}
 
+	g_ring_head = 0;
 	for (size_t r = 0; r < SCROLLBACK_ROWS; r++) {
 		clear_textbuf_row(r);
 	}
@@ -171,7 +250,6 @@ void terminal_clear(void) {
 	g_follow_tail = 1;
 
 	render_text_window();
-	sync_hw_cursor();
 }
 
 void terminal_clear_row(size_t row) {
@@ -179,8 +257,7 @@ void terminal_clear_row(size_t row) {
 		size_t abs = g_view_top + row;
 		if (abs < SCROLLBACK_ROWS) {
 			clear_textbuf_row(abs);
-			render_text_window();
-			sync_hw_cursor();
+			if (!g_batch) terminal_flush();
 		}
 	} else {
 		// overlay rows draw direct to VGA
@@ -191,6 +268,7 @@ void terminal_clear_row(size_t row) {
 }
 
 void terminal_clear_text_area(void) {
+	g_ring_head = 0;
 	for (size_t r = 0; r < SCROLLBACK_ROWS; r++) {
 		clear_textbuf_row(r);
 	}
@@ -202,23 +280,20 @@ void terminal_clear_text_area(void) {
 	g_follow_tail = 1;
 
 	render_text_window();
-	sync_hw_cursor();
 }
 
 static void terminal_newline(void) {
 	while (g_cursor_col < TEXT_WIDTH) {
-		g_textbuf[g_cursor_row][g_cursor_col] = vga_entry(' ', term_color);
+		text_row(g_cursor_row)[g_cursor_col] = vga_entry(' ', term_color);
 		g_cursor_col++;
 	}
+	mark_row(g_cursor_row);
 
 	advance_to_next_line();
 	g_head_row = g_cursor_row;
-
-	render_text_window();
-	sync_hw_cursor();
 }
 
-void terminal_putc(char c) {
+static void emit(char c) {
 	if (c == '\n') {
 		terminal_newline();
 		return;
@@ -229,7 +304,8 @@ void terminal_putc(char c) {
 		terminal_newline();
 	}
 
-	g_textbuf[g_cursor_row][g_cursor_col] = vga_entry(c, term_color);
+	text_row(g_cursor_row)[g_cursor_col] = vga_entry(c, term_color);
+	mark_row(g_cursor_row);
 	g_cursor_col++;
 
 	if (g_cursor_col >= TEXT_WIDTH) {
@@ -237,15 +313,20 @@ void terminal_putc(char c) {
 	} else {
 		g_head_row = g_cursor_row;
 		if (g_follow_tail) {
-			g_view_top = (g_cursor_row >= (TERM_HEIGHT - 1))
+			set_view_top((g_cursor_row >= (TERM_HEIGHT - 1))
 				? (g_cursor_row - (TERM_HEIGHT - 1))
-				: 0;
+				: 0);
 		}
-		render_text_window();
-		sync_hw_cursor();
 	}
 }
 
+void terminal_putc(char c) {
+	if (g_sink && g_sink(&c, 1)) return;
+	if (g_mirror) g_mirror(&c, 1);
+	emit(c);
+	if (!g_batch) terminal_flush();
+}
+
 void terminal_putc_at(size_t row, size_t col, char c) {
 	if (row >= VGA_HEIGHT || col >= VGA_WIDTH) return;
 
@@ -254,7 +335,7 @@ void terminal_putc_at(size_t row, size_t col, char c) {
 		size_t abs = g_view_top + row;
 		if (abs >= SCROLLBACK_ROWS) return;
 
-		g_textbuf[abs][col] = vga_entry(c, term_color);
+		text_row(abs)[col] = vga_entry(c, term_color);
 		VGA_MEMORY[row * VGA_WIDTH + col] = vga_entry(c, term_color);
 	} else {
 		VGA_MEMORY[row * VGA_WIDTH + col] = vga_entry(c, term_color);
@@ -262,8 +343,48 @@ void terminal_putc_at(size_t row, size_t col, char c) {
 }
 
 void terminal_write(const char* s) {
+	if (g_sink || g_mirror) {
+		size_t len = 0;
+		while (s[len]) len++;
+		if (len && g_sink && g_sink(s, len)) return;
+		if (len && g_mirror) g_mirror(s, len);
+	}
 	for (size_t i = 0; s[i] != '\0'; i++) {
-		terminal_putc(s[i]);
+		emit(s[i]);
+	}
+	if (!g_batch) terminal_flush();
+}
+
+void terminal_write_u32(uint32_t v) {
+	char tmp[11];
+	int p = 0;
+	if (v == 0) tmp[p++] = '0';
+	while (v > 0) { tmp[p++] = (char)('0' + (v % 10)); v /= 10; }
+	if (g_sink || g_mirror) {
+		char out[11];
+		for (int i = 0; i < p; i++) out[i] = tmp[p - 1 - i];
+		if (g_sink && g_sink(out, (size_t)p)) return;
+		if (g_mirror) g_mirror(out, (size_t)p);
+	}
+	while (p > 0) emit(tmp[--p]);
+	if (!g_batch) terminal_flush();
+}
+
+// copies count text rows of the current view from src to dst, writing
+// VGA memory from the scrollback copy so it is never read back
+void terminal_move_rows(size_t dst, size_t src, size_t count) {
+	if (dst == src || count == 0) return;
+	if (dst + count > TERM_HEIGHT || src + count > TERM_HEIGHT) return;
+	if (g_view_top + TERM_HEIGHT > SCROLLBACK_ROWS) return;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t k = (dst < src) ? i : count - 1 - i;
+		uint16_t* to = text_row(g_view_top + dst + k);
+		const uint16_t* from = text_row(g_view_top + src + k);
+		for (size_t c = 0; c < TEXT_WIDTH; c++) {
+			to[c] = from[c];
+			VGA_MEMORY[(dst + k) * VGA_WIDTH + c] = from[c];
+		}
 	}
 }
 
@@ -291,7 +412,10 @@ void vga_cursor_set_pos(size_t row, size_t col) {
 	if (row >= VGA_HEIGHT) row = VGA_HEIGHT - 1;
 	if (col >= VGA_WIDTH)  col = VGA_WIDTH - 1;
 
+	// four port writes, skipped when nothing moved
 	uint16_t pos = (uint16_t)(row * VGA_WIDTH + col);
+	if (pos == g_hw_cursor) return;
+	g_hw_cursor = pos;
 	outb(0x3D4, 0x0F);
 	outb(0x3D5, (uint8_t)(pos & 0xFF));
 	outb(0x3D4, 0x0E);
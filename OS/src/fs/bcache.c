@@ -0,0 +1,277 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "fs/bcache.h"
+#include "drivers/ata.h"
+#include "mm/pmm.h"
+#include "lib/str.h"
+#include "arsc/i386/cpu.h"
+#include "kernel/sched.h"
+
+#define BCACHE_HASH 64		// power of two
+#define BCACHE_SYNC_BATCH 16	// sectors per write during sync
+#define BCACHE_NONE 0xFFFFFFFFu
+
+typedef struct bcache_buf {
+	uint32_t lba;
+	uint8_t valid;
+	uint8_t dirty;
+	uint8_t* data;
+	struct bcache_buf* hash_next;
+	struct bcache_buf* lru_prev;	// head is most recently used
+	struct bcache_buf* lru_next;
+} bcache_buf_t;
+
+static bcache_buf_t g_bufs[BCACHE_BUFS];
+static bcache_buf_t* g_hash[BCACHE_HASH];
+static bcache_buf_t* g_lru_head = 0;
+static bcache_buf_t* g_lru_tail = 0;
+
+static uint8_t* g_stage = 0;	// contiguous sectors for range writes
+static bcache_stats_t g_stats;
+static volatile int g_busy = 0;
+
+static void lock(void) {
+	for (;;) {
+		uint32_t f = irq_save();
+		if (!g_busy) {
+			g_busy = 1;
+			irq_restore(f);
+			return;
+		}
+		irq_restore(f);
+		yield();
+	}
+}
+
+static void unlock(void) {
+	g_busy = 0;
+}
+
+static inline uint32_t hash_of(uint32_t lba) {
+	return lba & (BCACHE_HASH - 1u);
+}
+
+static void lru_unlink(bcache_buf_t* b) {
+	if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+	else g_lru_head = b->lru_next;
+	if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+	else g_lru_tail = b->lru_prev;
+	b->lru_prev = b->lru_next = 0;
+}
+
+static void lru_push_front(bcache_buf_t* b) {
+	b->lru_prev = 0;
+	b->lru_next = g_lru_head;
+	if (g_lru_head) g_lru_head->lru_prev = b;
+	g_lru_head = b;
+	if (!g_lru_tail) g_lru_tail = b;
+}
+
+static void touch(bcache_buf_t* b) {
+	if (g_lru_head == b) return;
+	lru_unlink(b);
+	lru_push_front(b);
+}
+
+static bcache_buf_t* lookup(uint32_t lba) {
+	for (bcache_buf_t* b = g_hash[hash_of(lba)]; b; b = b->hash_next) {
+		if (b->valid && b->lba == lba) return b;
+	}
+	return 0;
+}
+
+static void hash_remove(bcache_buf_t* b) {
+	bcache_buf_t** pp = &g_hash[hash_of(b->lba)];
+	while (*pp && *pp != b) pp = &(*pp)->hash_next;
+	if (*pp) *pp = b->hash_next;
+	b->hash_next = 0;
+}
+
+static void hash_insert(bcache_buf_t* b) {
+	uint32_t h = hash_of(b->lba);
+	b->hash_next = g_hash[h];
+	g_hash[h] = b;
+}
+
+// least recently used buffer, written back first if it is dirty
+static bcache_buf_t* take_victim(void) {
+	bcache_buf_t* b = g_lru_tail;
+	if (!b) return 0;
+
+	if (b->valid) {
+		if (b->dirty) {
+			if (ata_write28_n(b->lba, 1, b->data) != 0) return 0;
+			b->dirty = 0;
+			g_stats.dirty--;
+			g_stats.writebacks++;
+		}
+		hash_remove(b);
+		b->valid = 0;
+		g_stats.cached--;
+		g_stats.evictions++;
+	}
+	return b;
+}
+
+static bcache_buf_t* install(uint32_t lba, const uint8_t* src) {
+	bcache_buf_t* b = take_victim();
+	if (!b) return 0;
+
+	kmemcpy(b->data, src, ATA_SECTOR_SIZE);
+	b->lba = lba;
+	b->valid = 1;
+	b->dirty = 0;
+	hash_insert(b);
+	touch(b);
+	g_stats.cached++;
+	return b;
+}
+
+void bcache_init(void) {
+	kmemset(&g_stats, 0, sizeof(g_stats));
+	for (int i = 0; i < BCACHE_HASH; i++) g_hash[i] = 0;
+	g_lru_head = g_lru_tail = 0;
+
+	size_t frames = (BCACHE_BUFS * ATA_SECTOR_SIZE) / PMM_FRAME_SIZE;
+	uint8_t* pool = (uint8_t*)pmm_alloc_frames(frames);
+	g_stage = (uint8_t*)pmm_alloc_frames((BCACHE_SYNC_BATCH * ATA_SECTOR_SIZE) / PMM_FRAME_SIZE);
+
+	for (int i = 0; i < BCACHE_BUFS; i++) {
+		bcache_buf_t* b = &g_bufs[i];
+		b->lba = BCACHE_NONE;
+		b->valid = 0;
+		b->dirty = 0;
+		b->hash_next = 0;
+		b->data = pool ? pool + (size_t)i * ATA_SECTOR_SIZE : 0;
+		b->lru_prev = b->lru_next = 0;
+		if (b->data) lru_push_front(b);
+	}
+}
+
+int bcache_read(uint32_t lba, uint32_t count, uint8_t* out) {
+	if (!out) return 1;
+	lock();
+
+	uint32_t i = 0;
+	while (i < count) {
+		bcache_buf_t* b = lookup(lba + i);
+		if (b) {
+			kmemcpy(out + i * ATA_SECTOR_SIZE, b->data, ATA_SECTOR_SIZE);
+			touch(b);
+			g_stats.hits++;
+			i++;
+			continue;
+		}
+
+		// read the whole run of misses in one request, then keep copies
+		uint32_t run = 1;
+		while (i + run < count && !lookup(lba + i + run)) run++;
+
+		uint8_t* dst = out + i * ATA_SECTOR_SIZE;
+		int rc = ata_read28_n(lba + i, run, dst);
+		if (rc != 0) {
+			unlock();
+			return rc;
+		}
+		for (uint32_t k = 0; k < run; k++) install(lba + i + k, dst + k * ATA_SECTOR_SIZE);
+		g_stats.misses += run;
+		i += run;
+	}
+
+	unlock();
+	return 0;
+}
+
+int bcache_write(uint32_t lba, uint32_t count, const uint8_t* in) {
+	if (!in) return 1;
+	lock();
+
+	for (uint32_t i = 0; i < count; i++) {
+		const uint8_t* src = in + i * ATA_SECTOR_SIZE;
+		g_stats.writes++;
+
+		bcache_buf_t* b = lookup(lba + i);
+		if (b) {
+			touch(b);
+			if (kmemcmp(b->data, src, ATA_SECTOR_SIZE) == 0) {
+				g_stats.writes_unchanged++;
+				continue;
+			}
+			kmemcpy(b->data, src, ATA_SECTOR_SIZE);
+		} else {
+			b = install(lba + i, src);
+			if (!b) {
+				// cache unusable, go straight to the disk
+				int rc = ata_write28_n(lba + i, 1, src);
+				if (rc != 0) {
+					unlock();
+					return rc;
+				}
+				g_stats.writebacks++;
+				continue;
+			}
+		}
+
+		if (!b->dirty) {
+			b->dirty = 1;
+			g_stats.dirty++;
+		}
+	}
+
+	unlock();
+	return 0;
+}
+
+int bcache_sync(void) {
+	lock();
+
+	// dirty buffers in LBA order so runs of neighbours go out together
+	static bcache_buf_t* dirty[BCACHE_BUFS];
+	uint32_t n = 0;
+	for (int i = 0; i < BCACHE_BUFS; i++) {
+		bcache_buf_t* b = &g_bufs[i];
+		if (!b->valid || !b->dirty) continue;
+
+		uint32_t j = n++;
+		while (j > 0 && dirty[j - 1]->lba > b->lba) {
+			dirty[j] = dirty[j - 1];
+			j--;
+		}
+		dirty[j] = b;
+	}
+
+	int rc = 0;
+	uint32_t i = 0;
+	while (i < n && rc == 0) {
+		uint32_t run = 1;
+		while (g_stage && i + run < n && run < BCACHE_SYNC_BATCH &&
+		       dirty[i + run]->lba == dirty[i]->lba + run) run++;
+
+		if (run == 1) {
+			rc = ata_write28_n(dirty[i]->lba, 1, dirty[i]->data);
+		} else {
+			for (uint32_t k = 0; k < run; k++) {
+				kmemcpy(g_stage + k * ATA_SECTOR_SIZE, dirty[i + k]->data, ATA_SECTOR_SIZE);
+			}
+			rc = ata_write28_n(dirty[i]->lba, run, g_stage);
+		}
+		if (rc != 0) break;
+
+		for (uint32_t k = 0; k < run; k++) dirty[i + k]->dirty = 0;
+		g_stats.dirty -= run;
+		g_stats.writebacks += run;
+		i += run;
+	}
+
+	if (rc == 0 && n > 0) rc = ata_sync();
+
+	unlock();
+	return rc;
+}
+
+void bcache_get_stats(bcache_stats_t* out) {
+	if (!out) return;
+	uint32_t f = irq_save();
+	*out = g_stats;
+	irq_restore(f);
+}
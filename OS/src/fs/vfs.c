@@ -4,15 +4,75 @@
 #include "mm/heap.h"
 #include "lib/str.h"
 #include "drivers/ata.h"
+#include "fs/bcache.h"
+#include "lib/crc32.h"
+#include "kernel/trace.h"
+#include "arsc/i386/cpu.h"
 
 #define VFS_LBA_BASE 2048u
 #define VFS_MAGIC 0x50534631u
 
-#define VFS_VERSION_MAJOR 2u
-#define VFS_VERSION_MINOR 0u
-
-#define VFS_COMPAT_FLAGS 0u
-#define VFS_INCOMPAT_FLAGS 0u
+#define VFS_VERSION_MAJOR 3u
+#define VFS_VERSION_MINOR 3u
+
+// on-disk layout from VFS_LBA_BASE:
+//   superblock | journal (VFS_JOURNAL_SECTORS) | checkpoint images
+// a checkpoint is node table | data | trigrams | checksums starting at the
+// superblock's image_lba, the journal holds the changes made since then
+// and is replayed over it at mount
+#define VFS_INCOMPAT_JOURNAL 0x01u
+// journal may hold JREC_WRITE / JREC_TRUNC records
+#define VFS_INCOMPAT_JWRITE 0x02u
+// the node table is padded to VFS_NODE_TABLE_ALIGN sectors and each file
+// starts on a sector, so a checkpoint can leave unchanged chunks in place
+#define VFS_INCOMPAT_PADDED 0x04u
+#define VFS_NODE_TABLE_ALIGN 8u
+// the checkpoint image starts at the superblock's image_lba instead of
+// right after the journal. a new image is written where it does not
+// overlap the live one, so the superblock write alone switches over
+#define VFS_INCOMPAT_IMAGE_LBA 0x08u
+// a table of content trigram bits per node follows the data, in node
+// table order. without it the bits are rebuilt from the files on demand
+#define VFS_COMPAT_TRIGRAMS 0x01u
+// the superblock checksum is a CRC32 of itself, and a table after the
+// trigrams holds the CRC32 of the node table and then of every chunk of
+// file data, in data region order
+#define VFS_COMPAT_CRC32 0x02u
+
+#define VFS_COMPAT_FLAGS (VFS_COMPAT_TRIGRAMS | VFS_COMPAT_CRC32)
+#define VFS_INCOMPAT_FLAGS (VFS_INCOMPAT_JOURNAL | VFS_INCOMPAT_JWRITE | VFS_INCOMPAT_PADDED | VFS_INCOMPAT_IMAGE_LBA)
+
+#define VFS_JOURNAL_SECTORS 256u
+#define VFS_JOURNAL_BYTES (VFS_JOURNAL_SECTORS * ATA_SECTOR_SIZE)
+#define VFS_JOURNAL_LBA (VFS_LBA_BASE + 1u)
+// sectors from the superblock on that images may use, room for the pair
+// the checkpoint alternates between on a 16 MiB disk
+#define VFS_MAX_SECTORS 30720u
+#define VFS_JREC_MAGIC 0x4A524543u	// "JREC"
+
+// content trigram bits per file. a query can only be in a file that has
+// the bits of all its trigrams set
+#define VFS_TRI_BITS 512u
+#define VFS_TRI_WORDS (VFS_TRI_BITS / 32u)
+
+// file contents live in chunks of up to VFS_CHUNK bytes, so a write only
+// touches the chunks it covers. a chunk that is not in memory is clean
+// and reads back from the checkpoint at disk_off + k * VFS_CHUNK
+#define VFS_CHUNK 4096u
+#define VFS_CHUNK_SHIFT 12
+#define VFS_FILE_MAX (16u * 1024u * 1024u)
+
+#define VFS_MAX_OPEN 16
+
+typedef struct {
+	char* data;	// cap + 1 bytes, 0 while only on disk
+	uint16_t cap;
+	uint8_t dirty;	// differs from the checkpoint copy
+	uint8_t crc_ok;	// crc is known
+	uint32_t crc;	// of the checkpoint copy
+	uint8_t alt_ok;	// alt_crc is known
+	uint32_t alt_crc;	// of the copy in the image before the live one
+} vfs_chunk_t;
 
 typedef enum { NODE_DIR = 1, NODE_FILE = 2 } node_type_t;
 
@@ -20,11 +80,30 @@ typedef struct vfs_node {
 	node_type_t type;
 	char name[32];
 	uint8_t flags; // identify learned/executable spell
+	uint32_t ino;	// stable id, what journal records refer to
+	uint32_t name_hash;
+	struct vfs_node* hash_next;	// dentry hash chain
+	int32_t index;	// scratch, position in the node table while saving
 	struct vfs_node* parent;
 	struct vfs_node* sibling_next;
 	struct vfs_node* child_head;
-	char* file_data;
+	vfs_chunk_t* chunks;	// ceil(file_size / VFS_CHUNK) in use
+	uint32_t chunk_cap;
 	size_t file_size;
+	uint32_t disk_off;	// contents in the checkpoint data region
+	size_t disk_size;	// length of that copy
+	uint32_t alt_off;	// same, in the image before the live one
+	size_t alt_size;
+	uint32_t ckpt_off;	// scratch, offset in the image being written
+	char* flat;	// contiguous copy for insp and seek, 0 once stale
+	uint16_t open_count;
+	uint8_t tri_ok;	// tri matches the contents
+	uint32_t tri[VFS_TRI_WORDS];
+	uint32_t name_sig;	// trigram bits of the name
+	struct vfs_node* all_next;	// name index, every linked node
+	struct vfs_node* all_prev;
+	void* attach;	// derived from the contents, see vfs_attach
+	vfs_attach_free_t attach_free;
 } vfs_node_t;
 
 static int g_dirty = 0;
@@ -35,6 +114,58 @@ static void vfs_mark_clean(void) { g_dirty = 0; }
 static vfs_node_t* g_root = 0;
 static vfs_node_t* g_cwd = 0;
 
+static uint32_t g_next_ino = 1;
+static uint32_t g_data_lba = 0;	// data region of the current checkpoint
+static uint32_t g_image_lba = 0;	// where the current checkpoint starts, 0 if none
+static uint32_t g_image_end = 0;	// first sector after it
+static uint32_t g_alt_lba = 0;	// where the one before it starts, 0 if unknown
+static uint32_t g_alt_data_lba = 0;	// its data region, 0 once written over
+
+// journal state. records of the current generation are appended at
+// g_jcursor, g_jtail mirrors the sector the cursor is in
+static uint32_t g_gen = 0;
+static uint32_t g_jcursor = 0;
+static uint8_t g_jtail[ATA_SECTOR_SIZE];
+static int g_need_checkpoint = 1;
+
+typedef enum {
+	JREC_CREATE = 1,
+	JREC_DATA,	// whole contents
+	JREC_FLAGS,
+	JREC_REMOVE,
+	JREC_WRITE,	// u32 offset, then the bytes
+	JREC_TRUNC	// u32 size
+} jrec_type_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t gen;		// records from an older generation are stale
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t ino;
+	uint32_t len;		// payload bytes after the header
+	uint32_t sum;		// over the fields above and the payload
+} vfs_jrec_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t parent;
+	uint8_t type;
+	uint8_t flags;
+	char name[32];
+} vfs_jcreate_t;
+
+// open handles. a node with handles on it cannot be burned
+typedef struct {
+	vfs_node_t* node;	// 0 = slot free
+	uint32_t mode;
+} vfs_handle_t;
+
+static vfs_handle_t g_open[VFS_MAX_OPEN];
+
+static void handles_reset(void) {
+	for (int i = 0; i < VFS_MAX_OPEN; i++) g_open[i].node = 0;
+}
+
 static int name_valid(const char* s) {
 	if (!s || s[0] == '\0') return 0;
 
@@ -53,11 +184,13 @@ static int has_ms_extension(const char* name) {
 }
 
 static vfs_node_t* node_alloc(node_type_t t, const char* name, vfs_node_t* parent) {
-	vfs_node_t* n = (vfs_node_t*)kmalloc(sizeof(vfs_node_t));
+	vfs_node_t* n = (vfs_node_t*)kmalloc_tagged(sizeof(vfs_node_t), HEAP_TAG_VFS);
 	if (!n) return 0;
 	kmemset(n, 0, sizeof(vfs_node_t));
 	n->type = t;
 	n->parent = parent;
+	n->ino = g_next_ino++;
+	n->tri_ok = 1;	// nothing in it yet
 
 	kmemset(n->name, 0, sizeof(n->name));
 	if (name) {
@@ -70,14 +203,109 @@ static vfs_node_t* node_alloc(node_type_t t, const char* name, vfs_node_t* paren
 	return n;
 }
 
+static inline uint32_t tri_hash(const char* p) {
+	uint32_t t = ((uint32_t)(uint8_t)p[0] << 16) | ((uint32_t)(uint8_t)p[1] << 8) | (uint8_t)p[2];
+	return t * 2654435761u;
+}
+
+static uint32_t name_sig(const char* s) {
+	uint32_t sig = 0;
+	for (size_t i = 0; s[i] && s[i + 1] && s[i + 2]; i++) sig |= 1u << (tri_hash(s + i) >> 27);
+	return sig;
+}
+
+static void tri_bits(const char* s, size_t len, uint32_t* out) {
+	for (uint32_t w = 0; w < VFS_TRI_WORDS; w++) out[w] = 0;
+	for (size_t i = 0; i + 2 < len; i++) {
+		uint32_t b = tri_hash(s + i) >> 23;	// 9 bits
+		out[b >> 5] |= 1u << (b & 31u);
+	}
+}
+
+// the name index: every node in the tree on one list, so a search never
+// walks the directories. each node carries the trigram bits of its name
+static vfs_node_t* g_all = 0;
+static uint32_t g_all_count = 0;
+
+static void name_index_insert(vfs_node_t* n) {
+	n->name_sig = name_sig(n->name);
+	n->all_prev = 0;
+	n->all_next = g_all;
+	if (g_all) g_all->all_prev = n;
+	g_all = n;
+	g_all_count++;
+}
+
+static void name_index_remove(vfs_node_t* n) {
+	if (n->all_prev) n->all_prev->all_next = n->all_next;
+	else if (g_all == n) g_all = n->all_next;
+	else return;
+	if (n->all_next) n->all_next->all_prev = n->all_prev;
+	n->all_next = 0;
+	n->all_prev = 0;
+	g_all_count--;
+}
+
+// dentry hash keyed by (parent, name), so lookups do not walk the
+// sibling list. link_child and remove_child keep it current
+#define VFS_DENTRY_BUCKETS 256	// power of two
+
+static vfs_node_t* g_dentry[VFS_DENTRY_BUCKETS];
+
+static uint32_t name_hash(const char* s) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; s[i]; i++) {
+		h ^= (uint8_t)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t dentry_bucket(const vfs_node_t* dir, uint32_t nh) {
+	uint32_t h = nh ^ ((uint32_t)(uintptr_t)dir >> 4) * 2654435761u;
+	return h & (VFS_DENTRY_BUCKETS - 1u);
+}
+
+static void dentry_insert(vfs_node_t* dir, vfs_node_t* child) {
+	child->name_hash = name_hash(child->name);
+	uint32_t b = dentry_bucket(dir, child->name_hash);
+	child->hash_next = g_dentry[b];
+	g_dentry[b] = child;
+	name_index_insert(child);
+}
+
+static void dentry_remove(vfs_node_t* dir, vfs_node_t* child) {
+	vfs_node_t** pp = &g_dentry[dentry_bucket(dir, child->name_hash)];
+	while (*pp && *pp != child) pp = &(*pp)->hash_next;
+	if (*pp) *pp = child->hash_next;
+	child->hash_next = 0;
+	name_index_remove(child);
+}
+
+static void index_reset(void) {
+	for (int i = 0; i < VFS_DENTRY_BUCKETS; i++) g_dentry[i] = 0;
+	g_all = 0;
+	g_all_count = 0;
+}
+
+// after a mount has wired up the node links directly
+static void dentry_rebuild(vfs_node_t* dir) {
+	for (vfs_node_t* c = dir->child_head; c; c = c->sibling_next) {
+		dentry_insert(dir, c);
+		if (c->type == NODE_DIR) dentry_rebuild(c);
+	}
+}
+
 static void link_child(vfs_node_t* dir, vfs_node_t* child) {
 	child->sibling_next = dir->child_head;
 	dir->child_head = child;
+	dentry_insert(dir, child);
 }
 
 static vfs_node_t* find_child(vfs_node_t* dir, const char* name) {
-	for (vfs_node_t* c = dir->child_head; c; c = c->sibling_next) {
-		if (streq(c->name, name)) return c;
+	uint32_t nh = name_hash(name);
+	for (vfs_node_t* c = g_dentry[dentry_bucket(dir, nh)]; c; c = c->hash_next) {
+		if (c->name_hash == nh && c->parent == dir && streq(c->name, name)) return c;
 	}
 	return 0;
 }
@@ -89,12 +317,16 @@ static vfs_node_t* find_base_dir(void) {
 	return find_child(root, "base");
 }
 
+static void path_cache_invalidate(void);
+
 static vfs_status_t remove_child(vfs_node_t* dir, vfs_node_t* target) {
 	vfs_node_t* prev = 0;
 	for (vfs_node_t* c = dir->child_head; c; c = c->sibling_next) {
 		if (c == target) {
 			if (prev) prev->sibling_next = c->sibling_next;
 			else dir->child_head = c->sibling_next;
+			dentry_remove(dir, c);
+			path_cache_invalidate();
 			return VFS_OK;
 		}
 		prev = c;
@@ -102,6 +334,166 @@ static vfs_status_t remove_child(vfs_node_t* dir, vfs_node_t* target) {
 	return VFS_ERR_NOT_FOUND;
 }
 
+// recent successful lookups by (start dir, path text). a hit is only
+// trusted if no node was removed since, creating nodes cannot make an
+// existing answer wrong
+#define VFS_PATH_CACHE 32	// power of two
+#define VFS_PATH_MAX 128
+
+typedef struct {
+	const vfs_node_t* start;
+	uint32_t hash;
+	uint32_t gen;
+	vfs_node_t* node;
+	char path[VFS_PATH_MAX];
+} vfs_path_entry_t;
+
+static vfs_path_entry_t g_path_cache[VFS_PATH_CACHE];
+static uint32_t g_path_gen = 1;
+
+static void path_cache_invalidate(void) {
+	g_path_gen++;
+}
+
+// walk path from the cwd, or from the top for "/...". the first
+// component of an absolute path names the top directory itself
+static vfs_status_t walk(const char* path, vfs_node_t** out) {
+	vfs_node_t* cur = g_cwd;
+	const char* p = path;
+	int at_top = 0;
+
+	if (*p == '/') {
+		cur = g_root;
+		at_top = 1;
+		while (*p == '/') p++;
+	}
+
+	while (*p) {
+		char comp[32];
+		size_t n = 0;
+		while (p[n] && p[n] != '/') {
+			if (n + 1 >= sizeof(comp)) return VFS_ERR_NAME_INVALID;
+			comp[n] = p[n];
+			n++;
+		}
+		comp[n] = '\0';
+		p += n;
+		while (*p == '/') p++;
+
+		if (!cur) return VFS_ERR_NOT_FOUND;
+		if (at_top) {
+			at_top = 0;
+			if (!streq(comp, g_root->name)) return VFS_ERR_NOT_FOUND;
+			continue;
+		}
+		if (cur->type != NODE_DIR) return VFS_ERR_NOT_DIR;
+
+		if (streq(comp, ".")) continue;
+		if (streq(comp, "..")) {
+			if (cur->parent) cur = cur->parent;
+			continue;
+		}
+
+		cur = find_child(cur, comp);
+		if (!cur) return VFS_ERR_NOT_FOUND;
+	}
+
+	if (!cur) return VFS_ERR_NOT_FOUND;
+	*out = cur;
+	return VFS_OK;
+}
+
+static vfs_status_t lookup(const char* path, vfs_node_t** out) {
+	if (!path || !path[0]) return VFS_ERR_NAME_INVALID;
+	if (!g_root || !g_cwd) return VFS_ERR_NOT_FOUND;
+
+	size_t len = kstrlen(path);
+	uint32_t h = name_hash(path) ^ ((uint32_t)(uintptr_t)g_cwd * 2654435761u);
+	vfs_path_entry_t* e = &g_path_cache[h & (VFS_PATH_CACHE - 1u)];
+	if (e->gen == g_path_gen && e->start == g_cwd && e->hash == h && streq(e->path, path)) {
+		*out = e->node;
+		return VFS_OK;
+	}
+
+	vfs_status_t st = walk(path, out);
+	if (st == VFS_OK && len < VFS_PATH_MAX) {
+		e->start = g_cwd;
+		e->hash = h;
+		e->gen = g_path_gen;
+		e->node = *out;
+		kstrcpy(e->path, path);
+	}
+	return st;
+}
+
+// directory that will hold the last component, and that component
+static vfs_status_t lookup_parent(const char* path, vfs_node_t** out_dir, const char** out_leaf) {
+	if (!path || !path[0]) return VFS_ERR_NAME_INVALID;
+	if (!g_cwd) return VFS_ERR_NOT_FOUND;
+
+	size_t len = kstrlen(path);
+	while (len > 0 && path[len - 1] == '/') len--;
+	if (len == 0) return VFS_ERR_NAME_INVALID;
+
+	size_t slash = len;
+	while (slash > 0 && path[slash - 1] != '/') slash--;
+	*out_leaf = path + slash;
+
+	if (slash == 0) {
+		*out_dir = g_cwd;
+		return VFS_OK;
+	}
+	if (slash >= VFS_PATH_MAX) return VFS_ERR_NAME_INVALID;
+
+	char dir[VFS_PATH_MAX];
+	for (size_t i = 0; i < slash; i++) dir[i] = path[i];
+	dir[slash] = '\0';
+
+	vfs_node_t* d = 0;
+	vfs_status_t st = lookup(dir, &d);
+	if (st != VFS_OK) return st;
+	if (d->type != NODE_DIR) return VFS_ERR_NOT_DIR;
+	*out_dir = d;
+	return VFS_OK;
+}
+
+static vfs_status_t lookup_file(const char* path, vfs_node_t** out) {
+	vfs_status_t st = lookup(path, out);
+	if (st != VFS_OK) return st;
+	if ((*out)->type != NODE_FILE) return VFS_ERR_IS_DIR;
+	return VFS_OK;
+}
+
+static uint32_t chunk_count(size_t size) {
+	return (uint32_t)((size + VFS_CHUNK - 1u) >> VFS_CHUNK_SHIFT);
+}
+
+static void flat_drop(vfs_node_t* n) {
+	if (n->flat) kfree(n->flat);
+	n->flat = 0;
+}
+
+// whatever was built from the old contents no longer applies
+static void attach_drop(vfs_node_t* n) {
+	void* obj = n->attach;
+	vfs_attach_free_t fn = n->attach_free;
+	n->attach = 0;
+	n->attach_free = 0;
+	if (obj && fn) fn(obj);
+}
+
+static void content_free(vfs_node_t* n) {
+	for (uint32_t k = 0; k < n->chunk_cap; k++) {
+		if (n->chunks[k].data) kfree(n->chunks[k].data);
+	}
+	if (n->chunks) kfree(n->chunks);
+	n->chunks = 0;
+	n->chunk_cap = 0;
+	n->file_size = 0;
+	flat_drop(n);
+	attach_drop(n);
+}
+
 static void free_subtree(vfs_node_t* n) {
 	vfs_node_t* c = n->child_head;
 	while (c) {
@@ -109,15 +501,376 @@ static void free_subtree(vfs_node_t* n) {
 		free_subtree(c);
 		c = next;
 	}
-	if (n->type == NODE_FILE && n->file_data) {
-		kfree(n->file_data);
-		n->file_data = 0;
-		n->file_size = 0;
-	}
+	if (n->type == NODE_FILE) content_free(n);
 	kfree(n);
 }
 
+static int chunks_reserve(vfs_node_t* n, uint32_t count) {
+	if (count <= n->chunk_cap) return 1;
+	uint32_t cap = n->chunk_cap ? n->chunk_cap * 2u : 1u;
+	while (cap < count) cap *= 2u;
+
+	vfs_chunk_t* c = (vfs_chunk_t*)kmalloc_tagged(cap * sizeof(vfs_chunk_t), HEAP_TAG_VFS);
+	if (!c) return 0;
+	kmemset(c, 0, cap * sizeof(vfs_chunk_t));
+	if (n->chunks) {
+		kmemcpy(c, n->chunks, n->chunk_cap * sizeof(vfs_chunk_t));
+		kfree(n->chunks);
+	}
+	n->chunks = c;
+	n->chunk_cap = cap;
+	return 1;
+}
+
+// bytes of chunk k that are inside the file
+static uint32_t chunk_used(const vfs_node_t* n, uint32_t k) {
+	size_t base = (size_t)k << VFS_CHUNK_SHIFT;
+	if (n->file_size <= base) return 0;
+	size_t left = n->file_size - base;
+	return left < VFS_CHUNK ? (uint32_t)left : VFS_CHUNK;
+}
+
+// room for at least want bytes, the tail past the file stays zeroed
+static int chunk_grow(vfs_chunk_t* c, uint32_t want) {
+	if (c->data && want <= c->cap) return 1;
+	uint32_t cap = c->cap ? c->cap : 64u;
+	while (cap < want) cap *= 2u;
+	if (cap > VFS_CHUNK) cap = VFS_CHUNK;
+
+	char* d = (char*)kmalloc_tagged(cap + 1u, HEAP_TAG_VFS);
+	if (!d) return 0;
+	kmemset(d, 0, cap + 1u);
+	if (c->data) {
+		kmemcpy(d, c->data, c->cap);
+		kfree(c->data);
+	}
+	c->data = d;
+	c->cap = (uint16_t)cap;
+	return 1;
+}
+
+static uint8_t g_raw[VFS_CHUNK + ATA_SECTOR_SIZE];
+static uint32_t g_chunk_reads = 0;
+static vfs_stats_t g_stats;
+
+// chunk k in memory with room for want bytes. whole says the caller is
+// about to overwrite all of what is in the file, so skip the disk read
+static vfs_status_t chunk_load(vfs_node_t* n, uint32_t k, uint32_t want, int whole) {
+	if (!chunks_reserve(n, k + 1u)) return VFS_ERR_NO_MEM;
+	vfs_chunk_t* c = &n->chunks[k];
+	uint32_t used = chunk_used(n, k);
+	if (want < used) want = used;
+
+	if (c->data || used == 0 || whole) return chunk_grow(c, want) ? VFS_OK : VFS_ERR_NO_MEM;
+
+	uint32_t at = n->disk_off + (k << VFS_CHUNK_SHIFT);
+	uint32_t first = at / ATA_SECTOR_SIZE;
+	uint32_t count = (at + used - 1u) / ATA_SECTOR_SIZE - first + 1u;
+	if (bcache_read(g_data_lba + first, count, g_raw) != 0) return VFS_ERR_BUSY;
+	if (!chunk_grow(c, want)) return VFS_ERR_NO_MEM;
+
+	kmemcpy(c->data, g_raw + at % ATA_SECTOR_SIZE, used);
+	c->dirty = 0;
+	g_chunk_reads++;
+
+	// a chunk that is not in memory was never shortened, so its length
+	// is still the one the checksum was taken over
+	if (c->crc_ok && crc32(c->data, used) != c->crc) {
+		g_stats.crc_errors++;
+		kfree(c->data);
+		c->data = 0;
+		c->cap = 0;
+		return VFS_ERR_CORRUPT;
+	}
+	return VFS_OK;
+}
+
+// every chunk of the file in memory
+static vfs_status_t load_content(vfs_node_t* n) {
+	if (n->type != NODE_FILE) return VFS_OK;
+	uint32_t count = chunk_count(n->file_size);
+	for (uint32_t k = 0; k < count; k++) {
+		vfs_status_t st = chunk_load(n, k, 0, 0);
+		if (st != VFS_OK) return st;
+	}
+	return VFS_OK;
+}
+
+// the contents as one string. a single chunk is used in place, larger
+// files get a joined copy that lasts until the next change
+static vfs_status_t flat_view(vfs_node_t* n, const char** out) {
+	*out = "";
+	if (n->file_size == 0) return VFS_OK;
+
+	vfs_status_t st = load_content(n);
+	if (st != VFS_OK) return st;
+
+	if (n->file_size <= VFS_CHUNK) {
+		n->chunks[0].data[n->file_size] = '\0';
+		*out = n->chunks[0].data;
+		return VFS_OK;
+	}
+
+	if (!n->flat) {
+		char* f = (char*)kmalloc_tagged(n->file_size + 1u, HEAP_TAG_VFS);
+		if (!f) return VFS_ERR_NO_MEM;
+		uint32_t count = chunk_count(n->file_size);
+		for (uint32_t k = 0; k < count; k++) {
+			kmemcpy(f + ((size_t)k << VFS_CHUNK_SHIFT), n->chunks[k].data, chunk_used(n, k));
+		}
+		f[n->file_size] = '\0';
+		n->flat = f;
+	}
+	*out = n->flat;
+	return VFS_OK;
+}
+
+static int byte_at(const vfs_node_t* n, size_t off) {
+	if (off >= n->file_size || (off >> VFS_CHUNK_SHIFT) >= n->chunk_cap) return -1;
+	const vfs_chunk_t* c = &n->chunks[off >> VFS_CHUNK_SHIFT];
+	return c->data ? (uint8_t)c->data[off & (VFS_CHUNK - 1u)] : -1;
+}
+
+static vfs_status_t content_index(vfs_node_t* n) {
+	const char* text = 0;
+	vfs_status_t st = flat_view(n, &text);
+	if (st != VFS_OK) return st;
+	tri_bits(text, n->file_size, n->tri);
+	n->tri_ok = 1;
+	return VFS_OK;
+}
+
+// the bits only ever gain trigrams, which keeps them a superset of what
+// is in the file. that is all a search needs
+static void tri_add_range(vfs_node_t* n, size_t from, size_t to) {
+	if (!n->tri_ok) return;
+	from = from >= 2 ? from - 2 : 0;
+	if (to > n->file_size) to = n->file_size;
+	for (size_t i = from; i + 2 < to; i++) {
+		char t[3];
+		for (int j = 0; j < 3; j++) {
+			int b = byte_at(n, i + (size_t)j);
+			if (b < 0) {
+				// neighbour not in memory, rebuild on the next search
+				n->tri_ok = 0;
+				return;
+			}
+			t[j] = (char)b;
+		}
+		uint32_t b = tri_hash(t) >> 23;
+		n->tri[b >> 5] |= 1u << (b & 31u);
+	}
+}
+
+// src 0 writes zeros. a write past the end fills the gap with zeros
+static vfs_status_t content_write(vfs_node_t* n, size_t off, const char* src, size_t len) {
+	if (off > VFS_FILE_MAX || len > VFS_FILE_MAX - off) return VFS_ERR_NO_MEM;
+	if (len > 0 || off > n->file_size) attach_drop(n);
+	if (off > n->file_size) {
+		vfs_status_t st = content_write(n, n->file_size, 0, off - n->file_size);
+		if (st != VFS_OK) return st;
+	}
+	if (len == 0) return VFS_OK;
+
+	size_t end = off + len;
+	if (!chunks_reserve(n, chunk_count(end))) return VFS_ERR_NO_MEM;
+
+	size_t pos = off;
+	while (pos < end) {
+		uint32_t k = (uint32_t)(pos >> VFS_CHUNK_SHIFT);
+		uint32_t in = (uint32_t)(pos & (VFS_CHUNK - 1u));
+		uint32_t n_bytes = VFS_CHUNK - in;
+		if (n_bytes > end - pos) n_bytes = (uint32_t)(end - pos);
+
+		int whole = (in == 0 && n_bytes >= chunk_used(n, k));
+		vfs_status_t st = chunk_load(n, k, in + n_bytes, whole);
+		if (st != VFS_OK) return st;
+
+		vfs_chunk_t* c = &n->chunks[k];
+		if (src) kmemcpy(c->data + in, src + (pos - off), n_bytes);
+		else kmemset(c->data + in, 0, n_bytes);
+		c->dirty = 1;
+
+		pos += n_bytes;
+		if (pos > n->file_size) n->file_size = pos;
+	}
+
+	flat_drop(n);
+	tri_add_range(n, off, end + 2u);
+	return VFS_OK;
+}
+
+static vfs_status_t content_truncate(vfs_node_t* n, size_t size) {
+	if (size > n->file_size) return content_write(n, n->file_size, 0, size - n->file_size);
+	if (size == n->file_size) return VFS_OK;
+	attach_drop(n);
+
+	uint32_t keep = chunk_count(size);
+	for (uint32_t k = keep; k < n->chunk_cap; k++) {
+		if (n->chunks[k].data) kfree(n->chunks[k].data);
+		n->chunks[k].data = 0;
+		n->chunks[k].cap = 0;
+		n->chunks[k].dirty = 0;
+		n->chunks[k].crc_ok = 0;
+	}
+
+	// the new last chunk no longer matches its checksum. bring it in and
+	// keep the bytes past the end zero
+	uint32_t in = (uint32_t)(size & (VFS_CHUNK - 1u));
+	if (in) {
+		vfs_status_t st = chunk_load(n, keep - 1u, 0, 0);
+		if (st != VFS_OK) return st;
+		vfs_chunk_t* c = &n->chunks[keep - 1u];
+		kmemset(c->data + in, 0, c->cap - in);
+		c->dirty = 1;
+	}
+
+	n->file_size = size;
+	flat_drop(n);
+	if (size == 0) {
+		for (uint32_t w = 0; w < VFS_TRI_WORDS; w++) n->tri[w] = 0;
+		n->tri_ok = 1;
+	}
+	return VFS_OK;
+}
+
+static size_t reclaim_subtree(vfs_node_t* n, size_t want, size_t freed) {
+	for (vfs_node_t* c = n->child_head; c && (want == 0 || freed < want); c = c->sibling_next) {
+		freed = reclaim_subtree(c, want, freed);
+	}
+	if (n->type != NODE_FILE || n->open_count) return freed;
+
+	if (n->flat) {
+		freed += n->file_size + 1u;
+		flat_drop(n);
+	}
+	for (uint32_t k = 0; k < n->chunk_cap && (want == 0 || freed < want); k++) {
+		vfs_chunk_t* c = &n->chunks[k];
+		if (!c->data || c->dirty) continue;
+		freed += c->cap + 1u;
+		kfree(c->data);
+		c->data = 0;
+		c->cap = 0;
+	}
+	return freed;
+}
+
+size_t vfs_reclaim(size_t want) {
+	if (!g_root) return 0;
+	return reclaim_subtree(g_root, want, 0);
+}
+
+static vfs_node_t* find_ino(vfs_node_t* n, uint32_t ino) {
+	if (!n) return 0;
+	if (n->ino == ino) return n;
+	for (vfs_node_t* c = n->child_head; c; c = c->sibling_next) {
+		vfs_node_t* hit = find_ino(c, ino);
+		if (hit) return hit;
+	}
+	return 0;
+}
+
+// FNV-1a, enough to spot a torn or stale record
+static uint32_t sum_bytes(uint32_t h, const void* p, uint32_t n) {
+	const uint8_t* b = (const uint8_t*)p;
+	for (uint32_t i = 0; i < n; i++) {
+		h ^= b[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t jrec_sum(const vfs_jrec_t* r, const void* a, uint32_t alen, const void* b, uint32_t blen) {
+	uint32_t h = sum_bytes(2166136261u, r, (uint32_t)(sizeof(*r) - sizeof(r->sum)));
+	h = sum_bytes(h, a, alen);
+	return sum_bytes(h, b, blen);
+}
+
+static int journal_put(const void* p, uint32_t len) {
+	const uint8_t* src = (const uint8_t*)p;
+	while (len > 0) {
+		uint32_t off = g_jcursor % ATA_SECTOR_SIZE;
+		uint32_t n = ATA_SECTOR_SIZE - off;
+		if (n > len) n = len;
+
+		kmemcpy(g_jtail + off, src, n);
+		if (bcache_write(VFS_JOURNAL_LBA + g_jcursor / ATA_SECTOR_SIZE, 1, g_jtail) != 0) return 0;
+
+		g_jcursor += n;
+		src += n;
+		len -= n;
+		if (g_jcursor % ATA_SECTOR_SIZE == 0) kmemset(g_jtail, 0, ATA_SECTOR_SIZE);
+	}
+	return 1;
+}
+
+// append one record with a payload in up to two pieces. when the journal
+// cannot take it the next vfs_save writes a full checkpoint instead
+static void journal_log(jrec_type_t type, uint32_t ino, const void* a, uint32_t alen, const void* b, uint32_t blen) {
+	if (g_need_checkpoint) return;
+
+	vfs_jrec_t r;
+	r.magic = VFS_JREC_MAGIC;
+	r.gen = g_gen;
+	r.type = (uint16_t)type;
+	r.reserved = 0;
+	r.ino = ino;
+	r.len = alen + blen;
+	r.sum = jrec_sum(&r, a, alen, b, blen);
+
+	uint32_t total = (uint32_t)sizeof(r) + alen + blen;
+	if (total > VFS_JOURNAL_BYTES - g_jcursor ||
+	    !journal_put(&r, sizeof(r)) || !journal_put(a, alen) || !journal_put(b, blen)) {
+		g_need_checkpoint = 1;
+		return;
+	}
+
+	// compact once the log is mostly used
+	if (g_jcursor > (VFS_JOURNAL_BYTES / 4u) * 3u) g_need_checkpoint = 1;
+}
+
+static void journal_create(const vfs_node_t* n) {
+	vfs_jcreate_t c;
+	kmemset(&c, 0, sizeof(c));
+	c.parent = n->parent ? n->parent->ino : 0;
+	c.type = (uint8_t)n->type;
+	c.flags = n->flags;
+	for (int i = 0; i < 31; i++) c.name[i] = n->name[i];
+	journal_log(JREC_CREATE, n->ino, &c, sizeof(c), 0, 0);
+}
+
+static void journal_data(const vfs_node_t* n, const char* text, size_t len) {
+	journal_log(JREC_DATA, n->ino, text, (uint32_t)len, 0, 0);
+}
+
+static void journal_write(const vfs_node_t* n, uint32_t off, const void* src, size_t len) {
+	journal_log(JREC_WRITE, n->ino, &off, sizeof(off), src, (uint32_t)len);
+}
+
+static void journal_trunc(const vfs_node_t* n, uint32_t size) {
+	journal_log(JREC_TRUNC, n->ino, &size, sizeof(size), 0, 0);
+}
+
+static void journal_flags(const vfs_node_t* n) {
+	journal_log(JREC_FLAGS, n->ino, &n->flags, 1, 0, 0);
+}
+
+static void journal_remove(const vfs_node_t* n) {
+	journal_log(JREC_REMOVE, n->ino, 0, 0, 0, 0);
+}
+
 void vfs_init(void) {
+	g_next_ino = 1;
+	g_need_checkpoint = 1;
+	g_data_lba = 0;
+	g_image_lba = 0;
+	g_image_end = 0;
+	g_alt_lba = 0;
+	g_alt_data_lba = 0;
+	index_reset();
+	handles_reset();
+	path_cache_invalidate();
+
 	// build -- /P/root/base
 	g_root = node_alloc(NODE_DIR, "P", 0);
 	vfs_node_t* root = node_alloc(NODE_DIR, "root", g_root);
@@ -125,6 +878,7 @@ void vfs_init(void) {
 	if (!g_root || !root || !base) {
 		return;
 	}
+	name_index_insert(g_root);
 	link_child(g_root, root);
 	link_child(root, base);
 	g_cwd = base;
@@ -137,17 +891,10 @@ static size_t append_path_piece(char* out, size_t cap, size_t pos, const char* s
 	return pos;
 }
 
-void vfs_pwd(char* out, size_t cap) {
-	if (!out || cap == 0) return;
-	out[0] = '\0';
-	if (!g_cwd) {
-		append_path_piece(out, cap, 0, "/");
-		return;
-	}
-
-	vfs_node_t* chain[32];
+static void node_path(const vfs_node_t* node, char* out, size_t cap) {
+	const vfs_node_t* chain[32];
 	int n = 0;
-	vfs_node_t* cur = g_cwd;
+	const vfs_node_t* cur = node;
 	while (cur && n < 32) {
 		chain[n++] = cur;
 		cur = cur->parent;
@@ -161,94 +908,111 @@ void vfs_pwd(char* out, size_t cap) {
 	}
 }
 
-vfs_status_t vfs_cd(const char* name) {
-	if (!g_cwd) return VFS_ERR_NOT_FOUND;
-	if (!name || name[0] == '\0') return VFS_ERR_NAME_INVALID;
-	if (streq(name, "/")) {
-		g_cwd = g_root;
-		return VFS_OK;
-	}
-	if (streq(name, "..")) {
-		if (g_cwd->parent) g_cwd = g_cwd->parent;
-		return VFS_OK;
+void vfs_pwd(char* out, size_t cap) {
+	if (!out || cap == 0) return;
+	out[0] = '\0';
+	if (!g_cwd) {
+		append_path_piece(out, cap, 0, "/");
+		return;
 	}
+	node_path(g_cwd, out, cap);
+}
+
+vfs_status_t vfs_cd(const char* path) {
+	if (!g_cwd) return VFS_ERR_NOT_FOUND;
 
-	vfs_node_t* c = find_child(g_cwd, name);
-	if (!c) return VFS_ERR_NOT_FOUND;
+	vfs_node_t* c = 0;
+	vfs_status_t st = lookup(path, &c);
+	if (st != VFS_OK) return st;
 	if (c->type != NODE_DIR) return VFS_ERR_NOT_DIR;
 	g_cwd = c;
 	return VFS_OK;
 }
 
-vfs_status_t vfs_mkdir(const char* name) {
-	if (!g_cwd) return VFS_ERR_NOT_FOUND;
+vfs_status_t vfs_mkdir(const char* path) {
+	vfs_node_t* dir = 0;
+	const char* name = 0;
+	vfs_status_t st = lookup_parent(path, &dir, &name);
+	if (st != VFS_OK) return st;
 	if (!name_valid(name)) return VFS_ERR_NAME_INVALID;
-	if (find_child(g_cwd, name)) return VFS_ERR_EXISTS;
+	if (find_child(dir, name)) return VFS_ERR_EXISTS;
 
-	vfs_node_t* d = node_alloc(NODE_DIR, name, g_cwd);
+	vfs_node_t* d = node_alloc(NODE_DIR, name, dir);
 	if (!d) return VFS_ERR_NO_MEM;
-	link_child(g_cwd, d);
+	link_child(dir, d);
+	journal_create(d);
 	vfs_mark_dirty();
 	return VFS_OK;
 }
 
-vfs_status_t vfs_fab(const char* filename) {
-	if (!g_cwd) return VFS_ERR_NOT_FOUND;
-	if (!name_valid(filename)) return VFS_ERR_NAME_INVALID;
-	if (find_child(g_cwd, filename)) return VFS_ERR_EXISTS;
+vfs_status_t vfs_fab(const char* path) {
+	vfs_node_t* dir = 0;
+	const char* name = 0;
+	vfs_status_t st = lookup_parent(path, &dir, &name);
+	if (st != VFS_OK) return st;
+	if (!name_valid(name)) return VFS_ERR_NAME_INVALID;
+	if (find_child(dir, name)) return VFS_ERR_EXISTS;
 
-	vfs_node_t* f = node_alloc(NODE_FILE, filename, g_cwd);
+	vfs_node_t* f = node_alloc(NODE_FILE, name, dir);
 	if (!f) return VFS_ERR_NO_MEM;
-	link_child(g_cwd, f);
+	link_child(dir, f);
+	journal_create(f);
 	vfs_mark_dirty();
 	return VFS_OK;
 }
 
 vfs_status_t vfs_insp(const char* filename, const char** out_text) {
 	if (out_text) *out_text = 0;
-	if (!g_cwd) return VFS_ERR_NOT_FOUND;
-	vfs_node_t* f = find_child(g_cwd, filename);
-	if (!f) return VFS_ERR_NOT_FOUND;
-	if (f->type != NODE_FILE) return VFS_ERR_IS_DIR;
-	if (out_text) *out_text = (f->file_data) ? f->file_data : "";
+	vfs_node_t* f = 0;
+	vfs_status_t st = lookup_file(filename, &f);
+	if (st != VFS_OK) return st;
+
+	const char* text = 0;
+	st = flat_view(f, &text);
+	if (st != VFS_OK) return st;
+
+	if (out_text) *out_text = text;
+	return VFS_OK;
+}
+
+static vfs_status_t set_content(vfs_node_t* f, const char* text, size_t n) {
+	if (n > VFS_FILE_MAX) return VFS_ERR_NO_MEM;
+	content_truncate(f, 0);
+	vfs_status_t st = content_write(f, 0, text, n);
+	if (st != VFS_OK) {
+		content_truncate(f, 0);
+		return st;
+	}
+	tri_bits(text, n, f->tri);
+	f->tri_ok = 1;
 	return VFS_OK;
 }
 
 vfs_status_t vfs_carve(const char* filename, const char* text) {
-	if (!g_cwd) return VFS_ERR_NOT_FOUND;
-	vfs_node_t* f = find_child(g_cwd, filename);
-	if (!f) return VFS_ERR_NOT_FOUND;
-	if (f->type != NODE_FILE) return VFS_ERR_IS_DIR;
+	vfs_node_t* f = 0;
+	vfs_status_t st = lookup_file(filename, &f);
+	if (st != VFS_OK) return st;
 
 	const char* src = text ? text : "";
 	size_t n = kstrlen(src);
 
-	char* buf = (char*)kmalloc(n + 1);
-	if (!buf) return VFS_ERR_NO_MEM;
-
-	for (size_t i = 0; i < n; i++) buf[i] = src[i];
-	buf[n] = '\0';
-
-	if (f->file_data) {
-		kfree(f->file_data);
-		f->file_data = 0;
-		f->file_size = 0;
-	}
-
-	f->file_data = buf;
-	f->file_size = n;
+	st = set_content(f, src, n);
+	if (st != VFS_OK) return st;
+	journal_data(f, src, n);
 	vfs_mark_dirty();
 	return VFS_OK;
 }
 
 vfs_status_t vfs_burn(const char* filename) {
-	if (!g_cwd) return VFS_ERR_NOT_FOUND;
-	vfs_node_t* n = find_child(g_cwd, filename);
-	if (!n) return VFS_ERR_NOT_FOUND;
+	vfs_node_t* n = 0;
+	vfs_status_t st = lookup(filename, &n);
+	if (st != VFS_OK) return st;
+	if (!n->parent || n == g_cwd || n->open_count) return VFS_ERR_BUSY;
 	if (n->type == NODE_DIR) {
 		if (n->child_head) return VFS_ERR_BUSY;
 	}
-	remove_child(g_cwd, n);
+	journal_remove(n);
+	remove_child(n->parent, n);
 	n->parent = 0;
 	n->sibling_next = 0;
 	free_subtree(n);
@@ -256,6 +1020,124 @@ vfs_status_t vfs_burn(const char* filename) {
 	return VFS_OK;
 }
 
+vfs_status_t vfs_open(const char* path, uint32_t mode, int* out_fd) {
+	if (out_fd) *out_fd = -1;
+	if (!out_fd || (mode & (VFS_O_READ | VFS_O_WRITE)) == 0) return VFS_ERR_NAME_INVALID;
+	if ((mode & (VFS_O_CREATE | VFS_O_TRUNC)) && !(mode & VFS_O_WRITE)) return VFS_ERR_NAME_INVALID;
+
+	int fd = -1;
+	for (int i = 0; i < VFS_MAX_OPEN; i++) {
+		if (!g_open[i].node) { fd = i; break; }
+	}
+	if (fd < 0) return VFS_ERR_BUSY;
+
+	vfs_node_t* f = 0;
+	vfs_status_t st = lookup_file(path, &f);
+	if (st == VFS_ERR_NOT_FOUND && (mode & VFS_O_CREATE)) {
+		st = vfs_fab(path);
+		if (st == VFS_OK) st = lookup_file(path, &f);
+	}
+	if (st != VFS_OK) return st;
+
+	if ((mode & VFS_O_TRUNC) && f->file_size) {
+		content_truncate(f, 0);
+		journal_trunc(f, 0);
+		vfs_mark_dirty();
+	}
+
+	g_open[fd].node = f;
+	g_open[fd].mode = mode;
+	f->open_count++;
+	*out_fd = fd;
+	return VFS_OK;
+}
+
+static vfs_handle_t* handle_get(int fd, uint32_t need) {
+	if (fd < 0 || fd >= VFS_MAX_OPEN) return 0;
+	vfs_handle_t* h = &g_open[fd];
+	if (!h->node || (h->mode & need) != need) return 0;
+	return h;
+}
+
+vfs_status_t vfs_read(int fd, size_t off, void* buf, size_t len, size_t* out_read) {
+	if (out_read) *out_read = 0;
+	vfs_handle_t* h = handle_get(fd, VFS_O_READ);
+	if (!h) return VFS_ERR_BAD_FD;
+	vfs_node_t* n = h->node;
+
+	if (off >= n->file_size) return VFS_OK;
+	if (len > n->file_size - off) len = n->file_size - off;
+
+	// only the chunks the range covers are brought in
+	uint8_t* out = (uint8_t*)buf;
+	size_t done = 0;
+	while (done < len) {
+		size_t pos = off + done;
+		uint32_t k = (uint32_t)(pos >> VFS_CHUNK_SHIFT);
+		uint32_t in = (uint32_t)(pos & (VFS_CHUNK - 1u));
+		uint32_t n_bytes = chunk_used(n, k) - in;
+		if (n_bytes > len - done) n_bytes = (uint32_t)(len - done);
+
+		vfs_status_t st = chunk_load(n, k, 0, 0);
+		if (st != VFS_OK) return st;
+		kmemcpy(out + done, n->chunks[k].data + in, n_bytes);
+		done += n_bytes;
+		if (out_read) *out_read = done;
+	}
+	return VFS_OK;
+}
+
+vfs_status_t vfs_write(int fd, size_t off, const void* buf, size_t len) {
+	vfs_handle_t* h = handle_get(fd, VFS_O_WRITE);
+	if (!h) return VFS_ERR_BAD_FD;
+	if (len == 0 && off <= h->node->file_size) return VFS_OK;
+
+	vfs_status_t st = content_write(h->node, off, (const char*)buf, len);
+	if (st != VFS_OK) {
+		// part of it may have landed, the journal cannot say which
+		g_need_checkpoint = 1;
+		vfs_mark_dirty();
+		return st;
+	}
+	journal_write(h->node, (uint32_t)off, buf, len);
+	vfs_mark_dirty();
+	return VFS_OK;
+}
+
+vfs_status_t vfs_append(int fd, const void* buf, size_t len) {
+	vfs_handle_t* h = handle_get(fd, VFS_O_WRITE);
+	if (!h) return VFS_ERR_BAD_FD;
+	return vfs_write(fd, h->node->file_size, buf, len);
+}
+
+vfs_status_t vfs_truncate(int fd, size_t size) {
+	vfs_handle_t* h = handle_get(fd, VFS_O_WRITE);
+	if (!h) return VFS_ERR_BAD_FD;
+	if (size == h->node->file_size) return VFS_OK;
+
+	vfs_status_t st = content_truncate(h->node, size);
+	if (st != VFS_OK) return st;
+	journal_trunc(h->node, (uint32_t)size);
+	vfs_mark_dirty();
+	return VFS_OK;
+}
+
+vfs_status_t vfs_size(int fd, size_t* out_size) {
+	if (out_size) *out_size = 0;
+	vfs_handle_t* h = handle_get(fd, 0);
+	if (!h) return VFS_ERR_BAD_FD;
+	if (out_size) *out_size = h->node->file_size;
+	return VFS_OK;
+}
+
+vfs_status_t vfs_close(int fd) {
+	vfs_handle_t* h = handle_get(fd, 0);
+	if (!h) return VFS_ERR_BAD_FD;
+	h->node->open_count--;
+	h->node = 0;
+	return VFS_OK;
+}
+
 typedef struct __attribute__((packed)) {
 	uint32_t magic;
 
@@ -273,12 +1155,21 @@ typedef struct __attribute__((packed)) {
 	uint32_t root_index;
 	uint32_t total_sectors;
 	uint32_t checksum;
+
+	// VFS_INCOMPAT_JOURNAL
+	uint32_t journal_sectors;	// after the superblock
+	uint32_t generation;		// bumped by every checkpoint
+	uint32_t next_ino;
+
+	// VFS_INCOMPAT_IMAGE_LBA, older superblocks end before it
+	uint32_t image_lba;		// node table, data, trigrams, checksums
 } vfs_superblock_t;
 
 typedef struct __attribute__((packed)) {
 	uint8_t type;
 	uint8_t flags;
 	char name[32];
+	uint32_t ino;
 	int32_t parent;
 	int32_t first_child;
 	int32_t next_sibling;
@@ -286,9 +1177,12 @@ typedef struct __attribute__((packed)) {
 	uint32_t file_len;
 } vfs_disk_node_t;
 
+// preorder numbering, each node keeps its own index so links resolve in
+// constant time while the table is written
 static int build_index_table(vfs_node_t* n, vfs_node_t** out, int cap, int* count) {
 	if (!n) return 0;
 	if (*count >= cap) return 0;
+	n->index = *count;
 	out[*count] = n;
 	(*count)++;
 	for (vfs_node_t* ch = n->child_head; ch; ch = ch->sibling_next) {
@@ -297,46 +1191,186 @@ static int build_index_table(vfs_node_t* n, vfs_node_t** out, int cap, int* coun
 	return 1;
 }
 
-static int find_index(vfs_node_t** arr, int n, vfs_node_t* target) {
-	for (int i = 0; i < n; i++) if (arr[i] == target) return i;
-	return -1;
-}
-
 static uint32_t bytes_to_sectors(uint32_t bytes) {
 	return (bytes + ATA_SECTOR_SIZE - 1u) / ATA_SECTOR_SIZE;
 }
 
-vfs_status_t vfs_save(void) {
-	if (!g_root) return VFS_ERR_NOT_FOUND;
+static int has_data(const vfs_node_t* n) {
+	return n->type == NODE_FILE && n->file_size;
+}
 
+// the image is streamed front to back into a staging buffer and sent to
+// the block cache in batches of whole sectors
+#define VFS_WRITE_BATCH 16
+
+typedef struct {
+	uint8_t* buf;
+	uint32_t lba;	// where buf[0] goes
+	uint32_t count;	// full sectors staged
+	uint32_t fill;	// bytes in the sector after them
+} vfs_writer_t;
+
+static int writer_flush(vfs_writer_t* w) {
+	if (w->count == 0) return 0;
+	if (bcache_write(w->lba, w->count, w->buf) != 0) return 1;
+	w->lba += w->count;
+	w->count = 0;
+	return 0;
+}
+
+static int writer_put(vfs_writer_t* w, const void* p, uint32_t len) {
+	const uint8_t* src = (const uint8_t*)p;
+	while (len > 0) {
+		uint8_t* sec = w->buf + w->count * ATA_SECTOR_SIZE;
+		if (w->fill == 0) kmemset(sec, 0, ATA_SECTOR_SIZE);
+
+		uint32_t n = ATA_SECTOR_SIZE - w->fill;
+		if (n > len) n = len;
+		kmemcpy(sec + w->fill, src, n);
+		w->fill += n;
+		src += n;
+		len -= n;
+
+		if (w->fill == ATA_SECTOR_SIZE) {
+			w->fill = 0;
+			w->count++;
+			if (w->count == VFS_WRITE_BATCH && writer_flush(w) != 0) return 1;
+		}
+	}
+	return 0;
+}
+
+// finish the partial sector, zero padded
+static int writer_pad(vfs_writer_t* w) {
+	if (w->fill == 0) return 0;
+	w->fill = 0;
+	w->count++;
+	if (w->count == VFS_WRITE_BATCH) return writer_flush(w);
+	return 0;
+}
+
+// leave sectors as they are on disk
+static int writer_skip(vfs_writer_t* w, uint32_t sectors) {
+	if (writer_pad(w) != 0 || writer_flush(w) != 0) return 1;
+	w->lba += sectors;
+	return 0;
+}
+
+static uint32_t node_table_sectors_for(uint32_t node_count, uint32_t incompat) {
+	uint32_t sectors = bytes_to_sectors(node_count * (uint32_t)sizeof(vfs_disk_node_t));
+	if (incompat & VFS_INCOMPAT_PADDED) {
+		sectors = (sectors + VFS_NODE_TABLE_ALIGN - 1u) / VFS_NODE_TABLE_ALIGN * VFS_NODE_TABLE_ALIGN;
+	}
+	return sectors;
+}
+
+// bytes of chunk k in a copy of size bytes
+static uint32_t chunk_size_used(size_t size, uint32_t k) {
+	size_t base = (size_t)k << VFS_CHUNK_SHIFT;
+	if (size <= base) return 0;
+	size_t left = size - base;
+	return left < VFS_CHUNK ? (uint32_t)left : VFS_CHUNK;
+}
+
+static int image_fits(uint32_t lba, uint32_t sectors) {
+	if (sectors > VFS_MAX_SECTORS || lba + sectors > VFS_LBA_BASE + VFS_MAX_SECTORS) return 0;
+	return g_image_lba == 0 || lba + sectors <= g_image_lba || lba >= g_image_end;
+}
+
+// the live image is never written over. the new one goes where the image
+// before it was, so unchanged chunks can stay, or else below the live one
+// or after it. 0 when none of those fit in the region
+static uint32_t image_place(uint32_t sectors) {
+	uint32_t first = VFS_JOURNAL_LBA + VFS_JOURNAL_SECTORS;
+	uint32_t after = (g_image_end + VFS_NODE_TABLE_ALIGN - 1u) / VFS_NODE_TABLE_ALIGN * VFS_NODE_TABLE_ALIGN;
+	if (g_alt_lba && image_fits(g_alt_lba, sectors)) return g_alt_lba;
+	if (image_fits(first, sectors)) return first;
+	if (g_image_lba && image_fits(after, sectors)) return after;
+	return 0;
+}
+
+// chunk k is identical to the copy the image before the live one left
+// where the new image puts it, so the checkpoint does not have to write
+// or even read it
+static int chunk_unchanged(const vfs_node_t* n, uint32_t k, int same_place) {
+	if (!same_place || k >= n->chunk_cap) return 0;
+	const vfs_chunk_t* c = &n->chunks[k];
+	uint32_t used = chunk_used(n, k);
+	if (!c->alt_ok || used == 0 || used != chunk_size_used(n->alt_size, k)) return 0;
+	if (!c->dirty && c->crc_ok && used == chunk_size_used(n->disk_size, k)) return c->crc == c->alt_crc;
+	return c->data && crc32(c->data, used) == c->alt_crc;
+}
+
+// one TRACE_VFS_PHASE event for the phase that ends now
+static void vfs_phase(uint32_t op, uint32_t phase, uint64_t* t) {
+	uint64_t now = cpu_rdtsc();
+	if (trace_on(TRACE_VFS_PHASE)) trace_record(TRACE_VFS_PHASE, op, phase, trace_cycles_since(*t, now));
+	*t = now;
+}
+
+// full image of the tree, which also empties the journal. traced phases:
+// 0 layout and reading in moved chunks, 1 node table, 2 file data,
+// 3 trigrams and checksums, 4 image written back, 5 superblock
+vfs_status_t vfs_checkpoint(void) {
 	enum { MAX_NODES_SNAPSHOT = 1024 };
-	vfs_node_t** nodes = (vfs_node_t**)kmalloc(sizeof(vfs_node_t*) * MAX_NODES_SNAPSHOT);
+	uint64_t t = cpu_rdtsc();
+	vfs_node_t** nodes = (vfs_node_t**)kmalloc_tagged(sizeof(vfs_node_t*) * MAX_NODES_SNAPSHOT, HEAP_TAG_VFS);
 	if (!nodes) return VFS_ERR_NO_MEM;
-	
+
 	int node_count = 0;
 	if (!build_index_table(g_root, nodes, MAX_NODES_SNAPSHOT, &node_count)) {
+		kfree(nodes);
 		return VFS_ERR_NO_MEM;
 	}
 
+	uint32_t node_table_sectors = node_table_sectors_for((uint32_t)node_count, VFS_INCOMPAT_FLAGS);
+
+	// each file starts on a sector boundary
 	uint32_t data_bytes = 0;
+	uint32_t chunks_total = 0;
 	for (int i = 0; i < node_count; i++) {
-		if (nodes[i]->type == NODE_FILE && nodes[i]->file_data && nodes[i]->file_size) {
-			data_bytes += (uint32_t)nodes[i]->file_size;
-		}
+		vfs_node_t* n = nodes[i];
+		if (n->type == NODE_FILE && !n->tri_ok) (void)content_index(n);
+		n->ckpt_off = 0;
+		if (!has_data(n)) continue;
+		n->ckpt_off = data_bytes;
+		data_bytes += bytes_to_sectors((uint32_t)n->file_size) * ATA_SECTOR_SIZE;
+		chunks_total += chunk_count(n->file_size);
 	}
 
-	uint32_t node_table_bytes = (uint32_t)node_count * (uint32_t)sizeof(vfs_disk_node_t);
-	uint32_t node_table_sectors = bytes_to_sectors(node_table_bytes);
 	uint32_t data_sectors = bytes_to_sectors(data_bytes);
-	uint32_t total_sectors = 1u + node_table_sectors + data_sectors;
+	uint32_t tri_sectors = bytes_to_sectors((uint32_t)node_count * (uint32_t)sizeof(nodes[0]->tri));
+	uint32_t crc_sectors = bytes_to_sectors((1u + chunks_total) * (uint32_t)sizeof(uint32_t));
+	uint32_t image_sectors = node_table_sectors + data_sectors + tri_sectors + crc_sectors;
+	uint32_t image_lba = image_place(image_sectors);
+	if (image_lba == 0) {
+		kfree(nodes);
+		return VFS_ERR_FULL;
+	}
+	uint32_t data_lba = image_lba + node_table_sectors;
+
+	// every chunk the new image writes is copied out of memory, so the
+	// ones that only exist in the live image come in first
+	for (int i = 0; i < node_count; i++) {
+		vfs_node_t* n = nodes[i];
+		if (!has_data(n)) continue;
+		int same_place = (data_lba == g_alt_data_lba && n->ckpt_off == n->alt_off);
+		for (uint32_t k = 0; k < chunk_count(n->file_size); k++) {
+			if (chunk_unchanged(n, k, same_place)) continue;
+			vfs_status_t lst = chunk_load(n, k, 0, 0);
+			if (lst != VFS_OK) {
+				kfree(nodes);
+				return lst;
+			}
+		}
+	}
 
-	int root_index = find_index(nodes, node_count, g_root);
-	if (root_index < 0) root_index = 0;
+	vfs_phase(TRACE_VFS_CHECKPOINT, 0, &t);
 
 	vfs_superblock_t sb;
 	kmemset(&sb, 0, sizeof(sb));
 	sb.magic = VFS_MAGIC;
-	
+
 	sb.version_major = (uint16_t)VFS_VERSION_MAJOR;
 	sb.version_minor = (uint16_t)VFS_VERSION_MINOR;
 
@@ -348,116 +1382,336 @@ vfs_status_t vfs_save(void) {
 
 	sb.node_count = (uint32_t)node_count;
 	sb.data_bytes = data_bytes;
-	sb.root_index = (uint32_t)root_index;
-	sb.total_sectors = total_sectors;
+	sb.root_index = (uint32_t)g_root->index;
+	sb.total_sectors = image_lba + image_sectors - VFS_LBA_BASE;
 	sb.checksum = 0;
 
-	uint8_t sector[ATA_SECTOR_SIZE];
-	kmemset(sector, 0, ATA_SECTOR_SIZE);
-
-	for (size_t i = 0; i < sizeof(sb); i++) sector[i] = ((const uint8_t*)&sb)[i];
+	sb.journal_sectors = VFS_JOURNAL_SECTORS;
+	sb.generation = g_gen + 1u;
+	sb.next_ino = g_next_ino;
+	sb.image_lba = image_lba;
+	sb.checksum = crc32(&sb, sizeof(sb));
+
+	vfs_writer_t w;
+	w.buf = (uint8_t*)kmalloc_tagged(VFS_WRITE_BATCH * ATA_SECTOR_SIZE, HEAP_TAG_VFS);
+	w.lba = image_lba;
+	w.count = 0;
+	w.fill = 0;
+	uint32_t* crcs = (uint32_t*)kmalloc_tagged((1u + chunks_total) * sizeof(uint32_t), HEAP_TAG_VFS);
+	if (!w.buf || !crcs) {
+		if (w.buf) kfree(w.buf);
+		if (crcs) kfree(crcs);
+		kfree(nodes);
+		return VFS_ERR_NO_MEM;
+	}
 
-	if (ata_pio_write28(VFS_LBA_BASE, sector) != 0) return VFS_ERR_BUSY;
+	vfs_status_t st = VFS_ERR_BUSY;
 
-	uint32_t data_cursor = 0;
-	uint32_t lba = VFS_LBA_BASE + 1u;
+	// from here on the older image may be partly overwritten
+	uint32_t alt_data_lba = g_alt_data_lba;
+	g_alt_data_lba = 0;
 
-	uint32_t written_nodes = 0;
-	for (uint32_t s = 0; s < node_table_sectors; s++) {
-		kmemset(sector, 0, ATA_SECTOR_SIZE);
-		uint32_t off = s * ATA_SECTOR_SIZE;
-		for (uint32_t j = 0; j < ATA_SECTOR_SIZE; j++) {
-			uint32_t pos = off + j;
-			if (pos >= node_table_bytes) break;
+	// node table, each entry built exactly once
+	uint32_t table_crc = 0;
+	for (int i = 0; i < node_count; i++) {
+		vfs_node_t* mn = nodes[i];
+		vfs_disk_node_t dn;
+		kmemset(&dn, 0, sizeof(dn));
+		dn.type = (uint8_t)mn->type;
+		dn.flags = mn->flags;
+		dn.ino = mn->ino;
+		for (int k = 0; k < 31; k++) dn.name[k] = mn->name[k];
+		dn.name[31] = '\0';
+
+		dn.parent = mn->parent ? mn->parent->index : -1;
+		dn.first_child = mn->child_head ? mn->child_head->index : -1;
+		dn.next_sibling = mn->sibling_next ? mn->sibling_next->index : -1;
+
+		if (has_data(mn)) {
+			dn.file_off = mn->ckpt_off;
+			dn.file_len = (uint32_t)mn->file_size;
+		}
 
-			uint32_t ni = pos / sizeof(vfs_disk_node_t);
-			uint32_t bi = pos % sizeof(vfs_disk_node_t);
+		table_crc = crc32_update(table_crc, &dn, sizeof(dn));
+		if (writer_put(&w, &dn, sizeof(dn)) != 0) goto out;
+	}
+	crcs[0] = table_crc;
+	if (writer_skip(&w, node_table_sectors - bytes_to_sectors((uint32_t)node_count * (uint32_t)sizeof(vfs_disk_node_t))) != 0) goto out;
 
-			if (ni >= (uint32_t)node_count) break;
+	vfs_phase(TRACE_VFS_CHECKPOINT, 1, &t);
 
-			vfs_node_t* mn = nodes[ni];
-			vfs_disk_node_t dn;
-			kmemset(&dn, 0, sizeof(dn));
-			dn.type = (uint8_t)mn->type;
-			dn.flags = mn->flags;
-
-			kmemset(dn.name, 0, sizeof(dn.name));
-			for (int k = 0; k < 31; k++) dn.name[k] = mn->name[k];
-			dn.name[31] = '\0';
-
-			dn.parent = (mn->parent) ? find_index(nodes, node_count, mn->parent) : -1;
-			dn.first_child = (mn->child_head) ? find_index(nodes, node_count, mn->child_head) : -1;
-			dn.next_sibling = (mn->sibling_next) ? find_index(nodes, node_count, mn->sibling_next) : -1;
-
-			if (mn->type == NODE_FILE && mn->file_data && mn->file_size) {
-				dn.file_off = data_cursor;
-				dn.file_len = (uint32_t)mn->file_size;
-			} else {
-				dn.file_off = 0;
-				dn.file_len = 0;
+	// file contents at the offsets above, skipping chunks already there
+	uint32_t ci = 1;
+	uint32_t kept = 0;
+	for (int i = 0; i < node_count; i++) {
+		vfs_node_t* n = nodes[i];
+		if (!has_data(n)) continue;
+		int same_place = (data_lba == alt_data_lba && n->ckpt_off == n->alt_off);
+		for (uint32_t k = 0; k < chunk_count(n->file_size); k++) {
+			uint32_t used = chunk_used(n, k);
+			if (chunk_unchanged(n, k, same_place)) {
+				crcs[ci++] = n->chunks[k].crc;
+				kept += bytes_to_sectors(used);
+				if (writer_skip(&w, bytes_to_sectors(used)) != 0) goto out;
+				continue;
 			}
+			crcs[ci++] = crc32(n->chunks[k].data, used);
+			if (writer_put(&w, n->chunks[k].data, used) != 0) goto out;
+		}
+		if (writer_pad(&w) != 0) goto out;
+	}
 
-			sector[j] = ((uint8_t*)&dn)[bi];
+	vfs_phase(TRACE_VFS_CHECKPOINT, 2, &t);
 
-			if (bi == sizeof(vfs_disk_node_t) - 1) {
-				if (mn->type == NODE_FILE && mn->file_data && mn->file_size) {
-					data_cursor += (uint32_t)mn->file_size;
-				}
-				written_nodes++;
-			}
+	// VFS_COMPAT_TRIGRAMS, zeros for directories
+	for (int i = 0; i < node_count; i++) {
+		if (writer_put(&w, nodes[i]->tri, sizeof(nodes[i]->tri)) != 0) goto out;
+	}
+	if (writer_pad(&w) != 0) goto out;
+
+	// VFS_COMPAT_CRC32
+	if (writer_put(&w, crcs, (1u + chunks_total) * (uint32_t)sizeof(uint32_t)) != 0) goto out;
+	if (writer_pad(&w) != 0) goto out;
+	if (writer_flush(&w) != 0) goto out;
+	vfs_phase(TRACE_VFS_CHECKPOINT, 3, &t);
+
+	// the image has to be on the disk before a superblock that points at
+	// it. until that one sector is written a crash mounts the old image
+	// and replays the old journal, neither of which was touched
+	if (bcache_sync() != 0) goto out;
+	vfs_phase(TRACE_VFS_CHECKPOINT, 4, &t);
+
+	kmemset(w.buf, 0, ATA_SECTOR_SIZE);
+	kmemcpy(w.buf, &sb, sizeof(sb));
+	if (bcache_write(VFS_LBA_BASE, 1, w.buf) != 0) goto out;
+
+	// every file now has an up to date copy in the new data region, and
+	// the old live image is the one a later checkpoint may keep chunks of
+	ci = 1;
+	for (int i = 0; i < node_count; i++) {
+		vfs_node_t* n = nodes[i];
+		if (n->type != NODE_FILE) continue;
+		n->alt_off = n->disk_off;
+		n->alt_size = n->disk_size;
+		for (uint32_t k = 0; k < n->chunk_cap; k++) {
+			n->chunks[k].alt_crc = n->chunks[k].crc;
+			n->chunks[k].alt_ok = n->chunks[k].crc_ok;
+		}
+		n->disk_off = n->ckpt_off;
+		n->disk_size = n->file_size;
+		for (uint32_t k = 0; k < chunk_count(n->file_size); k++) {
+			n->chunks[k].dirty = 0;
+			n->chunks[k].crc = crcs[ci++];
+			n->chunks[k].crc_ok = 1;
 		}
-
-		if (ata_pio_write28(lba + s, sector) != 0) return VFS_ERR_BUSY;
 	}
+	g_alt_lba = g_image_lba;
+	g_alt_data_lba = g_data_lba;
+	g_data_lba = data_lba;
+	g_image_lba = image_lba;
+	g_image_end = image_lba + image_sectors;
+	g_stats.checkpoints++;
+	g_stats.data_sectors_written += data_sectors - kept;
+	g_stats.data_sectors_kept += kept;
+
+	g_gen = sb.generation;
+	g_jcursor = 0;
+	kmemset(g_jtail, 0, ATA_SECTOR_SIZE);
+	g_need_checkpoint = 0;
+	st = VFS_OK;
+	vfs_phase(TRACE_VFS_CHECKPOINT, 5, &t);
+
+out:
+	kfree(crcs);
+	kfree(w.buf);
+	kfree(nodes);
+	return st;
+}
 
-	uint32_t data_lba = VFS_LBA_BASE + 1u + node_table_sectors;
-	uint32_t blob_written = 0;
-
-	for (uint32_t s = 0; s < data_sectors; s++) {
-		kmemset(sector, 0, ATA_SECTOR_SIZE);
-		uint32_t fill = 0;
+// mutations have already logged themselves into the journal, so a save
+// only costs a checkpoint when the journal is full or was never started.
+// either way the journal tail, and the superblock after a checkpoint, go
+// to the disk before the tree counts as clean. only the vfs writes
+// through the block cache, so its dirty sectors are exactly those
+vfs_status_t vfs_save(void) {
+	if (!g_root) return VFS_ERR_NOT_FOUND;
 
-		while (fill < ATA_SECTOR_SIZE && blob_written < data_bytes) {
-			uint32_t acc = 0;
-			vfs_node_t* src = 0;
-			uint32_t src_off = 0;
+	if (g_need_checkpoint) {
+		vfs_status_t st = vfs_checkpoint();
+		if (st != VFS_OK) return st;
+	}
+	if (bcache_sync() != 0) return VFS_ERR_BUSY;
+	vfs_mark_clean();
+	return VFS_OK;
+}
 
-			for (int i = 0; i < node_count; i++) {
-				if (nodes[i]->type != NODE_FILE || !nodes[i]->file_data || !nodes[i]->file_size) continue;
-				uint32_t len = (uint32_t)nodes[i]->file_size;
-				if (blob_written >= acc && blob_written < acc + len) {
-					src = nodes[i];
-					src_off = blob_written - acc;
-					break;
-				}
-				acc += len;
-			}
+// traced phases: 0 save, 1 cache write back
+vfs_status_t vfs_sync(void) {
+	uint64_t t = cpu_rdtsc();
+	if (g_dirty) {
+		vfs_status_t st = vfs_save();
+		if (st != VFS_OK) return st;
+	}
+	vfs_phase(TRACE_VFS_SYNC, 0, &t);
+	if (bcache_sync() != 0) return VFS_ERR_BUSY;
+	vfs_phase(TRACE_VFS_SYNC, 1, &t);
+	return VFS_OK;
+}
 
-			if (!src) break;
+typedef struct {
+	uint32_t pos;		// byte offset into the journal
+	uint32_t loaded;	// sector index held in buf, or ~0
+	uint8_t buf[ATA_SECTOR_SIZE];
+} vfs_jreader_t;
+
+static int jread(vfs_jreader_t* r, void* dst, uint32_t len) {
+	uint8_t* out = (uint8_t*)dst;
+	if (len > VFS_JOURNAL_BYTES - r->pos) return 0;
+	while (len > 0) {
+		uint32_t sec = r->pos / ATA_SECTOR_SIZE;
+		if (sec != r->loaded) {
+			if (bcache_read(VFS_JOURNAL_LBA + sec, 1, r->buf) != 0) return 0;
+			r->loaded = sec;
+		}
+		uint32_t off = r->pos % ATA_SECTOR_SIZE;
+		uint32_t n = ATA_SECTOR_SIZE - off;
+		if (n > len) n = len;
+		kmemcpy(out, r->buf + off, n);
+		out += n;
+		r->pos += n;
+		len -= n;
+	}
+	return 1;
+}
 
-			uint32_t remaining = (uint32_t)src->file_size - src_off;
-			uint32_t to_copy = ATA_SECTOR_SIZE - fill;
-			if (to_copy > remaining) to_copy = remaining;
+static void replay_apply(const vfs_jrec_t* rec, uint8_t* payload) {
+	vfs_node_t* n = (rec->type == JREC_CREATE) ? 0 : find_ino(g_root, rec->ino);
+
+	switch (rec->type) {
+		case JREC_CREATE: {
+			if (rec->len != sizeof(vfs_jcreate_t)) return;
+			vfs_jcreate_t* c = (vfs_jcreate_t*)payload;
+			vfs_node_t* parent = find_ino(g_root, c->parent);
+			if (!parent || parent->type != NODE_DIR) return;
+			if (c->type != NODE_DIR && c->type != NODE_FILE) return;
+
+			c->name[31] = '\0';
+			vfs_node_t* child = node_alloc((node_type_t)c->type, c->name, parent);
+			if (!child) return;
+			child->ino = rec->ino;
+			child->flags = c->flags;
+			link_child(parent, child);
+			if (rec->ino >= g_next_ino) g_next_ino = rec->ino + 1u;
+			break;
+		}
+		case JREC_DATA:
+			if (!n || n->type != NODE_FILE) return;
+			set_content(n, (const char*)payload, rec->len);
+			break;
+		case JREC_WRITE: {
+			if (!n || n->type != NODE_FILE || rec->len < sizeof(uint32_t)) return;
+			uint32_t off;
+			kmemcpy(&off, payload, sizeof(off));
+			content_write(n, off, (const char*)payload + sizeof(off), rec->len - sizeof(off));
+			break;
+		}
+		case JREC_TRUNC: {
+			if (!n || n->type != NODE_FILE || rec->len != sizeof(uint32_t)) return;
+			uint32_t size;
+			kmemcpy(&size, payload, sizeof(size));
+			content_truncate(n, size);
+			break;
+		}
+		case JREC_FLAGS:
+			if (n && rec->len == 1) n->flags = payload[0];
+			break;
+		case JREC_REMOVE:
+			if (!n || !n->parent || n->child_head) return;
+			remove_child(n->parent, n);
+			n->parent = 0;
+			n->sibling_next = 0;
+			free_subtree(n);
+			break;
+	}
+}
 
-			for (uint32_t k = 0; k < to_copy; k++) {
-				sector[fill + k] = (uint8_t)src->file_data[src_off + k];
-			}
+// walk the records of this generation in order. the first one that is
+// stale, torn or fails its sum is where the log ends
+static void journal_replay(void) {
+	vfs_jreader_t r;
+	r.pos = 0;
+	r.loaded = 0xFFFFFFFFu;
+
+	for (;;) {
+		uint32_t start = r.pos;
+		vfs_jrec_t rec;
+		uint8_t* payload = 0;
+
+		int ok = jread(&r, &rec, sizeof(rec)) &&
+			 rec.magic == VFS_JREC_MAGIC && rec.gen == g_gen &&
+			 rec.len <= VFS_JOURNAL_BYTES - r.pos;
+		if (ok && rec.len > 0) {
+			payload = (uint8_t*)kmalloc_tagged(rec.len, HEAP_TAG_VFS);
+			ok = payload && jread(&r, payload, rec.len);
+		}
+		if (ok) ok = jrec_sum(&rec, payload, rec.len, 0, 0) == rec.sum;
 
-			fill += to_copy;
-			blob_written += to_copy;
+		if (ok) replay_apply(&rec, payload);
+		if (payload) kfree(payload);
+		if (!ok) {
+			r.pos = start;
+			break;
 		}
+	}
 
-		if (ata_pio_write28(data_lba + s, sector) != 0) return VFS_ERR_BUSY;
+	// keep appending right after the last good record
+	g_jcursor = r.pos;
+	kmemset(g_jtail, 0, ATA_SECTOR_SIZE);
+	if (g_jcursor % ATA_SECTOR_SIZE) {
+		bcache_read(VFS_JOURNAL_LBA + g_jcursor / ATA_SECTOR_SIZE, 1, g_jtail);
+		// drop whatever followed the end of the log
+		kmemset(g_jtail + g_jcursor % ATA_SECTOR_SIZE, 0, ATA_SECTOR_SIZE - g_jcursor % ATA_SECTOR_SIZE);
 	}
+}
 
-	kfree(nodes);
-	vfs_mark_clean();
-	return VFS_OK;
+// VFS_COMPAT_CRC32 table, entry 0 is the node table
+static uint32_t* load_crcs(const vfs_superblock_t* sb, uint32_t data_lba, uint32_t chunks_total) {
+	uint32_t lba = data_lba + bytes_to_sectors(sb->data_bytes);
+	if (sb->compat_flags & VFS_COMPAT_TRIGRAMS) lba += bytes_to_sectors(sb->node_count * (uint32_t)(VFS_TRI_WORDS * sizeof(uint32_t)));
+
+	uint32_t bytes = (1u + chunks_total) * (uint32_t)sizeof(uint32_t);
+	uint32_t sectors = bytes_to_sectors(bytes);
+	uint32_t* crcs = (uint32_t*)kmalloc_tagged(sectors * ATA_SECTOR_SIZE, HEAP_TAG_VFS);
+	if (!crcs) return 0;
+	if (bcache_read(lba, sectors, (uint8_t*)crcs) != 0) {
+		kfree(crcs);
+		return 0;
+	}
+	return crcs;
+}
+
+// optional, a node whose bits are missing gets them on the next search
+static void load_trigrams(const vfs_superblock_t* sb, vfs_node_t** nodes) {
+	uint32_t bytes = sb->node_count * (uint32_t)sizeof(nodes[0]->tri);
+	uint32_t sectors = bytes_to_sectors(bytes);
+	uint8_t* buf = (uint8_t*)kmalloc_tagged(sectors * ATA_SECTOR_SIZE, HEAP_TAG_VFS);
+	if (!buf) return;
+
+	if (bcache_read(g_data_lba + bytes_to_sectors(sb->data_bytes), sectors, buf) == 0) {
+		for (uint32_t i = 0; i < sb->node_count; i++) {
+			kmemcpy(nodes[i]->tri, buf + i * sizeof(nodes[i]->tri), sizeof(nodes[i]->tri));
+			nodes[i]->tri_ok = 1;
+		}
+	}
+	kfree(buf);
 }
 
+// traced phases: 0 superblock, 1 node table and checksums, 2 nodes,
+// 3 indexes, 4 journal replay
 vfs_status_t vfs_load(void) {
+	uint64_t t = cpu_rdtsc();
 	uint8_t sector[ATA_SECTOR_SIZE];
-	if (ata_pio_read28(VFS_LBA_BASE, sector) != 0) return VFS_ERR_NOT_FOUND;
+	if (bcache_read(VFS_LBA_BASE, 1, sector) != 0) return VFS_ERR_NOT_FOUND;
 
 	vfs_superblock_t sb;
 	kmemset(&sb, 0, sizeof(sb));
@@ -465,46 +1719,73 @@ vfs_status_t vfs_load(void) {
 
 	if (sb.magic != VFS_MAGIC) return VFS_ERR_NOT_FOUND;
 
+	// a superblock from before VFS_INCOMPAT_IMAGE_LBA is shorter, and its
+	// image follows the journal
+	const uint32_t short_header = (uint32_t)offsetof(vfs_superblock_t, image_lba);
+	int movable = (sb.incompat_flags & VFS_INCOMPAT_IMAGE_LBA) != 0;
+
 	// reject incompatible major version
 	if (sb.version_major != VFS_VERSION_MAJOR) {
 		return VFS_ERR_BUSY;
 	}
 
 	// reject if on-disk node/header sizes do not match current build
-	if (sb.header_size != sizeof(vfs_superblock_t)) return VFS_ERR_BUSY;
+	if (sb.header_size != (movable ? sizeof(vfs_superblock_t) : short_header)) return VFS_ERR_BUSY;
 	if (sb.node_size   != sizeof(vfs_disk_node_t))  return VFS_ERR_BUSY;
 
 	// reject incompatible or unsupported features
 	if ((sb.incompat_flags & ~VFS_INCOMPAT_FLAGS) != 0) return VFS_ERR_BUSY;
+	if (sb.journal_sectors != VFS_JOURNAL_SECTORS) return VFS_ERR_BUSY;
+
+	if (sb.compat_flags & VFS_COMPAT_CRC32) {
+		vfs_superblock_t raw = sb;
+		raw.checksum = 0;
+		if (crc32(&raw, sb.header_size) != sb.checksum) return VFS_ERR_CORRUPT;
+	}
+	if (!movable) sb.image_lba = VFS_JOURNAL_LBA + sb.journal_sectors;
+	if (sb.image_lba < VFS_JOURNAL_LBA + sb.journal_sectors || sb.image_lba >= VFS_LBA_BASE + sb.total_sectors) {
+		return VFS_ERR_CORRUPT;
+	}
 	
 	if (sb.node_count == 0 || sb.node_count > 1024) return VFS_ERR_NOT_FOUND;
 
-	uint32_t node_table_bytes = sb.node_count * (uint32_t)sizeof(vfs_disk_node_t);
-	uint32_t node_table_sectors = bytes_to_sectors(node_table_bytes);
-	uint32_t data_sectors = bytes_to_sectors(sb.data_bytes);
+	vfs_phase(TRACE_VFS_LOAD, 0, &t);
 
-	uint8_t* nodebuf = (uint8_t*)kmalloc(node_table_sectors * ATA_SECTOR_SIZE);
+	vfs_status_t st = VFS_ERR_BUSY;
+	uint32_t* crcs = 0;
+	vfs_node_t** nodes = 0;
+
+	uint32_t node_table_bytes = sb.node_count * (uint32_t)sizeof(vfs_disk_node_t);
+	uint32_t node_table_read = bytes_to_sectors(node_table_bytes);
+	uint8_t* nodebuf = (uint8_t*)kmalloc_tagged(node_table_read * ATA_SECTOR_SIZE, HEAP_TAG_VFS);
 	if (!nodebuf) return VFS_ERR_NO_MEM;
 
-	for (uint32_t s = 0; s < node_table_sectors; s++) {
-		if (ata_pio_read28(VFS_LBA_BASE + 1u + s, sector) != 0) return VFS_ERR_BUSY;
-		for (uint32_t j = 0; j < ATA_SECTOR_SIZE; j++) nodebuf[s * ATA_SECTOR_SIZE + j] = sector[j];
-	}
+	uint32_t image_lba = sb.image_lba;
+	if (bcache_read(image_lba, node_table_read, nodebuf) != 0) goto fail;
 
-	uint8_t* databuf = 0;
-	if (sb.data_bytes > 0) {
-		databuf = (uint8_t*)kmalloc(data_sectors * ATA_SECTOR_SIZE);
-		if (!databuf) return VFS_ERR_NO_MEM;
+	// file contents stay on disk until someone opens the file
+	uint32_t data_lba = image_lba + node_table_sectors_for(sb.node_count, sb.incompat_flags);
 
-		uint32_t data_lba = VFS_LBA_BASE + 1u + node_table_sectors;
-		for (uint32_t s = 0; s < data_sectors; s++) {
-			if (ata_pio_read28(data_lba + s, sector) != 0) return VFS_ERR_BUSY;
-			for (uint32_t j = 0; j < ATA_SECTOR_SIZE; j++) databuf[s * ATA_SECTOR_SIZE + j] = sector[j];
+	uint32_t chunks_total = 0;
+	if (sb.compat_flags & VFS_COMPAT_CRC32) {
+		for (uint32_t i = 0; i < sb.node_count; i++) {
+			vfs_disk_node_t dn;
+			kmemcpy(&dn, nodebuf + i * sizeof(vfs_disk_node_t), sizeof(dn));
+			if (dn.type == NODE_FILE && dn.file_len <= VFS_FILE_MAX) chunks_total += chunk_count(dn.file_len);
+		}
+		crcs = load_crcs(&sb, data_lba, chunks_total);
+		if (!crcs) goto fail;
+		if (crcs[0] != crc32(nodebuf, node_table_bytes)) {
+			st = VFS_ERR_CORRUPT;
+			goto fail;
 		}
 	}
 
-	vfs_node_t** nodes = (vfs_node_t**)kmalloc(sizeof(vfs_node_t*) * sb.node_count);
-	if (!nodes) return VFS_ERR_NO_MEM;
+	vfs_phase(TRACE_VFS_LOAD, 1, &t);
+
+	st = VFS_ERR_NO_MEM;
+	nodes = (vfs_node_t**)kmalloc_tagged(sizeof(vfs_node_t*) * sb.node_count, HEAP_TAG_VFS);
+	if (!nodes) goto fail;
 	for (uint32_t i = 0; i < sb.node_count; i++) nodes[i] = 0;
 
 	for (uint32_t i = 0; i < sb.node_count; i++) {
@@ -515,34 +1796,36 @@ vfs_status_t vfs_load(void) {
 			((uint8_t*)&dn)[b] = nodebuf[base + b];
 		}
 
-		vfs_node_t* n = (vfs_node_t*)kmalloc(sizeof(vfs_node_t));
-		if (!n) return VFS_ERR_NO_MEM;
+		st = VFS_ERR_NO_MEM;
+		vfs_node_t* n = (vfs_node_t*)kmalloc_tagged(sizeof(vfs_node_t), HEAP_TAG_VFS);
+		if (!n) goto fail;
 		kmemset(n, 0, sizeof(vfs_node_t));
+		nodes[i] = n;
 
 		n->type = (node_type_t)dn.type;
 		n->flags = dn.flags;
+		n->ino = dn.ino;
 		
-		if (n->type != NODE_DIR && n->type != NODE_FILE) {
-			// bad image
-			return VFS_ERR_NOT_FOUND;
-		}
+		// bad image
+		st = VFS_ERR_NOT_FOUND;
+		if (n->type != NODE_DIR && n->type != NODE_FILE) goto fail;
 		
 		for (int k = 0; k < 32; k++) n->name[k] = dn.name[k];
 		n->name[31] = '\0';
 
 		if (n->type == NODE_FILE && dn.file_len > 0) {
-			n->file_data = (char*)kmalloc(dn.file_len + 1u);
-			if (!n->file_data) return VFS_ERR_NO_MEM;
-			for (uint32_t k = 0; k < dn.file_len; k++) {
-				n->file_data[k] = (char)databuf[dn.file_off + k];
+			if (dn.file_off > sb.data_bytes || dn.file_len > sb.data_bytes - dn.file_off ||
+			    dn.file_len > VFS_FILE_MAX) {
+				goto fail;
 			}
-			n->file_data[dn.file_len] = '\0';
 			n->file_size = dn.file_len;
+			n->disk_size = dn.file_len;
+			n->disk_off = dn.file_off;
 		}
-
-		nodes[i] = n;
 	}
 
+	// every link has to name a node of this table
+	st = VFS_ERR_CORRUPT;
 	for (uint32_t i = 0; i < sb.node_count; i++) {
 		vfs_disk_node_t dn;
 		kmemset(&dn, 0, sizeof(dn));
@@ -551,19 +1834,82 @@ vfs_status_t vfs_load(void) {
 			((uint8_t*)&dn)[b] = nodebuf[base + b];
 		}
 
+		if (dn.parent >= (int32_t)sb.node_count || dn.first_child >= (int32_t)sb.node_count ||
+		    dn.next_sibling >= (int32_t)sb.node_count) {
+			goto fail;
+		}
 		vfs_node_t* n = nodes[i];
 		if (dn.parent >= 0) n->parent = nodes[(uint32_t)dn.parent];
 		if (dn.first_child >= 0) n->child_head = nodes[(uint32_t)dn.first_child];
 		if (dn.next_sibling >= 0) n->sibling_next = nodes[(uint32_t)dn.next_sibling];
 	}
 
+	// per chunk checksums in data order, checked as each chunk is read
+	if (crcs) {
+		st = VFS_ERR_NO_MEM;
+		uint32_t ci = 1;
+		for (uint32_t i = 0; i < sb.node_count; i++) {
+			vfs_node_t* n = nodes[i];
+			uint32_t count = chunk_count(n->file_size);
+			if (count == 0) continue;
+			if (!chunks_reserve(n, count)) goto fail;
+			for (uint32_t k = 0; k < count; k++) {
+				n->chunks[k].crc = crcs[ci++];
+				n->chunks[k].crc_ok = 1;
+			}
+		}
+		kfree(crcs);
+		crcs = 0;
+	}
+
+	vfs_phase(TRACE_VFS_LOAD, 2, &t);
+
+	// the tree being replaced goes, attachments and all
+	vfs_node_t* old_root = g_root;
+
+	g_data_lba = data_lba;
+	g_image_lba = image_lba;
+	g_image_end = VFS_LBA_BASE + sb.total_sectors;
+	g_alt_lba = 0;	// nothing is known about what lies outside it
+	g_alt_data_lba = 0;
 	g_root = nodes[sb.root_index < sb.node_count ? sb.root_index : 0];
+	index_reset();
+	handles_reset();
+	path_cache_invalidate();
+	name_index_insert(g_root);
+	dentry_rebuild(g_root);
+	if (sb.compat_flags & VFS_COMPAT_TRIGRAMS) load_trigrams(&sb, nodes);
+
+	kfree(nodes);
+	kfree(nodebuf);
+	if (old_root) free_subtree(old_root);
+
+	g_gen = sb.generation;
+	g_next_ino = sb.next_ino;
+	vfs_phase(TRACE_VFS_LOAD, 3, &t);
+	journal_replay();
+	vfs_phase(TRACE_VFS_LOAD, 4, &t);
+	g_need_checkpoint = (g_jcursor > (VFS_JOURNAL_BYTES / 4u) * 3u);
+
 	g_cwd = find_base_dir();
 	if (!g_cwd) g_cwd = g_root;
 
-	kfree(nodes);
 	vfs_mark_clean();
 	return VFS_OK;
+
+fail:
+	// the links may be half made, so free the nodes one by one
+	if (nodes) {
+		for (uint32_t i = 0; i < sb.node_count; i++) {
+			if (!nodes[i]) continue;
+			if (nodes[i]->type == NODE_FILE) content_free(nodes[i]);
+			kfree(nodes[i]);
+		}
+		kfree(nodes);
+	}
+	if (crcs) kfree(crcs);
+	kfree(nodebuf);
+	return st;
 }
 
 void vfs_shop(vfs_list_cb_t cb, void* user) {
@@ -597,26 +1943,108 @@ void vfs_grimoire(vfs_spell_cb_t cb, void* user) {
 }
 
 vfs_status_t vfs_learn(const char* filename) {
-	if (!g_cwd) return VFS_ERR_NOT_FOUND;
-	vfs_node_t* f = find_child(g_cwd, filename);
-	if (!f) return VFS_ERR_NOT_FOUND;
-	if (f->type != NODE_FILE) return VFS_ERR_IS_DIR;
-	if (!has_ms_extension(filename)) return VFS_ERR_NAME_INVALID;
+	vfs_node_t* f = 0;
+	vfs_status_t st = lookup_file(filename, &f);
+	if (st != VFS_OK) return st;
+	if (!has_ms_extension(f->name)) return VFS_ERR_NAME_INVALID;
 
 	f->flags |= 0x01;
+	journal_flags(f);
 	vfs_mark_dirty();
 	return VFS_OK;
 }
 
 vfs_status_t vfs_is_learned(const char* filename, int* out_learned) {
 	if (out_learned) *out_learned = 0;
-	if (!g_cwd) return VFS_ERR_NOT_FOUND;
-	vfs_node_t* f = find_child(g_cwd, filename);
-	if (!f) return VFS_ERR_NOT_FOUND;
-	if (f->type != NODE_FILE) return VFS_ERR_IS_DIR;
-	if (!has_ms_extension(filename)) return VFS_ERR_NAME_INVALID;
+	vfs_node_t* f = 0;
+	vfs_status_t st = lookup_file(filename, &f);
+	if (st != VFS_OK) return st;
+	if (!has_ms_extension(f->name)) return VFS_ERR_NAME_INVALID;
 
 	if (out_learned) *out_learned = (f->flags & 0x01) ? 1 : 0;
 	return VFS_OK;
 }
 
+vfs_status_t vfs_attach(const char* filename, void* obj, vfs_attach_free_t free_fn) {
+	vfs_node_t* f = 0;
+	vfs_status_t st = lookup_file(filename, &f);
+	if (st != VFS_OK) return st;
+
+	attach_drop(f);
+	f->attach = obj;
+	f->attach_free = free_fn;
+	return VFS_OK;
+}
+
+vfs_status_t vfs_attached(const char* filename, void** out_obj) {
+	if (out_obj) *out_obj = 0;
+	vfs_node_t* f = 0;
+	vfs_status_t st = lookup_file(filename, &f);
+	if (st != VFS_OK) return st;
+
+	if (out_obj) *out_obj = f->attach;
+	return f->attach ? VFS_OK : VFS_ERR_NOT_FOUND;
+}
+
+// candidates come from the name index and the trigram bits, only those
+// are read and checked with a real substring match
+vfs_status_t vfs_seek(vfs_seek_mode_t mode, const char* query, vfs_list_cb_t cb, void* user, vfs_seek_stats_t* out_stats) {
+	vfs_seek_stats_t stats;
+	kmemset(&stats, 0, sizeof(stats));
+	if (out_stats) *out_stats = stats;
+	if (!query || !query[0] || !cb) return VFS_ERR_NAME_INVALID;
+	if (!g_root) return VFS_ERR_NOT_FOUND;
+
+	size_t qlen = kstrlen(query);
+	uint32_t qname = name_sig(query);
+	uint32_t qtri[VFS_TRI_WORDS];
+	tri_bits(query, qlen, qtri);
+
+	vfs_status_t st = VFS_OK;
+	char path[VFS_PATH_MAX];
+	for (vfs_node_t* n = g_all; n; n = n->all_next) {
+		stats.nodes++;
+
+		if (mode == VFS_SEEK_NAME) {
+			if ((n->name_sig & qname) != qname) continue;
+			stats.candidates++;
+			if (!kstrstr(n->name, query)) continue;
+		} else {
+			if (n->type != NODE_FILE || n->file_size < qlen) continue;
+
+			// unindexed since mount, costs one read now and never again
+			uint32_t reads = g_chunk_reads;
+			if (!n->tri_ok) {
+				st = content_index(n);
+				if (st != VFS_OK) break;
+			}
+
+			int hit = 1;
+			for (uint32_t w = 0; w < VFS_TRI_WORDS; w++) {
+				if ((n->tri[w] & qtri[w]) != qtri[w]) { hit = 0; break; }
+			}
+			if (hit) {
+				stats.candidates++;
+				const char* text = 0;
+				st = flat_view(n, &text);
+				if (st != VFS_OK) break;
+				hit = kstrstr(text, query) != 0;
+			}
+			if (g_chunk_reads != reads) stats.read++;
+			if (!hit) continue;
+		}
+
+		stats.matches++;
+		node_path(n, path, sizeof(path));
+		cb(path, n->type == NODE_DIR, user);
+	}
+
+	if (out_stats) *out_stats = stats;
+	return st;
+}
+
+void vfs_get_stats(vfs_stats_t* out) {
+	if (!out) return;
+	*out = g_stats;
+	out->chunk_reads = g_chunk_reads;
+}
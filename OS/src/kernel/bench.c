@@ -0,0 +1,540 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel/bench.h"
+#include "kernel/shell.h"
+#include "kernel/task.h"
+#include "kernel/sched.h"
+#include "drivers/vga.h"
+#include "drivers/ata.h"
+#include "drivers/pit.h"
+#include "fs/vfs.h"
+#include "lib/str.h"
+#include "lib/div64.h"
+#include "mm/heap.h"
+#include "arsc/i386/cpu.h"
+#include "arsc/i386/fpu.h"
+#include "arsc/i386/ports.h"
+
+// every size class moves about 4 MiB in total; sizes and run counts are
+// powers of two so the per-call figure is a shift, not a 64-bit divide
+#define BENCH_TOTAL_SHIFT 22
+#define BENCH_MAX_SHIFT 16
+#define BENCH_MIN_RUNS_SHIFT 4
+
+#define BENCH_HAY_BYTES 16384
+#define BENCH_HAY_RUNS_SHIFT 5
+
+#define BENCH_CAL_MS 100
+#define BENCH_ALLOC_PAIRS 4096
+#define BENCH_ALLOC_BATCH 256
+#define BENCH_ALLOC_ROUNDS 16
+#define BENCH_LARGE_PAIRS 256
+#define BENCH_PINGPONG_ROUNDS 4096
+#define BENCH_DISK_LBA 1024u	// below VFS_LBA_BASE, the filesystem never writes it
+#define BENCH_DISK_SECTORS 128u
+#define BENCH_DISK_ROUNDS 4
+#define BENCH_TERM_LINES 96
+#define BENCH_VFS_NODES 128
+
+// QEMU's debug console and isa-debug-exit device, see the bench target in
+// the Makefile. only touched when the suite was started from boot
+#define BENCH_DEBUGCON 0xE9
+#define BENCH_EXIT_PORT 0xF4
+
+// keeps the compiler from merging or dropping the timed calls
+#define BENCH_BARRIER() __asm__ volatile ("" : : : "memory")
+
+static int g_console = 0;
+static uint32_t g_cycles_per_ms = 0;
+
+static void byte_copy(void* dst, const void* src, size_t n) {
+	volatile unsigned char* d = (volatile unsigned char*)dst;
+	const unsigned char* s = (const unsigned char*)src;
+	for (size_t i = 0; i < n; i++) d[i] = s[i];
+}
+
+static void byte_set(void* dst, int v, size_t n) {
+	volatile unsigned char* d = (volatile unsigned char*)dst;
+	for (size_t i = 0; i < n; i++) d[i] = (unsigned char)v;
+}
+
+// the scan kstrstr used before the skip table
+static const char* naive_strstr(const char* h, const char* n) {
+	for (size_t i = 0; h[i]; i++) {
+		size_t j = 0;
+		while (n[j] && h[i + j] && h[i + j] == n[j]) j++;
+		if (n[j] == '\0') return &h[i];
+	}
+	return 0;
+}
+
+static uint32_t clamp32(uint64_t v) {
+	return (v > 0xFFFFFFFFull) ? 0xFFFFFFFFu : (uint32_t)v;
+}
+
+static uint32_t per_op(uint64_t cycles, uint32_t ops) {
+	return clamp32(udiv64(cycles, ops ? ops : 1u, 0));
+}
+
+static uint32_t kib_per_sec(uint64_t bytes, uint64_t cycles) {
+	return clamp32(udiv64(bytes * g_cycles_per_ms * 1000u, cycles * 1024u, 0));
+}
+
+static void con_write(const char* s) {
+	while (*s) outb(BENCH_DEBUGCON, (uint8_t)*s++);
+}
+
+static void con_write_u32(uint32_t v) {
+	char tmp[11];
+	int p = 0;
+	if (v == 0) tmp[p++] = '0';
+	while (v > 0) { tmp[p++] = (char)('0' + (v % 10)); v /= 10; }
+	while (p > 0) outb(BENCH_DEBUGCON, (uint8_t)tmp[--p]);
+}
+
+// "BENCH <key> <value> <unit>" on the debug console, one line per figure
+static void con_result(const char* key, uint32_t value, const char* unit) {
+	if (!g_console) return;
+	con_write("BENCH ");
+	con_write(key);
+	con_write(" ");
+	con_write_u32(value);
+	con_write(" ");
+	con_write(unit);
+	con_write("\n");
+}
+
+static uint32_t per_call(uint64_t cycles, int runs_shift) {
+	cycles >>= runs_shift;
+	return (cycles > 0xFFFFFFFFull) ? 0xFFFFFFFFu : (uint32_t)cycles;
+}
+
+static void write_col(uint32_t v, int width) {
+	int digits = 1;
+	for (uint32_t x = v; x >= 10; x /= 10) digits++;
+	terminal_write_u32(v);
+	while (digits++ < width) terminal_putc(' ');
+}
+
+static void write_speedup(uint32_t before, uint32_t after) {
+	if (after == 0) after = 1;
+	uint32_t x10 = (before > 0xFFFFFFFFu / 10u) ? 0xFFFFFFFFu : before * 10u / after;
+	terminal_write_u32(x10 / 10);
+	terminal_putc('.');
+	terminal_write_u32(x10 % 10);
+	terminal_write("x\n");
+}
+
+typedef enum {
+	BENCH_COPY = 0,
+	BENCH_SET,
+	BENCH_MOVE
+} bench_op_t;
+
+static uint64_t time_op(bench_op_t op, int fast, uint8_t* a, uint8_t* b, size_t size, int runs_shift) {
+	uint32_t runs = 1u << runs_shift;
+	uint64_t t0 = cpu_rdtsc();
+	for (uint32_t i = 0; i < runs; i++) {
+		if (op == BENCH_COPY) {
+			if (fast) kmemcpy(a, b, size);
+			else byte_copy(a, b, size);
+		} else if (op == BENCH_SET) {
+			if (fast) kmemset(a, (int)i, size);
+			else byte_set(a, (int)i, size);
+		} else {
+			// overlapping, dst above src: the backward path
+			if (fast) kmemmove(a + 1, a, size);
+			else for (size_t k = size; k > 0; k--) ((volatile uint8_t*)a)[k] = a[k - 1];
+		}
+		BENCH_BARRIER();
+	}
+	return cpu_rdtsc() - t0;
+}
+
+static void con_size_result(const char* key, uint32_t size, const char* variant, uint32_t value) {
+	if (!g_console) return;
+	char name[40];
+	char num[11];
+	int p = 0;
+	for (uint32_t v = size; v > 0 || p == 0; v /= 10) num[p++] = (char)('0' + (v % 10));
+
+	kstrncpy0(name, key, sizeof(name));
+	size_t at = kstrlen(name);
+	if (at + (size_t)p + 2 < sizeof(name)) {
+		name[at++] = '_';
+		while (p > 0) name[at++] = num[--p];
+		name[at] = '\0';
+	}
+	size_t n = kstrlen(name);
+	if (n + 1 < sizeof(name)) {
+		name[n] = '_';
+		kstrncpy0(name + n + 1, variant, sizeof(name) - n - 1);
+	}
+	con_result(name, value, "cycles");
+}
+
+static void bench_rows(const char* title, const char* key, bench_op_t op, uint8_t* a, uint8_t* b) {
+	terminal_write(title);
+	terminal_write("\n  bytes  plain    fast     speedup\n");
+	static const int size_shifts[] = { 4, 6, 8, 12, BENCH_MAX_SHIFT };
+
+	for (size_t i = 0; i < sizeof(size_shifts) / sizeof(size_shifts[0]); i++) {
+		size_t size = (size_t)1 << size_shifts[i];
+		int runs_shift = BENCH_TOTAL_SHIFT - size_shifts[i];
+		if (runs_shift < BENCH_MIN_RUNS_SHIFT) runs_shift = BENCH_MIN_RUNS_SHIFT;
+
+		uint32_t slow = per_call(time_op(op, 0, a, b, size, runs_shift), runs_shift);
+		uint32_t fast = per_call(time_op(op, 1, a, b, size, runs_shift), runs_shift);
+
+		terminal_write("  ");
+		write_col((uint32_t)size, 7);
+		write_col(slow, 9);
+		write_col(fast, 9);
+		write_speedup(slow, fast);
+		con_size_result(key, (uint32_t)size, "plain", slow);
+		con_size_result(key, (uint32_t)size, "fast", fast);
+	}
+}
+
+static void bench_search(char* hay) {
+	terminal_write("strstr, 16 KiB haystack, match at the end\n");
+	terminal_write("  needle plain    fast     speedup\n");
+
+	// a small alphabet keeps partial matches frequent
+	uint32_t seed = 12345;
+	for (size_t i = 0; i < BENCH_HAY_BYTES; i++) {
+		seed = seed * 1103515245u + 12345u;
+		hay[i] = (char)('a' + ((seed >> 16) % 4u));
+	}
+	// one byte no other position has, so each needle first matches at the end
+	hay[BENCH_HAY_BYTES - 1] = 'z';
+	hay[BENCH_HAY_BYTES] = '\0';
+
+	static const size_t lens[] = { 4, 16, 64 };
+	for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		const char* needle = hay + BENCH_HAY_BYTES - lens[i];
+		const char* expect = kstrstr(hay, needle);
+		uint32_t runs = 1u << BENCH_HAY_RUNS_SHIFT;
+
+		uint64_t t0 = cpu_rdtsc();
+		for (uint32_t r = 0; r < runs; r++) {
+			if (naive_strstr(hay, needle) != expect) break;
+			BENCH_BARRIER();
+		}
+		uint64_t t1 = cpu_rdtsc();
+		for (uint32_t r = 0; r < runs; r++) {
+			if (kstrstr(hay, needle) != expect) break;
+			BENCH_BARRIER();
+		}
+		uint64_t t2 = cpu_rdtsc();
+
+		uint32_t slow = per_call(t1 - t0, BENCH_HAY_RUNS_SHIFT);
+		uint32_t fast = per_call(t2 - t1, BENCH_HAY_RUNS_SHIFT);
+
+		terminal_write("  ");
+		write_col((uint32_t)lens[i], 7);
+		write_col(slow, 9);
+		write_col(fast, 9);
+		write_speedup(slow, fast);
+		con_size_result("strstr", (uint32_t)lens[i], "plain", slow);
+		con_size_result("strstr", (uint32_t)lens[i], "fast", fast);
+	}
+}
+
+void bench_mem(void) {
+	size_t bytes = ((size_t)1 << BENCH_MAX_SHIFT) + 64;
+	uint8_t* a = (uint8_t*)kmalloc_tagged(bytes, HEAP_TAG_OTHER);
+	uint8_t* b = (uint8_t*)kmalloc_tagged(bytes, HEAP_TAG_OTHER);
+	if (!a || !b) {
+		if (a) kfree(a);
+		if (b) kfree(b);
+		terminal_write("Out of memory.\n");
+		return;
+	}
+	kmemset(b, 0x5A, bytes);
+
+	terminal_write("Cycles per call");
+	terminal_write(fpu_has_sse() ? ", SSE copies on\n" : ", no SSE\n");
+	bench_rows("memcpy", "memcpy", BENCH_COPY, a, b);
+	bench_rows("memset", "memset", BENCH_SET, a, b);
+	bench_rows("memmove, overlapping", "memmove", BENCH_MOVE, a, b);
+	bench_search((char*)a);
+
+	kfree(a);
+	kfree(b);
+}
+
+// one figure for the terminal and the debug console
+static void result(const char* key, uint32_t value, const char* unit) {
+	terminal_write("  ");
+	terminal_write(key);
+	for (size_t n = kstrlen(key); n < 22; n++) terminal_putc(' ');
+	write_col(value, 11);
+	terminal_write(unit);
+	terminal_putc('\n');
+	con_result(key, value, unit);
+}
+
+// TSC rate against the PIT, for the throughput figures
+static void calibrate(void) {
+	uint32_t start = pit_ticks();
+	while (pit_ticks() == start) BENCH_BARRIER();
+
+	uint32_t t0 = pit_ticks();
+	uint64_t c0 = cpu_rdtsc();
+	while (pit_ticks() - t0 < pit_ms_to_ticks(BENCH_CAL_MS)) BENCH_BARRIER();
+	g_cycles_per_ms = per_op(cpu_rdtsc() - c0, BENCH_CAL_MS);
+}
+
+static void bench_alloc(void) {
+	static void* ptrs[BENCH_ALLOC_BATCH];
+	terminal_write("heap, cycles per kmalloc + kfree\n");
+
+	uint64_t t0 = cpu_rdtsc();
+	for (uint32_t i = 0; i < BENCH_ALLOC_PAIRS; i++) {
+		void* p = kmalloc(32);
+		BENCH_BARRIER();
+		if (p) kfree(p);
+	}
+	result("heap_pair_32", per_op(cpu_rdtsc() - t0, BENCH_ALLOC_PAIRS), "cycles");
+
+	// a batch of one size, freed in allocation order
+	t0 = cpu_rdtsc();
+	for (int r = 0; r < BENCH_ALLOC_ROUNDS; r++) {
+		for (int i = 0; i < BENCH_ALLOC_BATCH; i++) ptrs[i] = kmalloc(64);
+		for (int i = 0; i < BENCH_ALLOC_BATCH; i++) if (ptrs[i]) kfree(ptrs[i]);
+	}
+	result("heap_batch_64", per_op(cpu_rdtsc() - t0, BENCH_ALLOC_ROUNDS * BENCH_ALLOC_BATCH), "cycles");
+
+	// mixed sizes from 16 bytes to 4 KiB, freed in a shuffled order
+	uint32_t seed = 2463534242u;
+	t0 = cpu_rdtsc();
+	for (int r = 0; r < BENCH_ALLOC_ROUNDS; r++) {
+		for (int i = 0; i < BENCH_ALLOC_BATCH; i++) {
+			seed = seed * 1103515245u + 12345u;
+			ptrs[i] = kmalloc((size_t)16 << ((seed >> 16) % 9u));
+		}
+		for (int i = BENCH_ALLOC_BATCH - 1; i > 0; i--) {
+			seed = seed * 1103515245u + 12345u;
+			int j = (int)((seed >> 16) % (uint32_t)(i + 1));
+			void* tmp = ptrs[i];
+			ptrs[i] = ptrs[j];
+			ptrs[j] = tmp;
+		}
+		for (int i = 0; i < BENCH_ALLOC_BATCH; i++) if (ptrs[i]) kfree(ptrs[i]);
+	}
+	result("heap_mixed", per_op(cpu_rdtsc() - t0, BENCH_ALLOC_ROUNDS * BENCH_ALLOC_BATCH), "cycles");
+
+	t0 = cpu_rdtsc();
+	for (uint32_t i = 0; i < BENCH_LARGE_PAIRS; i++) {
+		void* p = kmalloc(65536);
+		BENCH_BARRIER();
+		if (p) kfree(p);
+	}
+	result("heap_pair_64k", per_op(cpu_rdtsc() - t0, BENCH_LARGE_PAIRS), "cycles");
+}
+
+typedef struct {
+	volatile int left;
+	volatile uint64_t end;
+} pingpong_t;
+
+static void pingpong_task(void* arg) {
+	pingpong_t* pp = (pingpong_t*)arg;
+	for (int i = 0; i < BENCH_PINGPONG_ROUNDS; i++) yield();
+
+	// the last one out stops the clock, neither touches pp after that
+	uint32_t f = irq_save();
+	if (--pp->left == 0) pp->end = cpu_rdtsc();
+	irq_restore(f);
+}
+
+// two tasks at the top level yielding to each other, one switch per yield
+static void bench_yield(void) {
+	terminal_write("scheduler\n");
+	pingpong_t pp = { 2, 0 };
+
+	// neither task runs before both are queued
+	uint32_t f = irq_save();
+	int a = task_create_arg(pingpong_task, &pp, "bench-ping");
+	int b = task_create_arg(pingpong_task, &pp, "bench-pong");
+	if (a < 0 || b < 0) {
+		if (a >= 0) task_kill(a);
+		if (b >= 0) task_kill(b);
+		irq_restore(f);
+		terminal_write("  yield: no free task slots\n");
+		return;
+	}
+	// killing one would leave pp.left up and the suite waiting for good
+	task_pin(a, 1);
+	task_pin(b, 1);
+	sched_set_priority(task_at(a), 0);
+	sched_set_priority(task_at(b), 0);
+	uint64_t t0 = cpu_rdtsc();
+	irq_restore(f);
+
+	while (pp.left > 0) task_sleep_ms(1);
+	result("yield_pingpong", per_op(pp.end - t0, 2u * BENCH_PINGPONG_ROUNDS), "cycles");
+}
+
+// the sectors are written back with what was read from them, so nothing
+// on the disk changes
+static void bench_disk(void) {
+	terminal_write("disk, LBA ");
+	terminal_write_u32(BENCH_DISK_LBA);
+	terminal_write(ata_dma_active() ? ", DMA\n" : ", PIO\n");
+
+	uint32_t bytes = BENCH_DISK_SECTORS * ATA_SECTOR_SIZE;
+	uint8_t* buf = (uint8_t*)kmalloc_tagged(bytes, HEAP_TAG_OTHER);
+	if (!buf) {
+		terminal_write("  Out of memory.\n");
+		return;
+	}
+	if (ata_pio_read28(BENCH_DISK_LBA, buf) != 0) {
+		terminal_write("  no drive\n");
+		kfree(buf);
+		return;
+	}
+
+	int err = 0;
+	uint64_t t0 = cpu_rdtsc();
+	for (uint32_t i = 0; i < BENCH_DISK_SECTORS; i++) {
+		err |= ata_pio_read28(BENCH_DISK_LBA + i, buf + i * ATA_SECTOR_SIZE);
+	}
+	uint64_t pio_read = cpu_rdtsc() - t0;
+
+	t0 = cpu_rdtsc();
+	for (uint32_t i = 0; i < BENCH_DISK_SECTORS; i++) {
+		err |= ata_pio_write28(BENCH_DISK_LBA + i, buf + i * ATA_SECTOR_SIZE);
+	}
+	err |= ata_flush();
+	uint64_t pio_write = cpu_rdtsc() - t0;
+
+	t0 = cpu_rdtsc();
+	for (int r = 0; r < BENCH_DISK_ROUNDS; r++) err |= ata_read28_n(BENCH_DISK_LBA, BENCH_DISK_SECTORS, buf);
+	uint64_t n_read = cpu_rdtsc() - t0;
+
+	t0 = cpu_rdtsc();
+	for (int r = 0; r < BENCH_DISK_ROUNDS; r++) err |= ata_write28_n(BENCH_DISK_LBA, BENCH_DISK_SECTORS, buf);
+	err |= ata_sync();
+	uint64_t n_write = cpu_rdtsc() - t0;
+	kfree(buf);
+
+	if (err) {
+		terminal_write("  disk error\n");
+		return;
+	}
+	result("disk_pio_read", per_op(pio_read, BENCH_DISK_SECTORS), "cycles/sector");
+	result("disk_pio_read_rate", kib_per_sec(bytes, pio_read), "KiB/s");
+	result("disk_pio_write", per_op(pio_write, BENCH_DISK_SECTORS), "cycles/sector");
+	result("disk_pio_write_rate", kib_per_sec(bytes, pio_write), "KiB/s");
+	result("disk_read_n", per_op(n_read, BENCH_DISK_ROUNDS * BENCH_DISK_SECTORS), "cycles/sector");
+	result("disk_read_n_rate", kib_per_sec((uint64_t)bytes * BENCH_DISK_ROUNDS, n_read), "KiB/s");
+	result("disk_write_n", per_op(n_write, BENCH_DISK_ROUNDS * BENCH_DISK_SECTORS), "cycles/sector");
+	result("disk_write_n_rate", kib_per_sec((uint64_t)bytes * BENCH_DISK_ROUNDS, n_write), "KiB/s");
+}
+
+static void bench_terminal(void) {
+	static const char line[] = "the quick brown fox jumps over the lazy dog, 0123456789 abcdefgh\n";
+
+	uint64_t t0 = cpu_rdtsc();
+	for (int i = 0; i < BENCH_TERM_LINES; i++) terminal_write(line);
+	uint64_t plain = cpu_rdtsc() - t0;
+
+	t0 = cpu_rdtsc();
+	terminal_batch_begin();
+	for (int i = 0; i < BENCH_TERM_LINES; i++) terminal_write(line);
+	terminal_batch_end();
+	uint64_t batched = cpu_rdtsc() - t0;
+
+	terminal_write("terminal, 64 character lines\n");
+	result("term_line", per_op(plain, BENCH_TERM_LINES), "cycles");
+	result("term_line_batched", per_op(batched, BENCH_TERM_LINES), "cycles");
+}
+
+// builds a synthetic tree, writes a full image of it and mounts it again.
+// that leaves the tree on disk, which is why this only runs on the
+// scratch disk
+static void bench_vfs(void) {
+	terminal_write("filesystem, ");
+	terminal_write_u32(BENCH_VFS_NODES);
+	terminal_write(" files of 200 bytes\n");
+
+	char text[201];
+	for (int i = 0; i < 200; i++) text[i] = (char)('a' + i % 26);
+	text[200] = '\0';
+
+	uint64_t t0 = cpu_rdtsc();
+	vfs_status_t st = vfs_mkdir("benchtree");
+	char path[32];
+	for (int i = 0; i < BENCH_VFS_NODES && st == VFS_OK; i++) {
+		kstrncpy0(path, "benchtree/f", sizeof(path));
+		size_t n = kstrlen(path);
+		path[n++] = (char)('0' + (i / 100) % 10);
+		path[n++] = (char)('0' + (i / 10) % 10);
+		path[n++] = (char)('0' + i % 10);
+		path[n] = '\0';
+
+		st = vfs_fab(path);
+		if (st == VFS_OK) st = vfs_carve(path, text);
+	}
+	uint64_t build = cpu_rdtsc() - t0;
+	if (st != VFS_OK) {
+		terminal_write("  could not build the tree\n");
+		return;
+	}
+
+	t0 = cpu_rdtsc();
+	st = vfs_checkpoint();
+	uint64_t checkpoint = cpu_rdtsc() - t0;
+
+	t0 = cpu_rdtsc();
+	if (st == VFS_OK) st = vfs_sync();
+	uint64_t sync = cpu_rdtsc() - t0;
+
+	t0 = cpu_rdtsc();
+	if (st == VFS_OK) st = vfs_load();
+	uint64_t load = cpu_rdtsc() - t0;
+
+	if (st != VFS_OK) {
+		terminal_write("  save or load failed\n");
+		return;
+	}
+	result("vfs_build", per_op(build, BENCH_VFS_NODES), "cycles/file");
+	result("vfs_checkpoint", clamp32(checkpoint), "cycles");
+	result("vfs_sync", clamp32(sync), "cycles");
+	result("vfs_load", clamp32(load), "cycles");
+}
+
+void bench_run(int scratch) {
+	calibrate();
+	terminal_write("TSC ");
+	terminal_write_u32(g_cycles_per_ms / 1000u);
+	terminal_write(" MHz\n");
+	con_result("tsc_per_ms", g_cycles_per_ms, "cycles");
+
+	bench_mem();
+	bench_alloc();
+	bench_yield();
+	bench_disk();
+	bench_terminal();
+	if (scratch) bench_vfs();
+	else terminal_write("filesystem: scratch disk only, see make bench\n");
+}
+
+void task_bench(void) {
+	g_console = 1;
+	// the shell is up alongside, its commands and reclaim wait for the
+	// suite rather than racing the vfs part of it. a kill in the middle
+	// would leave the lock owned by a dead task
+	task_pin(task_current_id(), 1);
+	shell_lock();
+	bench_run(1);
+	shell_unlock();
+	task_pin(task_current_id(), 0);
+	con_write("BENCH done\n");
+
+	// leaves QEMU when it has an isa-debug-exit device, status 1
+	outb(BENCH_EXIT_PORT, 0);
+	terminal_write("Bench finished.\n");
+}
@@ -0,0 +1,273 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel/jobs.h"
+#include "kernel/task.h"
+#include "drivers/vga.h"
+#include "drivers/keyboard.h"
+#include "lib/str.h"
+#include "mm/heap.h"
+#include "arsc/i386/cpu.h"
+
+// a job's output grows from JOB_OUT_MIN up to JOB_OUT_MAX, past that it
+// is counted and dropped rather than stalling the job
+#define JOB_OUT_MIN 256
+#define JOB_OUT_MAX 16384
+#define JOB_LINE_MAX 160
+#define JOB_WAIT_POLL_MS 20
+
+typedef enum {
+	JOB_FREE = 0,
+	JOB_RUNNING,
+	JOB_DONE	// finished, not reported yet
+} job_state_t;
+
+typedef struct {
+	job_state_t state;
+	int task_id;
+	int cancel;
+	job_fn_t fn;
+	void* arg;
+	char label[32];
+
+	// unprinted output is out[head..len)
+	char* out;
+	size_t head;
+	size_t len;
+	size_t cap;
+	uint32_t lost;
+} job_t;
+
+static job_t g_jobs[JOBS_MAX];
+
+static job_t* job_self(void) {
+	int id = task_current_id();
+	for (int i = 0; i < JOBS_MAX; i++) {
+		if (g_jobs[i].state != JOB_FREE && g_jobs[i].task_id == id) return &g_jobs[i];
+	}
+	return 0;
+}
+
+// interrupts are off
+static void out_append(job_t* j, const char* s, size_t len) {
+	if (j->head > 0 && j->len + len > j->cap) {
+		kmemmove(j->out, j->out + j->head, j->len - j->head);
+		j->len -= j->head;
+		j->head = 0;
+	}
+
+	if (j->len + len > j->cap && j->cap < JOB_OUT_MAX) {
+		size_t cap = j->cap ? j->cap : JOB_OUT_MIN;
+		while (cap < j->len + len && cap < JOB_OUT_MAX) cap *= 2;
+		if (cap > JOB_OUT_MAX) cap = JOB_OUT_MAX;
+
+		char* nb = (char*)kmalloc_tagged(cap, HEAP_TAG_SHELL);
+		if (nb) {
+			if (j->out) {
+				kmemcpy(nb, j->out, j->len);
+				kfree(j->out);
+			}
+			j->out = nb;
+			j->cap = cap;
+		}
+	}
+
+	size_t room = j->cap - j->len;
+	size_t n = (len < room) ? len : room;
+	if (n) kmemcpy(j->out + j->len, s, n);
+	j->len += n;
+	j->lost += (uint32_t)(len - n);
+}
+
+static int job_sink(const char* s, size_t len) {
+	uint32_t f = irq_save();
+	job_t* j = job_self();
+	if (j && len) out_append(j, s, len);
+	irq_restore(f);
+	return j != 0;
+}
+
+void jobs_init(void) {
+	for (int i = 0; i < JOBS_MAX; i++) g_jobs[i].state = JOB_FREE;
+	terminal_set_sink(job_sink);
+}
+
+static void job_entry(void* arg) {
+	job_t* j = (job_t*)arg;
+	j->fn(j->arg);
+
+	uint32_t f = irq_save();
+	j->state = JOB_DONE;
+	irq_restore(f);
+}
+
+int job_start(const char* label, job_fn_t fn, void* arg) {
+	// the new task must not run before its id is recorded, or its first
+	// output would get past the sink
+	uint32_t f = irq_save();
+	int slot = -1;
+	for (int i = 0; i < JOBS_MAX; i++) {
+		if (g_jobs[i].state == JOB_FREE) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0) {
+		irq_restore(f);
+		return -1;
+	}
+
+	job_t* j = &g_jobs[slot];
+	kstrncpy0(j->label, label, sizeof(j->label));
+	j->fn = fn;
+	j->arg = arg;
+	j->cancel = 0;
+	j->out = 0;
+	j->head = 0;
+	j->len = 0;
+	j->cap = 0;
+	j->lost = 0;
+
+	int id = task_create_arg(job_entry, j, j->label);
+	if (id >= 0) {
+		j->task_id = id;
+		j->state = JOB_RUNNING;
+	}
+	irq_restore(f);
+	return (id >= 0) ? slot + 1 : -1;
+}
+
+int job_is_background(void) {
+	return job_self() != 0;
+}
+
+int job_cancelled(void) {
+	job_t* j = job_self();
+	return j && j->cancel;
+}
+
+int job_cancel_task(int task_id) {
+	for (int i = 0; i < JOBS_MAX; i++) {
+		if (g_jobs[i].state == JOB_RUNNING && g_jobs[i].task_id == task_id) {
+			g_jobs[i].cancel = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// a task that went away without finishing its job
+static void job_check_gone(job_t* j) {
+	if (j->state != JOB_RUNNING) return;
+	task_t* t = task_at(j->task_id);
+	if (!t || t->arg != j || t->state == TASK_ZOMBIE) j->state = JOB_DONE;
+}
+
+// copies out the next whole line, or what is left once the job is done.
+// lines longer than cap come out in pieces
+static int take_line(job_t* j, char* line, size_t cap) {
+	uint32_t f = irq_save();
+	const char* p = j->out + j->head;
+	size_t avail = j->len - j->head;
+
+	size_t n = 0;
+	while (n < avail && n + 1 < cap && p[n] != '\n') n++;
+	int ready = (n < avail) || n + 1 >= cap || (j->state == JOB_DONE && n > 0);
+
+	if (ready) {
+		kmemcpy(line, p, n);
+		line[n] = '\0';
+		j->head += n;
+		if (j->head < j->len && j->out[j->head] == '\n') j->head++;
+		if (j->head == j->len) j->head = j->len = 0;
+	}
+	irq_restore(f);
+	return ready;
+}
+
+static void write_job_tag(int slot) {
+	terminal_putc('[');
+	terminal_write_u32((uint32_t)slot + 1);
+	terminal_write("] ");
+}
+
+static void job_free(job_t* j) {
+	uint32_t f = irq_save();
+	char* out = j->out;
+	j->out = 0;
+	j->head = j->len = j->cap = 0;
+	j->state = JOB_FREE;
+	irq_restore(f);
+	if (out) kfree(out);
+}
+
+void jobs_drain(void) {
+	char line[JOB_LINE_MAX];
+
+	terminal_batch_begin();
+	for (int i = 0; i < JOBS_MAX; i++) {
+		job_t* j = &g_jobs[i];
+		if (j->state == JOB_FREE) continue;
+		job_check_gone(j);
+
+		while (take_line(j, line, sizeof(line))) {
+			write_job_tag(i);
+			terminal_write(line);
+			terminal_putc('\n');
+		}
+		if (j->state != JOB_DONE) continue;
+
+		if (j->lost) {
+			write_job_tag(i);
+			terminal_write_u32(j->lost);
+			terminal_write(" bytes of output lost\n");
+		}
+		write_job_tag(i);
+		terminal_write(j->cancel ? "stopped  " : "done  ");
+		terminal_write(j->label);
+		terminal_putc('\n');
+		job_free(j);
+	}
+	terminal_batch_end();
+}
+
+void jobs_print(void) {
+	int any = 0;
+	terminal_batch_begin();
+	for (int i = 0; i < JOBS_MAX; i++) {
+		job_t* j = &g_jobs[i];
+		if (j->state == JOB_FREE) continue;
+		job_check_gone(j);
+
+		any = 1;
+		write_job_tag(i);
+		terminal_write(j->state == JOB_RUNNING ? "running  " : "done     ");
+		terminal_write(j->label);
+		terminal_write("  (task ");
+		terminal_write_u32((uint32_t)j->task_id);
+		terminal_write(")\n");
+	}
+	if (!any) terminal_write("No jobs.\n");
+	terminal_batch_end();
+}
+
+int jobs_wait(int num) {
+	if (num < 0 || num > JOBS_MAX) return -1;
+	if (num > 0 && g_jobs[num - 1].state == JOB_FREE) return -1;
+
+	for (;;) {
+		jobs_drain();
+
+		int pending = 0;
+		for (int i = 0; i < JOBS_MAX; i++) {
+			if (num > 0 && i != num - 1) continue;
+			if (g_jobs[i].state != JOB_FREE) pending = 1;
+		}
+		if (!pending) return 1;
+
+		key_event_t ev;
+		while (keyboard_try_get_key(&ev)) {
+			if (ev.type == KEY_ESC) return 0;
+		}
+		task_sleep_ms(JOB_WAIT_POLL_MS);
+	}
+}
@@ -1,13 +1,40 @@
 #include <stdint.h>
 #include "drivers/vga.h"
+#include "drivers/keyboard.h"
+#include "drivers/serial.h"
+#include "drivers/ata.h"
 #include "kernel/task.h"
 #include "kernel/sched.h"
 #include "kernel/shell.h"
+#include "kernel/jobs.h"
+#include "kernel/bench.h"
 #include "ui/overlays.h"
 #include "mm/heap.h"
+#include "mm/pmm.h"
+#include "kernel/multiboot.h"
+#include "arsc/i386/gdt.h"
+#include "arsc/i386/idt.h"
+#include "arsc/i386/fpu.h"
+#include "arsc/i386/pic.h"
+#include "drivers/pit.h"
 #include "fs/vfs.h"
+#include "fs/bcache.h"
+#include "lib/str.h"
 
-void kmain(void) {
+// word is one of the space separated arguments, not just the start of one
+static int cmdline_has(const char* cmdline, const char* word) {
+	size_t n = kstrlen(word);
+	const char* p = cmdline;
+	while (*p) {
+		while (*p == ' ') p++;
+		const char* start = p;
+		while (*p && *p != ' ') p++;
+		if ((size_t)(p - start) == n && kstrncmp(start, word, n) == 0) return 1;
+	}
+	return 0;
+}
+
+void kmain(uint32_t magic, const multiboot_info_t* mbi) {
 	terminal_init();
 	terminal_write("Welcome to the land of Myrkthrima!\n");
 	terminal_write("  Also known as AidanOS.\n");
@@ -19,25 +46,54 @@ void kmain(void) {
 
 	terminal_write("Kernel starting tasks...\n");
 
+	gdt_init();
+	idt_init();
+	fpu_init();
+	pic_init();
+	keyboard_init();
+	serial_init();
+
+	pmm_init(magic, mbi);
 	heap_init();
+	ata_init();
+	if (ata_dma_active()) terminal_write("Disk: bus master DMA\n");
+	bcache_init();
 	vfs_init();
 
 	vfs_status_t st = vfs_load();
 	if (st == VFS_ERR_NOT_FOUND) {
 		// no fs present, make fresh one
-		vfs_save();
+		if (vfs_save() == VFS_OK) vfs_sync();
 	} else if (st != VFS_OK) {
 		terminal_write("Filesystem mount failed.\n");
 		terminal_write("Run formatfs to create a new filesystem.\n");
 	}
 
 	task_init();
+	jobs_init();
 
-	task_create(task_wraith, "wraith");
-	task_create(task_shell, "shell");
+	int wraith = task_create(task_wraith, "wraith");
+	int shell = task_create(task_shell, "shell");
 	task_create(task_heartbeat0, "heartbeat0");
 	task_create(task_heartbeat1, "heartbeat1");
+	task_create(task_overlay, "overlay");
+
+	// "bench" on the command line runs the suite and leaves QEMU, see the
+	// Makefile's bench target
+	if (magic == MULTIBOOT_BOOTLOADER_MAGIC && (mbi->flags & MULTIBOOT_INFO_CMDLINE) &&
+	    cmdline_has((const char*)(uintptr_t)mbi->cmdline, "bench")) {
+		sched_set_priority(task_at(task_create(task_bench, "bench")), 1);
+	}
+
+	// runs only when nothing else can
+	sched_set_idle(task_at(task_create(task_idle, "idle")));
+
+	// interactive shell ahead of the heartbeats, reaper behind them
+	sched_set_priority(task_at(shell), 1);
+	sched_set_priority(task_at(wraith), SCHED_LEVELS - 1);
 
+	// interrupts come on with the first task's EFLAGS
+	pit_init(PIT_HZ);
 	__asm__ volatile("cli");
 	schedule();
 
@@ -1,46 +1,238 @@
 #include <stdint.h>
 #include "kernel/sched.h"
 #include "kernel/task.h"
+#include "kernel/trace.h"
 #include "arsc/i386/ctx_switch.h"
+#include "arsc/i386/cpu.h"
+#include "arsc/i386/fpu.h"
+#include "drivers/pit.h"
 
 void _task_internal_set_current(int id);
 int  _task_internal_get_current(void);
 task_t* _task_internal_get(int id);
 
-void schedule(void) {
+// multi-level feedback queue:
+//  - one FIFO ready queue per level, plus a bitmap of non-empty levels,
+//    so picking the next task is a find-first-set
+//  - tasks sit at their base priority; input wakeups boost a task to
+//    level 0 for a few runs before it settles back
+//  - a task that burns its whole quantum is demoted a level until it
+//    sleeps or blocks
+//  - every SCHED_AGING_PERIOD picks all ready tasks get one run at the
+//    top level so lower levels cannot starve
+//  - the idle task is never queued, it runs only when every queue is empty
+#define SCHED_BOOST_RUNS 4
+#define SCHED_AGING_PERIOD 64
+
+typedef struct {
+	task_t* head;
+	task_t* tail;
+} run_queue_t;
+
+static run_queue_t g_rq[SCHED_LEVELS];
+static uint32_t g_ready_mask = 0;
+static int g_ready_count = 0;
+static uint32_t g_picks = 0;
+
+// sleepers sorted by wake_tick
+static task_t* g_sleep_head = 0;
+
+static uint32_t g_quantum = SCHED_QUANTUM_DEFAULT;
+static volatile uint32_t g_slice_left = SCHED_QUANTUM_DEFAULT;
+static volatile int g_need_resched = 0;
+
+static task_t* g_idle = 0;
+
+static uint64_t g_boot_tsc = 0;
+static uint64_t g_switch_tsc = 0;	// when the current task got the CPU
+static uint32_t g_switches = 0;
+
+static inline int tick_reached(uint32_t now, uint32_t when) {
+	return (int32_t)(now - when) >= 0;
+}
+
+static task_t* current_task(void) {
+	int cur = _task_internal_get_current();
+	return (cur >= 0) ? _task_internal_get(cur) : 0;
+}
+
+static void rq_insert(task_t* t) {
+	run_queue_t* q = &g_rq[t->priority];
+	t->rq_next = 0;
+	t->rq_prev = q->tail;
+	if (q->tail) q->tail->rq_next = t;
+	else q->head = t;
+	q->tail = t;
+
+	t->on_rq = 1;
+	g_ready_mask |= (1u << t->priority);
+	g_ready_count++;
+
+	// anything runnable beats the idle task
+	task_t* cur = current_task();
+	if (cur && cur == g_idle) g_need_resched = 1;
+}
+
+static void rq_remove(task_t* t) {
+	run_queue_t* q = &g_rq[t->priority];
+	if (t->rq_prev) t->rq_prev->rq_next = t->rq_next;
+	else q->head = t->rq_next;
+	if (t->rq_next) t->rq_next->rq_prev = t->rq_prev;
+	else q->tail = t->rq_prev;
+
+	t->rq_next = 0;
+	t->rq_prev = 0;
+	t->on_rq = 0;
+	if (!q->head) g_ready_mask &= ~(1u << t->priority);
+	g_ready_count--;
+}
+
+static void sleep_remove(task_t* t) {
+	task_t** pp = &g_sleep_head;
+	while (*pp && *pp != t) pp = &(*pp)->sleep_next;
+	if (*pp) *pp = t->sleep_next;
+	t->sleep_next = 0;
+}
+
+void sched_enqueue(task_t* t) {
+	if (!t) return;
+	uint32_t f = irq_save();
+	t->state = TASK_READY;
+	if (!t->on_rq) rq_insert(t);
+	irq_restore(f);
+}
+
+void sched_dequeue(task_t* t) {
+	if (!t) return;
+	uint32_t f = irq_save();
+	if (t->on_rq) rq_remove(t);
+	if (t->state == TASK_SLEEPING) sleep_remove(t);
+	irq_restore(f);
+}
+
+static void set_level(task_t* t, int level) {
+	if (t->priority == level) return;
+	int queued = t->on_rq;
+	if (queued) rq_remove(t);
+	t->priority = (uint8_t)level;
+	if (queued) rq_insert(t);
+}
+
+void sched_set_priority(task_t* t, int level) {
+	if (!t) return;
+	if (level < 0) level = 0;
+	if (level >= SCHED_LEVELS) level = SCHED_LEVELS - 1;
+
+	uint32_t f = irq_save();
+	t->base_priority = (uint8_t)level;
+	t->boost = 0;
+	set_level(t, level);
+	irq_restore(f);
+}
+
+void sched_boost(task_t* t) {
+	if (!t) return;
+	uint32_t f = irq_save();
+	t->boost = SCHED_BOOST_RUNS;
+	set_level(t, 0);
+
+	// a woken interactive task should not wait out someone else's slice
+	task_t* cur = current_task();
+	if (t->on_rq && cur && cur != t && t->priority < cur->priority) g_need_resched = 1;
+	irq_restore(f);
+}
+
+int sched_ready_count(void) {
+	return g_ready_count;
+}
+
+void sched_set_quantum(uint32_t ticks) {
+	g_quantum = ticks ? ticks : 1u;
+}
+
+uint32_t sched_get_quantum(void) {
+	return g_quantum;
+}
+
+// task gave up the CPU but is still runnable
+static void requeue(task_t* t, int preempted) {
+	if (preempted) {
+		t->boost = 0;
+		if (t->priority + 1 < SCHED_LEVELS) t->priority++;
+	} else {
+		if (t->boost > 0) t->boost--;
+		if (t->boost == 0) t->priority = t->base_priority;
+	}
+	t->state = TASK_READY;
+	rq_insert(t);
+}
+
+static void age_all(void) {
+	for (int i = 0; i < MAX_TASKS; i++) {
+		task_t* t = _task_internal_get(i);
+		if (!t || !t->on_rq || t->priority == 0) continue;
+		if (t->boost == 0) t->boost = 1;
+		set_level(t, 0);
+	}
+}
+
+static task_t* pick_next(void) {
+	if (!g_ready_mask) return g_idle;
+	int level = __builtin_ctz(g_ready_mask);
+	task_t* t = g_rq[level].head;
+	rq_remove(t);
+	return t;
+}
+
+// interrupts are off from here to the switch
+static void schedule_locked(int preempted) {
 	int prev = _task_internal_get_current();
 	task_t* prev_t = (prev >= 0) ? _task_internal_get(prev) : 0;
 
 	if (prev_t && prev_t->state == TASK_RUNNING) {
-		prev_t->state = TASK_READY;
+		if (prev_t == g_idle) prev_t->state = TASK_READY;
+		else requeue(prev_t, preempted);
 	}
 
-	int next = -1;
-	for (int step = 1; step <= MAX_TASKS; step++) {
-		int idx = (prev + step) % MAX_TASKS;
-		task_t* t = _task_internal_get(idx);
-		if (t && t->state == TASK_READY) {
-			next = idx;
-			break;
-		}
+	if (++g_picks >= SCHED_AGING_PERIOD) {
+		g_picks = 0;
+		age_all();
 	}
 
-	if (next == -1) {
-		if (prev_t) {
-			prev_t->state = TASK_RUNNING;
-			return;
-		}
-		return;
-	}
-
-	task_t* next_t = _task_internal_get(next);
+	task_t* next_t = pick_next();
 	if (!next_t) {
 		return;
 	}
 
+	// leaving idle, put the periodic tick back
+	if (prev_t == g_idle && next_t != g_idle) pit_exit_tickless();
+
+	g_need_resched = 0;
+	g_slice_left = g_quantum;
+
+	int next = next_t->id;
 	_task_internal_set_current(next);
 	next_t->state = TASK_RUNNING;
 
+	uint64_t now = cpu_rdtsc();
+	if (prev == -1) {
+		g_boot_tsc = now;
+	} else if (prev_t) {
+		prev_t->run_tsc += now - g_switch_tsc;
+		if (prev != next) {
+			if (preempted) prev_t->invol_switches++;
+			else prev_t->vol_switches++;
+		}
+	}
+	if (prev != next) {
+		next_t->switches_in++;
+		g_switches++;
+		trace(TRACE_SWITCH, (uint32_t)prev, (uint32_t)next, (uint32_t)preempted);
+	}
+	g_switch_tsc = now;
+
+	fpu_switch(next_t);
+
 	if (prev == -1) {
 		uint32_t dummy = 0;
 		ctx_switch(&dummy, next_t->esp);
@@ -49,6 +241,131 @@ void schedule(void) {
 	}
 }
 
+void schedule(void) {
+	uint32_t f = irq_save();
+	schedule_locked(0);
+	irq_restore(f);
+}
+
 void yield(void) {
 	schedule();
 }
+
+void sched_sleep_until(task_t* t, uint32_t wake_tick) {
+	if (!t) return;
+	uint32_t f = irq_save();
+	if (t->on_rq) rq_remove(t);
+
+	t->state = TASK_SLEEPING;
+	t->wake_tick = wake_tick;
+
+	task_t** pp = &g_sleep_head;
+	while (*pp && tick_reached(wake_tick, (*pp)->wake_tick)) pp = &(*pp)->sleep_next;
+	t->sleep_next = *pp;
+	*pp = t;
+	irq_restore(f);
+}
+
+void sched_tick(uint32_t now) {
+	int cur = _task_internal_get_current();
+	task_t* cur_t = (cur >= 0) ? _task_internal_get(cur) : 0;
+
+	while (g_sleep_head && tick_reached(now, g_sleep_head->wake_tick)) {
+		task_t* t = g_sleep_head;
+		g_sleep_head = t->sleep_next;
+		t->sleep_next = 0;
+
+		// back at its own level after sleeping
+		t->boost = 0;
+		t->priority = t->base_priority;
+		t->state = TASK_READY;
+		rq_insert(t);
+
+		if (cur_t && cur_t != g_idle && t->priority < cur_t->priority) g_need_resched = 1;
+	}
+
+	if (g_slice_left > 0 && --g_slice_left == 0) g_need_resched = 1;
+}
+
+void sched_irq_exit(void) {
+	if (!g_need_resched) return;
+	task_t* cur_t = current_task();
+	if (!cur_t || cur_t->state != TASK_RUNNING) return;
+	if (cur_t == g_idle && !g_ready_mask) {
+		g_need_resched = 0;
+		return;
+	}
+
+	// only a full slice counts against the task, a higher priority
+	// wakeup just cuts in line
+	schedule_locked(g_slice_left == 0);
+}
+
+uint64_t sched_task_runtime(const task_t* t) {
+	if (!t) return 0;
+	uint32_t f = irq_save();
+	uint64_t v = t->run_tsc;
+	if (t == current_task()) v += cpu_rdtsc() - g_switch_tsc;
+	irq_restore(f);
+	return v;
+}
+
+uint64_t sched_uptime_tsc(void) {
+	return g_boot_tsc ? cpu_rdtsc() - g_boot_tsc : 0;
+}
+
+uint32_t sched_switch_count(void) {
+	return g_switches;
+}
+
+void sched_block(task_t* t) {
+	if (!t) return;
+	uint32_t f = irq_save();
+	if (t->on_rq) rq_remove(t);
+	t->state = TASK_BLOCKED;
+	irq_restore(f);
+}
+
+void sched_wake(task_t* t) {
+	if (!t) return;
+	uint32_t f = irq_save();
+	if (t->state == TASK_BLOCKED || t->state == TASK_SLEEPING) {
+		if (t->state == TASK_SLEEPING) sleep_remove(t);
+		t->boost = 0;
+		t->priority = t->base_priority;
+		t->state = TASK_READY;
+		rq_insert(t);
+
+		task_t* cur = current_task();
+		if (cur && cur != g_idle && t->priority < cur->priority) g_need_resched = 1;
+	}
+	irq_restore(f);
+}
+
+void sched_set_idle(task_t* t) {
+	uint32_t f = irq_save();
+	if (t && t->on_rq) rq_remove(t);
+	g_idle = t;
+	irq_restore(f);
+}
+
+void task_idle(void) {
+	for (;;) {
+		uint32_t f = irq_save();
+		if (g_ready_mask) {
+			schedule_locked(0);
+		} else {
+			// sleep until the earliest sleeper is due, or until some
+			// other interrupt if nobody is
+			pit_exit_tickless();
+			uint32_t delta = PIT_NO_DEADLINE;
+			if (g_sleep_head) {
+				uint32_t now = pit_ticks();
+				delta = tick_reached(now, g_sleep_head->wake_tick) ? 0 : g_sleep_head->wake_tick - now;
+			}
+			pit_enter_tickless(delta);
+			cpu_wait_for_interrupt();
+		}
+		irq_restore(f);
+	}
+}
@@ -8,19 +8,33 @@
 #include "fs/vfs.h"
 #include "mm/heap.h"
 
-#define SCRIBE_MAX_LINES 512
 #define SCRIBE_STATUS_ROW (TERM_HEIGHT - 2)
 #define SCRIBE_CMD_ROW (TERM_HEIGHT - 1)
 #define SCRIBE_TEXT_ROWS (TERM_HEIGHT - 2)
 
+// each line is a gap buffer: text before the cursor sits at the front of
+// buf, text after it at the back, and the hole in between absorbs typing.
+// the gap only moves when the cursor does and the buffer only grows by
+// doubling, so a keystroke costs no allocation in the common case
+#define SCRIBE_LINE_MIN 16
+#define SCRIBE_LINES_MIN 64
+
+typedef struct {
+	char* buf;	// 0 until the line first needs storage
+	size_t cap;
+	size_t gap_start;
+	size_t gap_end;
+} scribe_line_t;
+
 typedef enum {
 	SCRIBE_MODE_WRITE = 0,
 	SCRIBE_MODE_COMMAND
 } scribe_mode_t;
 
 typedef struct {
-	char* lines[SCRIBE_MAX_LINES];
+	scribe_line_t* lines;
 	size_t line_count;
+	size_t line_cap;
 
 	size_t cur_line;
 	size_t cur_col;
@@ -32,29 +46,174 @@ typedef struct {
 
 	char filename[32];
 	char message[80];
+
+	// what is on screen: text rows are repainted only when marked, a
+	// change of top_line shifts the rows that are still visible, and the
+	// status and command rows redraw only when their contents change
+	int screen_valid;
+	size_t drawn_top;
+	uint8_t row_dirty[SCRIBE_TEXT_ROWS];
+
+	int status_valid;
+	scribe_mode_t drawn_mode;
+	int drawn_modified;
+	size_t drawn_line;
+	size_t drawn_col;
+
+	int message_dirty;
 } scribe_t;
 
-static size_t scribe_strlen(const char* s) {
-	return s ? kstrlen(s) : 0;
+static size_t line_len(const scribe_line_t* l) {
+	return l->cap - (l->gap_end - l->gap_start);
+}
+
+static char line_at(const scribe_line_t* l, size_t i) {
+	return (i < l->gap_start) ? l->buf[i] : l->buf[i + (l->gap_end - l->gap_start)];
+}
+
+static void line_move_gap(scribe_line_t* l, size_t pos) {
+	if (pos < l->gap_start) {
+		size_t n = l->gap_start - pos;
+		kmemmove(l->buf + l->gap_end - n, l->buf + pos, n);
+		l->gap_start -= n;
+		l->gap_end -= n;
+	} else if (pos > l->gap_start) {
+		size_t n = pos - l->gap_start;
+		kmemmove(l->buf + l->gap_start, l->buf + l->gap_end, n);
+		l->gap_start += n;
+		l->gap_end += n;
+	}
+}
+
+// make room for extra more bytes in the gap
+static int line_reserve(scribe_line_t* l, size_t extra) {
+	if (l->gap_end - l->gap_start >= extra) return 1;
+
+	size_t len = line_len(l);
+	size_t cap = l->cap ? l->cap * 2 : SCRIBE_LINE_MIN;
+	while (cap < len + extra) cap *= 2;
+
+	char* nb = (char*)kmalloc_tagged(cap, HEAP_TAG_SCRIBE);
+	if (!nb) return 0;
+
+	size_t tail = l->cap - l->gap_end;
+	if (l->buf) {
+		kmemcpy(nb, l->buf, l->gap_start);
+		kmemcpy(nb + cap - tail, l->buf + l->gap_end, tail);
+		kfree(l->buf);
+	}
+	l->buf = nb;
+	l->gap_end = cap - tail;
+	l->cap = cap;
+	return 1;
+}
+
+static int line_insert(scribe_line_t* l, size_t pos, char ch) {
+	if (!line_reserve(l, 1)) return 0;
+	line_move_gap(l, pos);
+	l->buf[l->gap_start++] = ch;
+	return 1;
+}
+
+static void line_erase(scribe_line_t* l, size_t pos) {
+	line_move_gap(l, pos);
+	l->gap_end++;
+}
+
+static void line_truncate(scribe_line_t* l, size_t pos) {
+	line_move_gap(l, pos);
+	l->gap_end = l->cap;
+}
+
+// append src[from..] to the end of dst
+static int line_append_from(scribe_line_t* dst, scribe_line_t* src, size_t from) {
+	size_t n = line_len(src) - from;
+	if (n == 0) return 1;
+	if (!line_reserve(dst, n)) return 0;
+
+	line_move_gap(dst, line_len(dst));
+	line_move_gap(src, from);
+	kmemcpy(dst->buf + dst->gap_start, src->buf + src->gap_end, n);
+	dst->gap_start += n;
+	return 1;
+}
+
+// the line as one string, closing the gap at the end; only for callers
+// that are not on the typing path
+static const char* line_text(scribe_line_t* l) {
+	if (!line_reserve(l, 1)) return "";
+	line_move_gap(l, line_len(l));
+	l->buf[l->gap_start] = '\0';
+	return l->buf;
+}
+
+static void line_init(scribe_line_t* l) {
+	l->buf = 0;
+	l->cap = 0;
+	l->gap_start = 0;
+	l->gap_end = 0;
+}
+
+static void line_free(scribe_line_t* l) {
+	if (l->buf) kfree(l->buf);
+	line_init(l);
+}
+
+static int scribe_lines_reserve(scribe_t* ed, size_t count) {
+	if (count <= ed->line_cap) return 1;
+
+	size_t cap = ed->line_cap ? ed->line_cap * 2 : SCRIBE_LINES_MIN;
+	while (cap < count) cap *= 2;
+
+	scribe_line_t* nl = (scribe_line_t*)kmalloc_tagged(cap * sizeof(scribe_line_t), HEAP_TAG_SCRIBE);
+	if (!nl) return 0;
+
+	if (ed->lines) {
+		kmemcpy(nl, ed->lines, ed->line_count * sizeof(scribe_line_t));
+		kfree(ed->lines);
+	}
+	ed->lines = nl;
+	ed->line_cap = cap;
+	return 1;
+}
+
+static size_t scribe_cur_len(scribe_t* ed) {
+	return line_len(&ed->lines[ed->cur_line]);
 }
 
 static void scribe_set_message(scribe_t* ed, const char* msg) {
 	if (!ed) return;
 	kstrncpy0(ed->message, msg ? msg : "", sizeof(ed->message));
+	ed->message_dirty = 1;
 }
 
-static char* scribe_make_empty_line(void) {
-	char* s = (char*)kmalloc(1);
-	if (!s) return 0;
-	s[0] = '\0';
-	return s;
+// everything on screen is stale, e.g. after a load or a clear
+static void scribe_invalidate(scribe_t* ed) {
+	ed->screen_valid = 0;
+	ed->status_valid = 0;
+	ed->message_dirty = 1;
 }
 
-static void scribe_init_empty(scribe_t* ed, const char* filename) {
-	for (size_t i = 0; i < SCRIBE_MAX_LINES; i++) ed->lines[i] = 0;
+static void scribe_mark_line(scribe_t* ed, size_t line) {
+	if (line < ed->drawn_top) return;
+	if (line - ed->drawn_top >= SCRIBE_TEXT_ROWS) return;
+	ed->row_dirty[line - ed->drawn_top] = 1;
+}
+
+// line and every line below it moved or changed
+static void scribe_mark_from(scribe_t* ed, size_t line) {
+	size_t r = (line > ed->drawn_top) ? line - ed->drawn_top : 0;
+	for (; r < SCRIBE_TEXT_ROWS; r++) ed->row_dirty[r] = 1;
+}
+
+static int scribe_init_empty(scribe_t* ed, const char* filename) {
+	ed->lines = 0;
+	ed->line_cap = 0;
+	ed->line_count = 0;
+	if (!scribe_lines_reserve(ed, 1)) return 0;
 
 	ed->line_count = 1;
-	ed->lines[0] = scribe_make_empty_line();
+	line_init(&ed->lines[0]);
 
 	ed->cur_line = 0;
 	ed->cur_col = 0;
@@ -64,52 +223,57 @@ static void scribe_init_empty(scribe_t* ed, const char* filename) {
 
 	kstrncpy0(ed->filename, filename ? filename : "untitled.txt", sizeof(ed->filename));
 	kstrncpy0(ed->message, "WRITE mode  |  Esc=COMMAND", sizeof(ed->message));
+	ed->drawn_top = 0;
+	scribe_invalidate(ed);
+	return 1;
 }
 
 static void scribe_free(scribe_t* ed) {
-	if (!ed) return;
-	for (size_t i = 0; i < ed->line_count; i++) {
-		if (ed->lines[i]) {
-			kfree(ed->lines[i]);
-			ed->lines[i] = 0;
-		}
-	}
+	if (!ed || !ed->lines) return;
+	for (size_t i = 0; i < ed->line_count; i++) line_free(&ed->lines[i]);
+	kfree(ed->lines);
+	ed->lines = 0;
+	ed->line_count = 0;
+	ed->line_cap = 0;
 }
 
 static int scribe_load_from_text(scribe_t* ed, const char* text) {
-	scribe_init_empty(ed, ed->filename);
+	if (!scribe_init_empty(ed, ed->filename)) return 0;
 
 	if (!text || !text[0]) return 1;
 
-	// clear empty default line
-	kfree(ed->lines[0]);
-	ed->lines[0] = 0;
+	// reuse the empty default line for the first one
 	ed->line_count = 0;
 
 	const char* p = text;
 	while (*p) {
-		if (ed->line_count >= SCRIBE_MAX_LINES) break;
-
 		const char* start = p;
 		while (*p && *p != '\n') p++;
 
 		size_t len = (size_t)(p - start);
 		if (len > 0 && start[len - 1] == '\r') len--;
 
-		char* line = (char*)kmalloc(len + 1);
-		if (!line) return 0;
-
-		for (size_t i = 0; i < len; i++) line[i] = start[i];
-		line[len] = '\0';
-
-		ed->lines[ed->line_count++] = line;
+		if (!scribe_lines_reserve(ed, ed->line_count + 1)) return 0;
+
+		// loaded lines start with no gap, the first edit makes one
+		scribe_line_t* line = &ed->lines[ed->line_count];
+		line_init(line);
+		if (len > 0) {
+			line->buf = (char*)kmalloc_tagged(len, HEAP_TAG_SCRIBE);
+			if (!line->buf) return 0;
+			kmemcpy(line->buf, start, len);
+			line->cap = len;
+			line->gap_start = len;
+			line->gap_end = len;
+		}
+		ed->line_count++;
 
 		if (*p == '\n') p++;
 	}
 
 	if (ed->line_count == 0) {
 		ed->line_count = 1;
-		ed->lines[0] = scribe_make_empty_line();
+		line_init(&ed->lines[0]);
 	}
 
 	return 1;
@@ -122,8 +286,22 @@ static void scribe_keep_cursor_visible(scribe_t* ed) {
 	}
 }
 
+// blank a row cell by cell; terminal_clear_row rerenders the whole window
+static void scribe_clear_row(size_t row) {
+	for (size_t c = 0; c < TEXT_WIDTH; c++) terminal_putc_at(row, c, ' ');
+}
+
 static void scribe_draw_status(scribe_t* ed) {
-	terminal_clear_row(SCRIBE_STATUS_ROW);
+	if (ed->status_valid && ed->drawn_mode == ed->mode && ed->drawn_modified == ed->modified &&
+	    ed->drawn_line == ed->cur_line && ed->drawn_col == ed->cur_col) return;
+
+	ed->status_valid = 1;
+	ed->drawn_mode = ed->mode;
+	ed->drawn_modified = ed->modified;
+	ed->drawn_line = ed->cur_line;
+	ed->drawn_col = ed->cur_col;
+
+	scribe_clear_row(SCRIBE_STATUS_ROW);
 
 	terminal_write_at(SCRIBE_STATUS_ROW, 0,
 		(ed->mode == SCRIBE_MODE_WRITE) ? "[WRITE] " : "[COMMAND] ");
@@ -174,21 +352,70 @@ static void scribe_draw_status(scribe_t* ed) {
 }
 
 static void scribe_draw_command(scribe_t* ed) {
-	terminal_clear_row(SCRIBE_CMD_ROW);
+	if (!ed->message_dirty) return;
+	ed->message_dirty = 0;
+
+	scribe_clear_row(SCRIBE_CMD_ROW);
 	terminal_write_at(SCRIBE_CMD_ROW, 0, ed->message);
 }
 
-static void scribe_draw_text(scribe_t* ed) {
-	for (size_t vr = 0; vr < SCRIBE_TEXT_ROWS; vr++) {
-		terminal_clear_row(vr);
+static void scribe_draw_row(scribe_t* ed, size_t vr) {
+	size_t line_index = ed->top_line + vr;
+	size_t len = 0;
+	const scribe_line_t* line = 0;
+	if (line_index < ed->line_count) {
+		line = &ed->lines[line_index];
+		len = line_len(line);
+	}
 
-		size_t line_index = ed->top_line + vr;
-		if (line_index >= ed->line_count) continue;
+	// read around the gap so drawing never moves it
+	for (size_t c = 0; c < TEXT_WIDTH; c++) {
+		terminal_putc_at(vr, c, (c < len) ? line_at(line, c) : ' ');
+	}
+}
 
-		const char* line = ed->lines[line_index];
-		if (!line) continue;
+// bring the screen over to top_line: rows still visible are moved,
+// only the ones scrolled in need drawing
+static void scribe_scroll_screen(scribe_t* ed) {
+	if (!ed->screen_valid) {
+		for (size_t r = 0; r < SCRIBE_TEXT_ROWS; r++) ed->row_dirty[r] = 1;
+		ed->screen_valid = 1;
+		ed->drawn_top = ed->top_line;
+		return;
+	}
+	if (ed->top_line == ed->drawn_top) return;
 
-		terminal_write_at(vr, 0, line);
+	size_t shift;
+	if (ed->top_line > ed->drawn_top) {
+		shift = ed->top_line - ed->drawn_top;
+		if (shift >= SCRIBE_TEXT_ROWS) {
+			shift = SCRIBE_TEXT_ROWS;
+		} else {
+			size_t keep = SCRIBE_TEXT_ROWS - shift;
+			terminal_move_rows(0, shift, keep);
+			for (size_t r = 0; r < keep; r++) ed->row_dirty[r] = ed->row_dirty[r + shift];
+		}
+		for (size_t r = SCRIBE_TEXT_ROWS - shift; r < SCRIBE_TEXT_ROWS; r++) ed->row_dirty[r] = 1;
+	} else {
+		shift = ed->drawn_top - ed->top_line;
+		if (shift >= SCRIBE_TEXT_ROWS) {
+			shift = SCRIBE_TEXT_ROWS;
+		} else {
+			size_t keep = SCRIBE_TEXT_ROWS - shift;
+			terminal_move_rows(shift, 0, keep);
+			for (size_t r = keep; r-- > 0;) ed->row_dirty[r + shift] = ed->row_dirty[r];
+		}
+		for (size_t r = 0; r < shift; r++) ed->row_dirty[r] = 1;
+	}
+	ed->drawn_top = ed->top_line;
+}
+
+static void scribe_draw_text(scribe_t* ed) {
+	scribe_scroll_screen(ed);
+	for (size_t vr = 0; vr < SCRIBE_TEXT_ROWS; vr++) {
+		if (!ed->row_dirty[vr]) continue;
+		ed->row_dirty[vr] = 0;
+		scribe_draw_row(ed, vr);
 	}
 }
 
@@ -206,50 +433,37 @@ static void scribe_render(scribe_t* ed) {
 	terminal_set_cursor_pos(screen_row, screen_col);
 }
 
-static int scribe_insert_line(scribe_t* ed, size_t index, char* line) {
-	if (ed->line_count >= SCRIBE_MAX_LINES) return 0;
+// opens an empty line at index
+static int scribe_insert_line(scribe_t* ed, size_t index) {
+	if (!scribe_lines_reserve(ed, ed->line_count + 1)) return 0;
 	if (index > ed->line_count) index = ed->line_count;
+	scribe_mark_from(ed, index);
 
-	for (size_t i = ed->line_count; i > index; i--) {
-		ed->lines[i] = ed->lines[i - 1];
-	}
-	ed->lines[index] = line;
+	kmemmove(&ed->lines[index + 1], &ed->lines[index], (ed->line_count - index) * sizeof(scribe_line_t));
+	line_init(&ed->lines[index]);
 	ed->line_count++;
 	return 1;
 }
 
 static void scribe_delete_line(scribe_t* ed, size_t index) {
 	if (ed->line_count == 0 || index >= ed->line_count) return;
+	scribe_mark_from(ed, index);
 
-	kfree(ed->lines[index]);
-	for (size_t i = index; i + 1 < ed->line_count; i++) {
-		ed->lines[i] = ed->lines[i + 1];
-	}
+	line_free(&ed->lines[index]);
+	kmemmove(&ed->lines[index], &ed->lines[index + 1], (ed->line_count - index - 1) * sizeof(scribe_line_t));
 	ed->line_count--;
 
 	if (ed->line_count == 0) {
 		ed->line_count = 1;
-		ed->lines[0] = scribe_make_empty_line();
+		line_init(&ed->lines[0]);
 	}
 
 	if (ed->cur_line >= ed->line_count) ed->cur_line = ed->line_count - 1;
 }
 
 static int scribe_insert_char(scribe_t* ed, char ch) {
-	char* line = ed->lines[ed->cur_line];
-	size_t len = scribe_strlen(line);
-
-	char* nline = (char*)kmalloc(len + 2);
-	if (!nline) return 0;
-
-	size_t p = 0;
-	for (size_t i = 0; i < ed->cur_col && i < len; i++) nline[p++] = line[i];
-	nline[p++] = ch;
-	for (size_t i = ed->cur_col; i < len; i++) nline[p++] = line[i];
-	nline[p] = '\0';
-
-	kfree(line);
-	ed->lines[ed->cur_line] = nline;
+	if (!line_insert(&ed->lines[ed->cur_line], ed->cur_col, ch)) return 0;
+	scribe_mark_line(ed, ed->cur_line);
 	ed->cur_col++;
 	ed->modified = 1;
 	return 1;
@@ -258,90 +472,42 @@ static int scribe_insert_char(scribe_t* ed, char ch) {
 static int scribe_backspace(scribe_t* ed) {
 	if (ed->cur_line == 0 && ed->cur_col == 0) return 1;
 
-	char* line = ed->lines[ed->cur_line];
-	size_t len = scribe_strlen(line);
-
 	if (ed->cur_col > 0) {
-		char* nline = (char*)kmalloc(len);
-		if (!nline) return 0;
-
-		size_t p = 0;
-		for (size_t i = 0; i < len; i++) {
-			if (i == ed->cur_col - 1) continue;
-			nline[p++] = line[i];
-		}
-		nline[p] = '\0';
-
-		kfree(line);
-		ed->lines[ed->cur_line] = nline;
+		line_erase(&ed->lines[ed->cur_line], ed->cur_col - 1);
+		scribe_mark_line(ed, ed->cur_line);
 		ed->cur_col--;
 		ed->modified = 1;
 		return 1;
 	}
 
 	// merge with the previous line
-	if (ed->cur_line > 0) {
-		char* prev = ed->lines[ed->cur_line - 1];
-		char* curr = ed->lines[ed->cur_line];
-		size_t prev_len = scribe_strlen(prev);
-		size_t curr_len = scribe_strlen(curr);
-
-		char* merged = (char*)kmalloc(prev_len + curr_len + 1);
-		if (!merged) return 0;
-
-		for (size_t i = 0; i < prev_len; i++) merged[i] = prev[i];
-		for (size_t i = 0; i < curr_len; i++) merged[prev_len + i] = curr[i];
-		merged[prev_len + curr_len] = '\0';
+	scribe_line_t* prev = &ed->lines[ed->cur_line - 1];
+	size_t prev_len = line_len(prev);
+	if (!line_append_from(prev, &ed->lines[ed->cur_line], 0)) return 0;
 
-		kfree(prev);
-		ed->lines[ed->cur_line - 1] = merged;
-		ed->cur_col = prev_len;
-		ed->cur_line--;
-
-		scribe_delete_line(ed, ed->cur_line + 1);
-		ed->modified = 1;
-		return 1;
-	}
+	ed->cur_col = prev_len;
+	ed->cur_line--;
+	scribe_mark_line(ed, ed->cur_line);
 
+	scribe_delete_line(ed, ed->cur_line + 1);
+	ed->modified = 1;
 	return 1;
 }
 
 static int scribe_delete_char(scribe_t* ed) {
-	char* line = ed->lines[ed->cur_line];
-	size_t len = scribe_strlen(line);
-
-	if (ed->cur_col < len) {
-		char* nline = (char*)kmalloc(len);
-		if (!nline) return 0;
+	scribe_line_t* line = &ed->lines[ed->cur_line];
 
-		size_t p = 0;
-		for (size_t i = 0; i < len; i++) {
-			if (i == ed->cur_col) continue;
-			nline[p++] = line[i];
-		}
-		nline[p] = '\0';
-
-		kfree(line);
-		ed->lines[ed->cur_line] = nline;
+	if (ed->cur_col < line_len(line)) {
+		line_erase(line, ed->cur_col);
+		scribe_mark_line(ed, ed->cur_line);
 		ed->modified = 1;
 		return 1;
 	}
 
 	// merge next line if applicable
 	if (ed->cur_line + 1 < ed->line_count) {
-		char* next = ed->lines[ed->cur_line + 1];
-		size_t curr_len = scribe_strlen(line);
-		size_t next_len = scribe_strlen(next);
-
-		char* merged = (char*)kmalloc(curr_len + next_len + 1);
-		if (!merged) return 0;
-
-		for (size_t i = 0; i < curr_len; i++) merged[i] = line[i];
-		for (size_t i = 0; i < next_len; i++) merged[curr_len + i] = next[i];
-		merged[curr_len + next_len] = '\0';
-
-		kfree(line);
-		ed->lines[ed->cur_line] = merged;
+		if (!line_append_from(line, &ed->lines[ed->cur_line + 1], 0)) return 0;
+		scribe_mark_line(ed, ed->cur_line);
 		scribe_delete_line(ed, ed->cur_line + 1);
 		ed->modified = 1;
 		return 1;
@@ -351,26 +517,15 @@ static int scribe_delete_char(scribe_t* ed) {
 }
 
 static int scribe_split_line(scribe_t* ed) {
-	char* line = ed->lines[ed->cur_line];
-	size_t len = scribe_strlen(line);
-
-	char* left = (char*)kmalloc(ed->cur_col + 1);
-	char* right = (char*)kmalloc((len - ed->cur_col) + 1);
-	if (!left || !right) return 0;
-
-	for (size_t i = 0; i < ed->cur_col; i++) left[i] = line[i];
-	left[ed->cur_col] = '\0';
+	if (!scribe_insert_line(ed, ed->cur_line + 1)) return 0;
 
-	size_t rp = 0;
-	for (size_t i = ed->cur_col; i < len; i++) right[rp++] = line[i];
-	right[rp] = '\0';
-
-	kfree(line);
-	ed->lines[ed->cur_line] = left;
-
-	if (!scribe_insert_line(ed, ed->cur_line + 1, right)) {
+	scribe_line_t* line = &ed->lines[ed->cur_line];
+	if (!line_append_from(&ed->lines[ed->cur_line + 1], line, ed->cur_col)) {
+		scribe_delete_line(ed, ed->cur_line + 1);
 		return 0;
 	}
+	line_truncate(line, ed->cur_col);
+	scribe_mark_line(ed, ed->cur_line);
 
 	ed->cur_line++;
 	ed->cur_col = 0;
@@ -378,27 +533,32 @@ static int scribe_split_line(scribe_t* ed) {
 	return 1;
 }
 
+// a whole-file save goes in as one journal record, so a crash leaves
+// either the old contents or the new ones
 static int scribe_save(scribe_t* ed) {
 	size_t total = 0;
 	for (size_t i = 0; i < ed->line_count; i++) {
-		total += scribe_strlen(ed->lines[i]);
+		total += line_len(&ed->lines[i]);
 		if (i + 1 < ed->line_count) total++;
 	}
 
-	char* out = (char*)kmalloc(total + 1);
+	char* out = (char*)kmalloc_tagged(total + 1, HEAP_TAG_SCRIBE);
 	if (!out) return 0;
 
 	size_t p = 0;
 	for (size_t i = 0; i < ed->line_count; i++) {
-		const char* line = ed->lines[i];
-		size_t len = scribe_strlen(line);
-		for (size_t j = 0; j < len; j++) out[p++] = line[j];
+		const scribe_line_t* line = &ed->lines[i];
+		kmemcpy(out + p, line->buf, line->gap_start);
+		p += line->gap_start;
+		kmemcpy(out + p, line->buf + line->gap_end, line->cap - line->gap_end);
+		p += line->cap - line->gap_end;
 		if (i + 1 < ed->line_count) out[p++] = '\n';
 	}
 	out[p] = '\0';
 
 	vfs_status_t st = vfs_carve(ed->filename, out);
 	kfree(out);
+	if (st == VFS_OK) st = vfs_save();
 
 	if (st != VFS_OK) return 0;
 
@@ -412,7 +572,7 @@ static void scribe_prompt_line(const char* prompt, char* out, size_t cap) {
 	out[0] = '\0';
 
 	for (;;) {
-		terminal_clear_row(SCRIBE_CMD_ROW);
+		scribe_clear_row(SCRIBE_CMD_ROW);
 		terminal_write_at(SCRIBE_CMD_ROW, 0, prompt);
 		terminal_write_at(SCRIBE_CMD_ROW, kstrlen(prompt), out);
 
@@ -421,10 +581,7 @@ static void scribe_prompt_line(const char* prompt, char* out, size_t cap) {
 		terminal_set_cursor_pos(SCRIBE_CMD_ROW, cursor_col);
 
 		key_event_t ev;
-		if (!keyboard_try_get_key(&ev)) {
-			yield();
-			continue;
-		}
+		keyboard_get_key(&ev);
 
 		if (ev.type == KEY_ENTER) {
 			return;
@@ -452,20 +609,22 @@ static void scribe_search(scribe_t* ed) {
 	}
 
 	for (size_t i = ed->cur_line; i < ed->line_count; i++) {
-		const char* found = kstrstr(ed->lines[i], needle);
+		const char* text = line_text(&ed->lines[i]);
+		const char* found = kstrstr(text, needle);
 		if (found) {
 			ed->cur_line = i;
-			ed->cur_col = (size_t)(found - ed->lines[i]);
+			ed->cur_col = (size_t)(found - text);
 			scribe_set_message(ed, "Match found.");
 			return;
 		}
 	}
 
 	for (size_t i = 0; i < ed->cur_line; i++) {
-		const char* found = kstrstr(ed->lines[i], needle);
+		const char* text = line_text(&ed->lines[i]);
+		const char* found = kstrstr(text, needle);
 		if (found) {
 			ed->cur_line = i;
-			ed->cur_col = (size_t)(found - ed->lines[i]);
+			ed->cur_col = (size_t)(found - text);
 			scribe_set_message(ed, "Match found.");
 			return;
 		}
@@ -487,7 +646,7 @@ static void scribe_goto(scribe_t* ed) {
 	if (line_num > ed->line_count) line_num = (uint32_t)ed->line_count;
 	ed->cur_line = (size_t)(line_num - 1);
 
-	size_t len = scribe_strlen(ed->lines[ed->cur_line]);
+	size_t len = scribe_cur_len(ed);
 	if (ed->cur_col > len) ed->cur_col = len;
 
 	scribe_set_message(ed, "Moved.");
@@ -511,10 +670,14 @@ void scribe_open(const char* filename) {
 			terminal_write("Could not create file.\n");
 			return;
 		}
-		scribe_init_empty(&ed, filename);
+		if (!scribe_init_empty(&ed, filename)) {
+			terminal_write("Out of memory.\n");
+			return;
+		}
 		scribe_set_message(&ed, "New file.");
 	} else if (st == VFS_OK) {
 		if (!scribe_load_from_text(&ed, text)) {
+			scribe_free(&ed);
 			terminal_write("Could not load file.\n");
 			return;
 		}
@@ -531,34 +694,31 @@ void scribe_open(const char* filename) {
 		scribe_render(&ed);
 
 		key_event_t ev;
-		if (!keyboard_try_get_key(&ev)) {
-			yield();
-			continue;
-		}
+		keyboard_get_key(&ev);
 
 		if (ed.mode == SCRIBE_MODE_WRITE) {
-			size_t line_len = scribe_strlen(ed.lines[ed.cur_line]);
+			size_t cur_len = scribe_cur_len(&ed);
 
 			if (ev.type == KEY_LEFT) {
 				if (ed.cur_col > 0) ed.cur_col--;
 				else if (ed.cur_line > 0) {
 					ed.cur_line--;
-					ed.cur_col = scribe_strlen(ed.lines[ed.cur_line]);
+					ed.cur_col = scribe_cur_len(&ed);
 				}
 			} else if (ev.type == KEY_RIGHT) {
-				if (ed.cur_col < line_len) ed.cur_col++;
+				if (ed.cur_col < cur_len) ed.cur_col++;
 				else if (ed.cur_line + 1 < ed.line_count) {
 					ed.cur_line++;
 					ed.cur_col = 0;
 				}
 			} else if (ev.type == KEY_UP) {
 				if (ed.cur_line > 0) ed.cur_line--;
-				line_len = scribe_strlen(ed.lines[ed.cur_line]);
-				if (ed.cur_col > line_len) ed.cur_col = line_len;
+				cur_len = scribe_cur_len(&ed);
+				if (ed.cur_col > cur_len) ed.cur_col = cur_len;
 			} else if (ev.type == KEY_DOWN) {
 				if (ed.cur_line + 1 < ed.line_count) ed.cur_line++;
-				line_len = scribe_strlen(ed.lines[ed.cur_line]);
-				if (ed.cur_col > line_len) ed.cur_col = line_len;
+				cur_len = scribe_cur_len(&ed);
+				if (ed.cur_col > cur_len) ed.cur_col = cur_len;
 			} else if (ev.type == KEY_BACKSPACE) {
 				if (!scribe_backspace(&ed)) scribe_set_message(&ed, "Out of memory.");
 			} else if (ev.type == KEY_DELETE) {
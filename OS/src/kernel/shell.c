@@ -4,17 +4,26 @@
 #include "kernel/shell.h"
 #include "drivers/vga.h"
 #include "drivers/keyboard.h"
+#include "drivers/serial.h"
 #include "kernel/sched.h"
 #include "kernel/scribe.h"
 #include "kernel/task.h"
+#include "kernel/bench.h"
+#include "kernel/jobs.h"
+#include "kernel/trace.h"
 #include "lib/str.h"
 #include "ui/overlays.h"
 #include "arsc/i386/ports.h"
+#include "arsc/i386/cpu.h"
 #include "fs/vfs.h"
+#include "fs/bcache.h"
 #include "mm/heap.h"
+#include "mm/pmm.h"
+#include "drivers/pit.h"
 
 #define HISTORY_MAX 32
 #define SCRIPT_DEPTH_MAX 4
+#define SHELL_RECLAIM_FRAMES 64
 
 static char g_history[HISTORY_MAX][160];
 static int g_history_count = 0;
@@ -26,6 +35,68 @@ static int split_next_line(const char** p, char* out, size_t cap);
 static void shell_execute_command(const char* buf, int from_script, int depth);
 static void shell_cast_script(const char* filename, int depth);
 
+// a learned spell is compiled once into steps that already name their
+// command and point at their arguments, and kept on the file's node until
+// the file changes. a cast holds a reference, so a spell that rewrites
+// its own file finishes on the copy it started with
+#define SPELL_LINE_MAX 160
+#define SPELL_NO_ARGS 0xFFFFFFFFu
+
+typedef struct {
+	int16_t cmd;	// -1 for a line that names no command
+	uint32_t line;	// offset in the pool, echoed before the step runs
+	uint32_t args;	// offset in the pool, or SPELL_NO_ARGS
+} spell_step_t;
+
+typedef struct spell {
+	uint32_t refs;
+	uint32_t count;
+	spell_step_t* steps;
+	char* pool;
+} spell_t;
+
+static spell_t* spell_compile_file(const char* filename);
+static void spell_release(spell_t* sp);
+static void spell_run(const spell_t* sp, int depth);
+
+// commands share the vfs and the terminal with background spells, so only
+// one runs at a time. the owner may take it again, a cast inside a locked
+// step does
+static task_t* g_cmd_owner = 0;
+static uint32_t g_cmd_depth = 0;
+
+static void cmd_lock(void) {
+	task_t* self = task_at(task_current_id());
+	for (;;) {
+		uint32_t f = irq_save();
+		if (!g_cmd_owner || g_cmd_owner == self) {
+			g_cmd_owner = self;
+			g_cmd_depth++;
+			irq_restore(f);
+			return;
+		}
+		irq_restore(f);
+
+		// keep showing job output while a job holds it
+		if (!job_is_background()) jobs_drain();
+		task_sleep_ms(1);
+	}
+}
+
+static void cmd_unlock(void) {
+	uint32_t f = irq_save();
+	if (g_cmd_depth > 0 && --g_cmd_depth == 0) g_cmd_owner = 0;
+	irq_restore(f);
+}
+
+void shell_lock(void) {
+	cmd_lock();
+}
+
+void shell_unlock(void) {
+	cmd_unlock();
+}
+
 static void prompt(void) {
 	char path[96];
 	vfs_pwd(path, sizeof(path));
@@ -59,42 +130,48 @@ static void history_push(const char* line) {
 	}
 }
 
-static void shell_cast_script(const char* filename, int depth) {
-	if (depth >= SCRIPT_DEPTH_MAX) {
-		terminal_write("Spell recursion too deep.\n");
-		return;
-	}
-
+// the spell learned as filename with a reference for the caller, or 0
+// after saying why not
+static spell_t* spell_acquire(const char* filename) {
 	int learned = 0;
 	vfs_status_t st = vfs_is_learned(filename, &learned);
 	if (st != VFS_OK) {
 		vfs_print_status(st);
-		return;
+		return 0;
 	}
 	if (!learned) {
 		terminal_write("That spell is not learned.\n");
-		return;
+		return 0;
 	}
 
-	const char* text = 0;
-	st = vfs_insp(filename, &text);
-	if (st != VFS_OK) {
-		vfs_print_status(st);
-		return;
+	void* cached = 0;
+	if (vfs_attached(filename, &cached) == VFS_OK) {
+		spell_t* sp = (spell_t*)cached;
+		sp->refs++;
+		return sp;
 	}
 
-	const char* p = text ? text : "";
-	char line[160];
+	spell_t* sp = spell_compile_file(filename);
+	if (!sp) terminal_write("Could not read the spell.\n");
+	return sp;
+}
 
-	while (split_next_line(&p, line, sizeof(line))) {
-		if (!line[0]) continue;
+static void shell_cast_script(const char* filename, int depth) {
+	if (depth >= SCRIPT_DEPTH_MAX) {
+		terminal_write("Spell recursion too deep.\n");
+		return;
+	}
 
-		terminal_write("[");
-		terminal_write(line);
-		terminal_write("] :\n");
+	cmd_lock();
+	spell_t* sp = spell_acquire(filename);
+	cmd_unlock();
+	if (!sp) return;
 
-		shell_execute_command(line, 1, depth + 1);
-	}
+	spell_run(sp, depth);
+
+	cmd_lock();
+	spell_release(sp);
+	cmd_unlock();
 }
 
 static int split_next_line(const char** p, char* out, size_t cap) {
@@ -148,7 +225,7 @@ static void load_history_entry(char** pbuf, size_t* pcap, size_t* plen, size_t*
 	if (n + 2 >= *pcap) {
 		size_t new_cap = *pcap;
 		while (n + 2 >= new_cap) new_cap *= 2;
-		char* nb = (char*)kmalloc(new_cap);
+		char* nb = (char*)kmalloc_tagged(new_cap, HEAP_TAG_SHELL);
 		if (!nb) return;
 		kfree(*pbuf);
 		*pbuf = nb;
@@ -173,7 +250,7 @@ static char* read_line(void) {
 	
 	size_t history_index = (size_t)g_history_count;
 
-	char* buf = (char*)kmalloc(cap);
+	char* buf = (char*)kmalloc_tagged(cap, HEAP_TAG_SHELL);
 	if (!buf) return 0;
 	buf[0] = '\0';
 
@@ -185,10 +262,7 @@ static char* read_line(void) {
 	for (;;) {
 		key_event_t ev;
 
-		if (!keyboard_try_get_key(&ev)) {
-			yield();
-			continue;
-		}
+		keyboard_get_key(&ev);
 
 		if (ev.type == KEY_PAGEUP) {
 			terminal_scroll_view_up();
@@ -255,7 +329,7 @@ static char* read_line(void) {
 				// grow heap buffer if needed
 				if (len + 2 >= cap) {
 					size_t new_cap = cap * 2;
-					char* nb = (char*)kmalloc(new_cap);
+					char* nb = (char*)kmalloc_tagged(new_cap, HEAP_TAG_SHELL);
 					if (nb) {
 						for (size_t i = 0; i < len; i++) nb[i] = buf[i];
 						nb[len] = '\0';
@@ -296,7 +370,7 @@ static char* read_line(void) {
 static char read_yes_no(void) {
 	for (;;) {
 		key_event_t ev;
-		if (!keyboard_try_get_key(&ev)) { yield(); continue; }
+		keyboard_get_key(&ev);
 		if (ev.type == KEY_CHAR) {
 			char c = ev.ch;
 			if (c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
@@ -319,6 +393,9 @@ static void vfs_print_status(vfs_status_t st) {
 		case VFS_ERR_NAME_INVALID: terminal_write("Invalid name.\n"); break;
 		case VFS_ERR_NO_MEM: terminal_write("Out of memory.\n"); break;
 		case VFS_ERR_BUSY: terminal_write("Busy.\n"); break;
+		case VFS_ERR_BAD_FD: terminal_write("Bad file handle.\n"); break;
+		case VFS_ERR_CORRUPT: terminal_write("Checksum mismatch, the disk copy is damaged.\n"); break;
+		case VFS_ERR_FULL: terminal_write("Filesystem full.\n"); break;
 		default: terminal_write("Error.\n"); break;
 	}
 }
@@ -336,6 +413,23 @@ static void shop_print_cb(const char* name, int is_dir, void* user) {
 	}
 }
 
+static void seek_run(vfs_seek_mode_t mode, const char* query) {
+	vfs_seek_stats_t ss;
+	vfs_status_t st = vfs_seek(mode, query, shop_print_cb, 0, &ss);
+	if (st != VFS_OK && ss.matches == 0) {
+		vfs_print_status(st);
+		return;
+	}
+	terminal_write_u32(ss.matches);
+	terminal_write(" found, ");
+	terminal_write_u32(ss.candidates);
+	terminal_write(" of ");
+	terminal_write_u32(ss.nodes);
+	terminal_write(" checked, ");
+	terminal_write_u32(ss.read);
+	terminal_write(" read from disk\n");
+}
+
 static void grimoire_print_cb(const char* name, void* user) {
 	(void)user;
 	terminal_write(" * ");
@@ -343,192 +437,899 @@ static void grimoire_print_cb(const char* name, void* user) {
 	terminal_putc('\n');
 }
 
-static void shell_execute_command(const char* buf, int from_script, int depth) {
-	if (streq(buf, "thanks")) {
-	      	terminal_write("You're welcome!\n");
-	} else if (streq(buf, "sync")) {
-		if (!vfs_is_dirty()) {
-	      		terminal_write("File system is clean.\n");
-	      	} else {
-	      		vfs_status_t s = vfs_save();
-	      		if (s == VFS_OK) terminal_write("Saved to disk.\n");
-	      		else terminal_write("Save failed.\n");
-	      	}
-	} else if (streq(buf, "exit")) {
-		if (from_script) {
-			terminal_write("Scripts may not shut down the system.\n");
-		} else {
-			terminal_write("Shutting down...\n");
-			if (vfs_is_dirty()) vfs_save();
-			shutdown_machine();
+static void write_stat(const char* label, uint32_t v, const char* unit) {
+	terminal_write(label);
+	terminal_write_u32(v);
+	if (unit) terminal_write(unit);
+	terminal_putc('\n');
+}
+
+static void heapstat_print(void) {
+	heap_stats_t st;
+	heap_get_stats(&st);
+
+	terminal_write("Heap:\n");
+	write_stat("  live blocks   ", st.live_blocks, 0);
+	write_stat("  live bytes    ", st.live_bytes, 0);
+	write_stat("  free blocks   ", st.free_blocks, 0);
+	write_stat("  free bytes    ", st.free_bytes, 0);
+	write_stat("  largest free  ", st.largest_free, 0);
+	write_stat("  high water    ", st.high_water, 0);
+	write_stat("  carved bytes  ", st.carved_bytes, 0);
+	write_stat("  chunks        ", st.chunks, 0);
+	write_stat("  free frames   ", (uint32_t)pmm_free_count(), 0);
+	write_stat("  total frames  ", (uint32_t)pmm_total_count(), 0);
+
+	terminal_write("By caller (allocs / live bytes):\n");
+	for (int t = 0; t < HEAP_TAG_COUNT; t++) {
+		terminal_write("  ");
+		terminal_write(heap_tag_name((heap_tag_t)t));
+		terminal_write(": ");
+		terminal_write_u32(st.tag_allocs[t]);
+		terminal_write(" / ");
+		terminal_write_u32(st.tag_live_bytes[t]);
+		terminal_putc('\n');
+	}
+
+	terminal_write("Guard: ");
+	terminal_write(heap_guard_enabled() ? "on" : "off");
+	terminal_write(", faults ");
+	terminal_write_u32(st.guard_faults);
+	terminal_putc('\n');
+}
+
+static void cachestat_print(void) {
+	bcache_stats_t st;
+	bcache_get_stats(&st);
+
+	terminal_write("Block cache:\n");
+	write_stat("  cached        ", st.cached, " sectors");
+	write_stat("  dirty         ", st.dirty, " sectors");
+	write_stat("  hits          ", st.hits, 0);
+	write_stat("  misses        ", st.misses, 0);
+	write_stat("  writes        ", st.writes, 0);
+	write_stat("  unchanged     ", st.writes_unchanged, 0);
+	write_stat("  writebacks    ", st.writebacks, 0);
+	write_stat("  evictions     ", st.evictions, 0);
+
+	vfs_stats_t vs;
+	vfs_get_stats(&vs);
+	terminal_write("Filesystem:\n");
+	write_stat("  checkpoints   ", vs.checkpoints, 0);
+	write_stat("  data written  ", vs.data_sectors_written, " sectors");
+	write_stat("  data kept     ", vs.data_sectors_kept, " sectors");
+	write_stat("  chunk reads   ", vs.chunk_reads, 0);
+	write_stat("  crc errors    ", vs.crc_errors, 0);
+}
+
+// carve <text> :: <file> replaces the contents, etch appends to them
+static void carve_command(const char* rest, int append) {
+	const char* delim = kstrstr(rest, " :: ");
+	if (!delim) delim = kstrstr(rest, "::");
+	if (!delim) {
+		terminal_write(append ? "Usage: etch <text> :: <filename>\n" : "Usage: carve <text> :: <filename>\n");
+		return;
+	}
+
+	size_t text_len = (size_t)(delim - rest);
+	while (text_len > 0 && (rest[text_len - 1] == ' ')) text_len--;
+
+	const char* fname = delim;
+	if (kstrncmp(delim, " :: ", 4) == 0) fname = delim + 4;
+	else fname = delim + 2;
+	while (*fname == ' ') fname++;
+
+	char* text = (char*)kmalloc_tagged(text_len + 1, HEAP_TAG_SHELL);
+	if (!text) {
+		terminal_write("Out of memory.\n");
+		return;
+	}
+
+	size_t out_len = 0;
+	for (size_t i = 0; i < text_len; i++) {
+		if (rest[i] == '\\' && (i + 1) < text_len) {
+			char n = rest[i + 1];
+
+			if (n == 'n') {
+				text[out_len++] = '\n';
+				i++;
+				continue;
+			} else if (n == 't') {
+				text[out_len++] = '\t';
+				i++;
+				continue;
+			} else if (n == '\\') {
+				text[out_len++] = '\\';
+				i++;
+				continue;
+			}
 		}
-	} else if (streq(buf, "formatfs")) {
-		terminal_write("Format filesystem? This will permanently erase all files. (y/n): ");
-		char yn = read_yes_no();
-		if (yn == 'y') {
-			vfs_init();
-			vfs_status_t st = vfs_save();
-			if (st == VFS_OK) terminal_write("Filesystem formatted.\n");
-			else vfs_print_status(st);
-		} else {
-			terminal_write("Canceled.\n");
+		text[out_len++] = rest[i];
+	}
+	text[out_len] = '\0';
+
+	// a replace is one journal record, an append only logs the new bytes
+	vfs_status_t st;
+	if (append) {
+		int fd = -1;
+		st = vfs_open(fname, VFS_O_WRITE, &fd);
+		if (st == VFS_OK) {
+			st = vfs_append(fd, text, out_len);
+			vfs_close(fd);
 		}
-	} else if (streq(buf, "help")) {
-		terminal_write("Commands:\n");
-		terminal_write("  help                    - show this help\n");
-		terminal_write("  clear                   - clear terminal text area\n");
-		terminal_write("  ps                      - list running tasks\n");
-		terminal_write("  kill <id>               - mark a task for reaping\n");
-		terminal_write("  spawn hb0               - spawn heartbeat type 0\n");
-		terminal_write("  spawn hb1               - spawn heartbeat type 1\n");
-		terminal_write("  yield                   - yield scheduler\n");
-		terminal_write("  sync                    - save filesystem to disk\n");
-		terminal_write("  exit                    - save and shut down\n");
-		terminal_write("  shop                    - list files/directories here\n");
-		terminal_write("  formatfs                - format the filesystem\n");
-		terminal_write("  fab <file>              - create file\n");
-		terminal_write("  insp <file>             - read file contents\n");
-		terminal_write("  carve <text> :: <file>  - write text to file\n");
-		terminal_write("  scribe <file>           - open text editor\n");
-		terminal_write("  burn <file>             - delete file\n");
-		terminal_write("  newdir <dir>            - create directory\n");
-		terminal_write("  cd <dir>                - change directory\n");
-		terminal_write("  learn <spell.ms>        - mark script as learned\n");
-		terminal_write("  cast <spell.ms>         - execute learned script\n");
-		terminal_write("  grimoire                - list learned spells\n");
-	} else if (streq(buf, "clear")) {
-      		terminal_clear_text_area();
-      		overlays_redraw();
-      	} else if (streq(buf, "ps")) {
-      		task_print_to_console();
-      	} else if (starts_with(buf, "kill ")) {
-      		uint32_t id;
-      		if (parse_u32(buf + 5, &id) && task_kill((int)id)) {
-      			terminal_write("Killed task.\n");
-      		} else {
-      			terminal_write("Usage: kill <id>\n");
-      		}
-      	} else if (streq(buf, "spawn hb0")) {
-      		int id = task_create(task_heartbeat0, "heartbeat0");
-      		if (id >= 0) terminal_write("Spawned hb0.\n");
-      		else terminal_write("No free task slots.\n");
-      	} else if (streq(buf, "spawn hb1")) {
-      		int id = task_create(task_heartbeat1, "heartbeat1");
-      		if (id >= 0) terminal_write("Spawned hb1.\n");
-      		else terminal_write("No free task slots.\n");
-      	} else if (streq(buf, "yield")) {
-      		terminal_write("(yield)\n");
-      		yield();
-      	} else if (streq(buf, "shop")) {
-      		terminal_write("In this directory:\n");
-      		vfs_shop(shop_print_cb, 0);
-	} else if (streq(buf, "grimoire")) {
-		terminal_write("Learned spells:\n");
-		vfs_grimoire(grimoire_print_cb, 0);
-      	} else if (starts_with(buf, "fab ")) {
-      		vfs_status_t st = vfs_fab(buf + 4);
-      		vfs_print_status(st);
-      		if (vfs_is_dirty()) vfs_save();
-      	} else if (starts_with(buf, "insp ")) {
-      		const char* text = 0;
-      		vfs_status_t st = vfs_insp(buf + 5, &text);
-      		if (st != VFS_OK) {
-      			vfs_print_status(st);
-      		} else {
-      			terminal_write(text ? text : "");
-      			terminal_putc('\n');
-      		}
-      	} else if (starts_with(buf, "carve ")) {
-      		// carve <text string> :: <filename>
-      		const char* rest = buf + 6;
-      		const char* delim = kstrstr(rest, " :: ");
-      		if (!delim) delim = kstrstr(rest, "::");
-      		if (!delim) {
-      			terminal_write("Usage: carve <text> :: <filename>\n");
-      		} else {
-      			size_t text_len = (size_t)(delim - rest);
-      			while (text_len > 0 && (rest[text_len - 1] == ' ')) text_len--;
-
-      			const char* fname = delim;
-      			if (kstrncmp(delim, " :: ", 4) == 0) fname = delim + 4;
-      			else fname = delim + 2;
-      			while (*fname == ' ') fname++;
-
-      			char* text = (char*)kmalloc(text_len + 1);
-			if (!text) {
-				terminal_write("Out of memory.\n");
-			} else {
-				size_t out_len = 0;
-
-				for (size_t i = 0; i < text_len; i++) {
-					if (rest[i] == '\\' && (i + 1) < text_len) {
-						char n = rest[i + 1];
-
-						if (n == 'n') {
-							text[out_len++] = '\n';
-							i++;
-							continue;
-						} else if (n == 't') {
-							text[out_len++] = '\t';
-							i++;
-						    	continue;
-						} else if (n == '\\') {
-							text[out_len++] = '\\';
-							i++;
-							continue;
-						}
-					}
-					text[out_len++] = rest[i];
-				}
-				text[out_len] = '\0';
+	} else {
+		st = vfs_carve(fname, text);
+	}
+	kfree(text);
+	vfs_print_status(st);
+	if (vfs_is_dirty()) vfs_save();
+}
 
-				vfs_status_t st = vfs_carve(fname, text);
-				kfree(text);
-				vfs_print_status(st);
-			}
-      		}
-      		if (vfs_is_dirty()) vfs_save();
-      	} else if (starts_with(buf, "scribe ")) {
-		scribe_open(buf + 7);
-      	} else if (starts_with(buf, "burn ")) {
-      		terminal_write("Burn file '");
-      		terminal_write(buf + 5);
-      		terminal_write("'? (y/n): ");
-      		char yn = read_yes_no();
-      		if (yn == 'y') {
-      			vfs_status_t st = vfs_burn(buf + 5);
-      			vfs_print_status(st);
-      			if (vfs_is_dirty()) vfs_save();
-      		} else {
-      			terminal_write("Canceled.\n");
-      		}
-      	} else if (starts_with(buf, "newdir ")) {
-      		vfs_status_t st = vfs_mkdir(buf + 7);
-      		vfs_print_status(st);
-      		if (vfs_is_dirty()) vfs_save();
-      	} else if (starts_with(buf, "cd ")) {
-      		vfs_status_t st = vfs_cd(buf + 3);
-      		vfs_print_status(st);
-      	} else if (starts_with(buf, "learn ")) {
-		vfs_status_t st = vfs_learn(buf + 6);
-		if (st == VFS_OK) terminal_write("Spell learned.\n");
+static void unknown_command(void) {
+	terminal_write("Unknown command. Use 'help' for commands.\n");
+}
+
+// handlers get the text after "name ", or 0 when the command was given
+// on its own
+typedef void (*shell_cmd_fn_t)(const char* args, int from_script, int depth);
+
+static void cmd_thanks(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	terminal_write("You're welcome!\n");
+}
+
+static void cmd_sync(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	bcache_stats_t cs;
+	bcache_get_stats(&cs);
+	if (!vfs_is_dirty() && cs.dirty == 0) {
+		terminal_write("File system is clean.\n");
+	} else {
+		vfs_status_t s = vfs_sync();
+		if (s == VFS_OK) terminal_write("Saved to disk.\n");
+		else terminal_write("Save failed.\n");
+	}
+}
+
+static void cmd_exit(const char* args, int from_script, int depth) {
+	(void)args; (void)depth;
+	if (from_script) {
+		terminal_write("Scripts may not shut down the system.\n");
+	} else {
+		terminal_write("Shutting down...\n");
+		vfs_sync();
+		shutdown_machine();
+	}
+}
+
+static void cmd_formatfs(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	terminal_write("Format filesystem? This will permanently erase all files. (y/n): ");
+	char yn = read_yes_no();
+	if (yn == 'y') {
+		vfs_init();
+		vfs_status_t st = vfs_save();
+		if (st == VFS_OK) st = vfs_sync();
+		if (st == VFS_OK) terminal_write("Filesystem formatted.\n");
 		else vfs_print_status(st);
+	} else {
+		terminal_write("Canceled.\n");
+	}
+}
+
+static void cmd_help(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	terminal_write("Commands:\n");
+	terminal_write("  help                    - show this help\n");
+	terminal_write("  clear                   - clear terminal text area\n");
+	terminal_write("  ps                      - list running tasks\n");
+	terminal_write("  top [ms]                - sample CPU use per task\n");
+	terminal_write("  kill <id>               - mark a task for reaping\n");
+	terminal_write("  prio <id> <level>       - set task priority (0 = highest)\n");
+	terminal_write("  spawn hb0               - spawn heartbeat type 0\n");
+	terminal_write("  spawn hb1               - spawn heartbeat type 1\n");
+	terminal_write("  yield                   - yield scheduler\n");
+	terminal_write("  quantum [ms]            - show or set the scheduler time slice\n");
+	terminal_write("  sync                    - save filesystem to disk\n");
+	terminal_write("  exit                    - save and shut down\n");
+	terminal_write("  shop                    - list files/directories here\n");
+	terminal_write("  seek name|text <s>      - find files by name or contents\n");
+	terminal_write("  formatfs                - format the filesystem\n");
+	terminal_write("  fab <file>              - create file\n");
+	terminal_write("  insp <file>             - read file contents\n");
+	terminal_write("  carve <text> :: <file>  - write text to file\n");
+	terminal_write("  etch <text> :: <file>   - append text to file\n");
+	terminal_write("  scribe <file>           - open text editor\n");
+	terminal_write("  burn <file>             - delete file\n");
+	terminal_write("  newdir <dir>            - create directory\n");
+	terminal_write("  cd <path>               - change directory (a/b, .., /P/root/...)\n");
+	terminal_write("  learn <spell.ms>        - mark script as learned\n");
+	terminal_write("  cast <spell.ms>         - execute learned script\n");
+	terminal_write("  cast <spell.ms> &       - run it in the background\n");
+	terminal_write("  jobs                    - list background spells\n");
+	terminal_write("  wait [job]              - wait for background spells (Esc stops)\n");
+	terminal_write("  grimoire                - list learned spells\n");
+	terminal_write("  heapstat                - show heap statistics\n");
+	terminal_write("  heapstat guard on|off   - toggle heap guard/poison mode\n");
+	terminal_write("  cachestat               - show block cache and fs statistics\n");
+	terminal_write("  membench                - time memcpy/memset/strstr\n");
+	terminal_write("  bench                   - time heap, scheduler, disk and terminal paths\n");
+	terminal_write("  serial [on|off]         - mirror the console to COM1\n");
+	terminal_write("  trace on [classes]      - record sched, disk, vfs, heap events\n");
+	terminal_write("  trace off|clear         - stop recording, or drop held events\n");
+	terminal_write("  trace dump|stream       - send held or new events to COM1\n");
+}
+
+static void cmd_clear(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	terminal_clear_text_area();
+	overlays_redraw();
+}
+
+static void cmd_heapstat(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	if (!args) {
+		heapstat_print();
+	} else if (streq(args, "guard on")) {
+		heap_set_guard(1);
+		terminal_write("Heap guard enabled.\n");
+	} else if (streq(args, "guard off")) {
+		heap_set_guard(0);
+		terminal_write("Heap guard disabled.\n");
+	} else {
+		unknown_command();
+	}
+}
+
+static void cmd_cachestat(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	cachestat_print();
+}
+
+static void cmd_membench(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	bench_mem();
+}
+
+static void cmd_bench(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	bench_run(0);
+}
+
+static int g_serial_console = 0;
+
+static void cmd_serial(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	if (!serial_present()) {
+		terminal_write("No serial port.\n");
+		return;
+	}
+
+	if (!args) {
+		terminal_write("COM1 115200 8N1, console ");
+		terminal_write(g_serial_console ? "on" : "off");
+		terminal_write(", ");
+		terminal_write_u32(serial_bytes_sent());
+		terminal_write(" bytes sent\n");
+	} else if (streq(args, "on")) {
+		g_serial_console = 1;
+		terminal_set_mirror(serial_write);
+		terminal_write("Serial console on.\n");
+	} else if (streq(args, "off")) {
+		terminal_write("Serial console off.\n");
+		g_serial_console = 0;
+		terminal_set_mirror(0);
+	} else {
+		terminal_write("Usage: serial [on|off]\n");
+	}
+}
+
+static const struct {
+	const char* name;
+	uint32_t bit;
+} g_trace_classes[] = {
+	{ "sched", TRACE_BIT(TRACE_SWITCH) },
+	{ "disk",  TRACE_BIT(TRACE_DISK) },
+	{ "vfs",   TRACE_BIT(TRACE_VFS_PHASE) },
+	{ "heap",  TRACE_BIT(TRACE_HEAP_SLOW) },
+};
+
+#define TRACE_CLASS_COUNT ((int)(sizeof(g_trace_classes) / sizeof(g_trace_classes[0])))
+#define TRACE_BATCH 32
+
+// space separated class names, 0 if any is unknown
+static int parse_trace_classes(const char* s, uint32_t* out) {
+	*out = 0;
+	while (*s) {
+		size_t len = 0;
+		while (s[len] && s[len] != ' ') len++;
+
+		int found = 0;
+		for (int i = 0; i < TRACE_CLASS_COUNT; i++) {
+			const char* name = g_trace_classes[i].name;
+			if (kstrncmp(name, s, len) == 0 && name[len] == '\0') {
+				*out |= g_trace_classes[i].bit;
+				found = 1;
+			}
+		}
+		if (!found) return 0;
+
+		s += len;
+		while (*s == ' ') s++;
+	}
+	return *out != 0;
+}
+
+static void trace_status(void) {
+	terminal_write("Tracing:");
+	if (!g_trace_mask) terminal_write(" off");
+	for (int i = 0; i < TRACE_CLASS_COUNT; i++) {
+		if (!(g_trace_mask & g_trace_classes[i].bit)) continue;
+		terminal_putc(' ');
+		terminal_write(g_trace_classes[i].name);
+	}
+	terminal_write("\n");
+	terminal_write_u32(trace_head() - trace_oldest());
+	terminal_write(" of ");
+	terminal_write_u32(TRACE_RECORDS);
+	terminal_write(" events held\n");
+}
+
+// sends events from *cursor on until end, or until Esc when stream is set
+static uint32_t trace_send(uint32_t* cursor, uint32_t end, int stream, uint32_t* lost) {
+	trace_event_t ev[TRACE_BATCH];
+	char line[64];
+	uint32_t sent = 0;
+
+	for (;;) {
+		uint32_t max = TRACE_BATCH;
+		if (!stream) {
+			// overwritten events can push the cursor past end
+			if ((int32_t)(end - *cursor) <= 0) break;
+			if (end - *cursor < max) max = end - *cursor;
+		}
+
+		uint32_t n = trace_read(cursor, ev, max, lost);
+		for (uint32_t i = 0; i < n; i++) {
+			size_t len = trace_format(&ev[i], line, sizeof(line));
+			serial_write(line, len);
+		}
+		sent += n;
+
+		if (!stream) {
+			if (n == 0) break;
+			continue;
+		}
+		key_event_t key;
+		if (keyboard_try_get_key(&key) && key.type == KEY_ESC) break;
+		if (n == 0) task_sleep_ms(10);
+	}
+	return sent;
+}
+
+static void cmd_trace(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	if (!args) {
+		trace_status();
+		return;
+	}
+
+	uint32_t mask;
+	if (streq(args, "on")) {
+		trace_set_mask(TRACE_ALL);
+		trace_status();
+	} else if (starts_with(args, "on ")) {
+		if (!parse_trace_classes(args + 3, &mask)) {
+			terminal_write("Classes: sched disk vfs heap\n");
+			return;
+		}
+		trace_set_mask(mask);
+		trace_status();
+	} else if (streq(args, "off")) {
+		trace_set_mask(0);
+		terminal_write("Tracing off.\n");
+	} else if (streq(args, "clear")) {
+		trace_clear();
+		terminal_write("Trace cleared.\n");
+	} else if (streq(args, "dump") || streq(args, "stream")) {
+		if (!serial_present()) {
+			terminal_write("No serial port.\n");
+			return;
+		}
+
+		int stream = streq(args, "stream");
+		if (stream) terminal_write("Streaming the trace to COM1, Esc stops.\n");
+
+		uint32_t lost = 0;
+		uint32_t cursor = stream ? trace_head() : trace_oldest();
+		uint32_t sent = trace_send(&cursor, trace_head(), stream, &lost);
+
+		terminal_write("Sent ");
+		terminal_write_u32(sent);
+		terminal_write(" events to COM1");
+		if (lost) {
+			terminal_write(", ");
+			terminal_write_u32(lost);
+			terminal_write(" overwritten first");
+		}
+		terminal_write(".\n");
+	} else {
+		terminal_write("Usage: trace [on [classes]|off|clear|dump|stream]\n");
+	}
+}
+
+static void cmd_ps(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	task_print_to_console();
+}
+
+static void cmd_top(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	uint32_t ms = 1000;
+	if (args && (!parse_u32(args, &ms) || ms == 0)) {
+		terminal_write("Usage: top [ms]\n");
+		return;
+	}
+	task_print_top(ms);
+}
+
+static void cmd_kill(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	uint32_t id;
+	if (parse_u32(args, &id) && job_cancel_task((int)id)) {
+		// a job stops between steps so it never leaves the lock held
+		terminal_write("Job will stop after its current step.\n");
+	} else if (parse_u32(args, &id) && task_kill((int)id)) {
+		terminal_write("Killed task.\n");
+	} else {
+		terminal_write("Usage: kill <id>\n");
+	}
+}
+
+static void cmd_prio(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	char id_str[12];
+	size_t n = 0;
+	while (args[n] && args[n] != ' ' && n + 1 < sizeof(id_str)) { id_str[n] = args[n]; n++; }
+	id_str[n] = '\0';
+
+	uint32_t id, level;
+	task_t* t = 0;
+	if (args[n] == ' ' && parse_u32(id_str, &id) && parse_u32(args + n + 1, &level) && level < SCHED_LEVELS) {
+		t = task_at((int)id);
+	}
+	if (t) {
+		sched_set_priority(t, (int)level);
+		terminal_write("Priority set.\n");
+	} else {
+		terminal_write("Usage: prio <id> <level 0-3>\n");
+	}
+}
+
+static void cmd_spawn(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	int id;
+	if (streq(args, "hb0")) {
+		id = task_create(task_heartbeat0, "heartbeat0");
+		if (id >= 0) terminal_write("Spawned hb0.\n");
+	} else if (streq(args, "hb1")) {
+		id = task_create(task_heartbeat1, "heartbeat1");
+		if (id >= 0) terminal_write("Spawned hb1.\n");
+	} else {
+		unknown_command();
+		return;
+	}
+	if (id < 0) terminal_write("No free task slots.\n");
+}
+
+static void cmd_quantum(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	if (!args) {
+		terminal_write("Quantum: ");
+		terminal_write_u32(sched_get_quantum());
+		terminal_write(" ticks\n");
+		return;
+	}
+
+	uint32_t ms;
+	if (parse_u32(args, &ms) && ms > 0) {
+		sched_set_quantum(pit_ms_to_ticks(ms));
+		terminal_write("Quantum set.\n");
+	} else {
+		terminal_write("Usage: quantum <ms>\n");
+	}
+}
+
+static void cmd_yield(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	terminal_write("(yield)\n");
+	yield();
+}
+
+static void cmd_shop(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	terminal_write("In this directory:\n");
+	vfs_shop(shop_print_cb, 0);
+}
+
+static void cmd_seek(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	if (args && starts_with(args, "name ")) {
+		seek_run(VFS_SEEK_NAME, args + 5);
+	} else if (args && starts_with(args, "text ")) {
+		seek_run(VFS_SEEK_TEXT, args + 5);
+	} else {
+		terminal_write("Usage: seek name <part of name> | seek text <words>\n");
+	}
+}
+
+static void cmd_grimoire(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	terminal_write("Learned spells:\n");
+	vfs_grimoire(grimoire_print_cb, 0);
+}
+
+static void cmd_fab(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	vfs_status_t st = vfs_fab(args);
+	vfs_print_status(st);
+	if (vfs_is_dirty()) vfs_save();
+}
+
+static void cmd_insp(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	const char* text = 0;
+	vfs_status_t st = vfs_insp(args, &text);
+	if (st != VFS_OK) {
+		vfs_print_status(st);
+	} else {
+		terminal_write(text ? text : "");
+		terminal_putc('\n');
+	}
+}
+
+static void cmd_carve(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	carve_command(args, 0);
+}
+
+static void cmd_etch(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	carve_command(args, 1);
+}
+
+static void cmd_scribe(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	scribe_open(args);
+}
+
+static void cmd_burn(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	terminal_write("Burn file '");
+	terminal_write(args);
+	terminal_write("'? (y/n): ");
+	char yn = read_yes_no();
+	if (yn == 'y') {
+		vfs_status_t st = vfs_burn(args);
+		vfs_print_status(st);
 		if (vfs_is_dirty()) vfs_save();
-	} else if (starts_with(buf, "cast ")) {
-		shell_cast_script(buf + 5, depth);
-      	} else {
-      		terminal_write("Unknown command. Use 'help' for commands.\n");
-      	}
+	} else {
+		terminal_write("Canceled.\n");
+	}
+}
+
+static void cmd_newdir(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	vfs_status_t st = vfs_mkdir(args);
+	vfs_print_status(st);
+	if (vfs_is_dirty()) vfs_save();
+}
+
+static void cmd_cd(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	vfs_status_t st = vfs_cd(args);
+	vfs_print_status(st);
+}
+
+static void cmd_learn(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	vfs_status_t st = vfs_learn(args);
+	if (st == VFS_OK) {
+		terminal_write("Spell learned.\n");
+		// compile now so the first cast is already fast; if this fails
+		// for memory the cast compiles it instead
+		spell_t* sp = spell_compile_file(args);
+		if (sp) spell_release(sp);
+	} else {
+		vfs_print_status(st);
+	}
+	if (vfs_is_dirty()) vfs_save();
+}
+
+static void spell_job(void* arg) {
+	spell_t* sp = (spell_t*)arg;
+	spell_run(sp, 0);
+
+	cmd_lock();
+	spell_release(sp);
+	cmd_unlock();
+}
+
+static void cmd_cast(const char* args, int from_script, int depth) {
+	(void)from_script;
+	size_t len = kstrlen(args);
+	if (len < 2 || args[len - 2] != ' ' || args[len - 1] != '&') {
+		shell_cast_script(args, depth);
+		return;
+	}
+
+	char name[SPELL_LINE_MAX];
+	kstrncpy0(name, args, (len - 1 < sizeof(name)) ? len - 1 : sizeof(name));
+
+	cmd_lock();
+	spell_t* sp = spell_acquire(name);
+	cmd_unlock();
+	if (!sp) return;
+
+	// the job takes over the reference
+	char label[32];
+	kstrncpy0(label, "cast ", sizeof(label));
+	kstrncpy0(label + 5, name, sizeof(label) - 5);
+	int num = job_start(label, spell_job, sp);
+	if (num < 0) {
+		terminal_write("No free job slots.\n");
+		cmd_lock();
+		spell_release(sp);
+		cmd_unlock();
+		return;
+	}
+
+	terminal_putc('[');
+	terminal_write_u32((uint32_t)num);
+	terminal_write("] ");
+	terminal_write(label);
+	terminal_putc('\n');
+}
+
+static void cmd_jobs(const char* args, int from_script, int depth) {
+	(void)args; (void)from_script; (void)depth;
+	jobs_print();
+}
+
+static void cmd_wait(const char* args, int from_script, int depth) {
+	(void)from_script; (void)depth;
+	uint32_t num = 0;
+	if (args && (!parse_u32(args, &num) || num == 0)) {
+		terminal_write("Usage: wait [job]\n");
+		return;
+	}
+
+	int r = jobs_wait((int)num);
+	if (r < 0) terminal_write("No such job.\n");
+	else if (r == 0) terminal_write("Stopped waiting.\n");
+}
+
+// which forms a command accepts, and how it runs
+#define SHELL_BARE 0x01u	// "name"
+#define SHELL_ARGS 0x02u	// "name <args>"
+#define SHELL_FG 0x04u	// needs the keyboard, the screen or the shell's cwd, not in a job
+#define SHELL_NOLOCK 0x08u	// runs without the command lock
+
+typedef struct {
+	const char* name;
+	uint8_t flags;
+	shell_cmd_fn_t fn;
+} shell_cmd_t;
+
+static const shell_cmd_t g_commands[] = {
+	{ "thanks",    SHELL_BARE,                          cmd_thanks },
+	{ "sync",      SHELL_BARE,                          cmd_sync },
+	{ "exit",      SHELL_BARE | SHELL_FG,               cmd_exit },
+	{ "formatfs",  SHELL_BARE | SHELL_FG,               cmd_formatfs },
+	{ "help",      SHELL_BARE,                          cmd_help },
+	{ "clear",     SHELL_BARE | SHELL_FG,               cmd_clear },
+	{ "heapstat",  SHELL_BARE | SHELL_ARGS,             cmd_heapstat },
+	{ "cachestat", SHELL_BARE,                          cmd_cachestat },
+	{ "membench",  SHELL_BARE | SHELL_NOLOCK,           cmd_membench },
+	{ "bench",     SHELL_BARE,                          cmd_bench },
+	{ "ps",        SHELL_BARE,                          cmd_ps },
+	{ "top",       SHELL_BARE | SHELL_ARGS | SHELL_NOLOCK, cmd_top },
+	{ "kill",      SHELL_ARGS,                          cmd_kill },
+	{ "prio",      SHELL_ARGS,                          cmd_prio },
+	{ "spawn",     SHELL_ARGS,                          cmd_spawn },
+	{ "quantum",   SHELL_BARE | SHELL_ARGS,             cmd_quantum },
+	{ "yield",     SHELL_BARE | SHELL_NOLOCK,           cmd_yield },
+	{ "shop",      SHELL_BARE,                          cmd_shop },
+	{ "seek",      SHELL_BARE | SHELL_ARGS,             cmd_seek },
+	{ "grimoire",  SHELL_BARE,                          cmd_grimoire },
+	{ "fab",       SHELL_ARGS,                          cmd_fab },
+	{ "insp",      SHELL_ARGS,                          cmd_insp },
+	{ "carve",     SHELL_ARGS,                          cmd_carve },
+	{ "etch",      SHELL_ARGS,                          cmd_etch },
+	{ "scribe",    SHELL_ARGS | SHELL_FG,               cmd_scribe },
+	{ "burn",      SHELL_ARGS | SHELL_FG,               cmd_burn },
+	{ "newdir",    SHELL_ARGS,                          cmd_newdir },
+	{ "cd",        SHELL_ARGS | SHELL_FG,               cmd_cd },
+	{ "learn",     SHELL_ARGS,                          cmd_learn },
+	{ "cast",      SHELL_ARGS | SHELL_NOLOCK,           cmd_cast },
+	{ "serial",    SHELL_BARE | SHELL_ARGS,             cmd_serial },
+	{ "trace",     SHELL_BARE | SHELL_ARGS | SHELL_FG | SHELL_NOLOCK, cmd_trace },
+	{ "jobs",      SHELL_BARE | SHELL_NOLOCK,           cmd_jobs },
+	{ "wait",      SHELL_BARE | SHELL_ARGS | SHELL_FG | SHELL_NOLOCK, cmd_wait },
+};
+
+#define SHELL_CMD_COUNT ((int)(sizeof(g_commands) / sizeof(g_commands[0])))
+
+// open addressing over the command names, slot holds index + 1
+#define SHELL_CMD_SLOTS 64
+static uint8_t g_cmd_slots[SHELL_CMD_SLOTS];
+static int g_cmd_slots_ready = 0;
+
+static uint32_t cmd_hash(const char* s, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) h = (h ^ (uint8_t)s[i]) * 16777619u;
+	return h;
+}
+
+static void cmd_table_build(void) {
+	for (int i = 0; i < SHELL_CMD_SLOTS; i++) g_cmd_slots[i] = 0;
+	for (int i = 0; i < SHELL_CMD_COUNT; i++) {
+		uint32_t h = cmd_hash(g_commands[i].name, kstrlen(g_commands[i].name));
+		uint32_t slot = h & (SHELL_CMD_SLOTS - 1u);
+		while (g_cmd_slots[slot]) slot = (slot + 1u) & (SHELL_CMD_SLOTS - 1u);
+		g_cmd_slots[slot] = (uint8_t)(i + 1);
+	}
+	g_cmd_slots_ready = 1;
+}
+
+// split a line into its command and arguments. returns the command index
+// or -1, and leaves *out_args at the text after the first space, or 0
+static int cmd_resolve(const char* line, const char** out_args) {
+	*out_args = 0;
+	if (!g_cmd_slots_ready) cmd_table_build();
+
+	size_t len = 0;
+	while (line[len] && line[len] != ' ') len++;
+	if (len == 0) return -1;
+
+	uint32_t slot = cmd_hash(line, len) & (SHELL_CMD_SLOTS - 1u);
+	for (; g_cmd_slots[slot]; slot = (slot + 1u) & (SHELL_CMD_SLOTS - 1u)) {
+		int i = g_cmd_slots[slot] - 1;
+		const char* name = g_commands[i].name;
+		if (kstrncmp(name, line, len) != 0 || name[len] != '\0') continue;
+
+		if (line[len] == ' ') {
+			if (!(g_commands[i].flags & SHELL_ARGS)) return -1;
+			*out_args = line + len + 1;
+		} else if (!(g_commands[i].flags & SHELL_BARE)) {
+			return -1;
+		}
+		return i;
+	}
+	return -1;
+}
+
+static void run_command(int cmd, const char* args, int from_script, int depth) {
+	const shell_cmd_t* c = &g_commands[cmd];
+	if ((c->flags & SHELL_FG) && job_is_background()) {
+		terminal_write("Not in a background spell.\n");
+		return;
+	}
+
+	if (c->flags & SHELL_NOLOCK) {
+		c->fn(args, from_script, depth);
+	} else {
+		cmd_lock();
+		c->fn(args, from_script, depth);
+		cmd_unlock();
+	}
+}
+
+static void shell_execute_command(const char* buf, int from_script, int depth) {
+	const char* args;
+	int cmd = cmd_resolve(buf, &args);
+	if (cmd < 0) {
+		unknown_command();
+		return;
+	}
+	run_command(cmd, args, from_script, depth);
+}
+
+static void spell_release(spell_t* sp) {
+	if (sp && --sp->refs == 0) kfree(sp);
+}
+
+static void spell_release_attached(void* obj) {
+	spell_release((spell_t*)obj);
+}
+
+static spell_t* spell_compile(const char* text) {
+	const char* p = text ? text : "";
+	char line[SPELL_LINE_MAX];
+
+	// one pass to size it, one to fill it, all in a single block
+	uint32_t count = 0;
+	size_t pool_bytes = 0;
+	while (split_next_line(&p, line, sizeof(line))) {
+		if (!line[0]) continue;
+		count++;
+		pool_bytes += kstrlen(line) + 1u;
+	}
+
+	size_t bytes = sizeof(spell_t) + count * sizeof(spell_step_t) + pool_bytes;
+	spell_t* sp = (spell_t*)kmalloc_tagged(bytes, HEAP_TAG_SHELL);
+	if (!sp) return 0;
+	sp->refs = 1;
+	sp->count = count;
+	sp->steps = (spell_step_t*)(sp + 1);
+	sp->pool = (char*)(sp->steps + count);
+
+	p = text ? text : "";
+	uint32_t k = 0;
+	size_t pos = 0;
+	while (k < count && split_next_line(&p, line, sizeof(line))) {
+		if (!line[0]) continue;
+		size_t len = kstrlen(line);
+		kmemcpy(sp->pool + pos, line, len + 1u);
+
+		const char* args;
+		spell_step_t* st = &sp->steps[k++];
+		st->cmd = (int16_t)cmd_resolve(sp->pool + pos, &args);
+		st->line = (uint32_t)pos;
+		st->args = args ? (uint32_t)(args - sp->pool) : SPELL_NO_ARGS;
+		pos += len + 1u;
+	}
+	return sp;
+}
+
+// compiles filename and leaves the result on its node. the caller gets
+// its own reference
+static spell_t* spell_compile_file(const char* filename) {
+	const char* text = 0;
+	if (vfs_insp(filename, &text) != VFS_OK) return 0;
+
+	spell_t* sp = spell_compile(text);
+	if (!sp) return 0;
+	if (vfs_attach(filename, sp, spell_release_attached) == VFS_OK) sp->refs++;
+	return sp;
+}
+
+static void spell_run(const spell_t* sp, int depth) {
+	for (uint32_t k = 0; k < sp->count; k++) {
+		const spell_step_t* st = &sp->steps[k];
+		if (job_cancelled()) break;
+
+		terminal_write("[");
+		terminal_write(sp->pool + st->line);
+		terminal_write("] :\n");
+
+		if (st->cmd < 0) {
+			unknown_command();
+			continue;
+		}
+		const char* args = (st->args == SPELL_NO_ARGS) ? 0 : sp->pool + st->args;
+		run_command(st->cmd, args, 1, depth + 1);
+	}
+}
+
+// gives clean file contents back. a background spell may be in the middle
+// of a step that holds file text, so wait until no command runs
+static void shell_reclaim(void) {
+	cmd_lock();
+	vfs_reclaim(0);
+	cmd_unlock();
 }
 
 void task_shell(void) {
 	for (;;) {
+		jobs_drain();
 		prompt();
 		
 		char* buf = read_line();
 		
 		if (!buf) {
 			terminal_write("Out of memory.\n");
+			shell_reclaim();
 			yield();
 			continue;
 		}
@@ -536,6 +1337,8 @@ void task_shell(void) {
 		history_push(buf);
 		shell_execute_command(buf, 0, 0);
 
+		if (pmm_free_count() < SHELL_RECLAIM_FRAMES) shell_reclaim();
+
 		kfree(buf);
 		yield();
 	}
@@ -4,15 +4,31 @@
 #include "kernel/sched.h"
 #include "drivers/vga.h"
 #include "lib/str.h"
-#include "mm/heap.h"
+#include "mm/pmm.h"
 #include "ui/overlays.h"
+#include "drivers/pit.h"
+#include "arsc/i386/cpu.h"
 
 
 #define KSTACK_SIZE 16384
+#define KSTACK_FRAMES (KSTACK_SIZE / PMM_FRAME_SIZE)
 
 static task_t* g_tasks[MAX_TASKS];
 static int g_current = -1;
 
+// control blocks come from a fixed pool indexed by slot, and kernel stacks
+// are taken from the PMM once and then cached, so spawn/reap never touches
+// the general heap
+static task_t g_task_pool[MAX_TASKS];
+
+static int g_free_slots[MAX_TASKS];
+static int g_free_slot_count = 0;
+
+static void* g_stack_cache[MAX_TASKS];
+static int g_stack_cache_count = 0;
+
+static uint32_t g_spawns = 0;
+
 static void task_trampoline(void);
 
 task_t* task_at(int id) {
@@ -23,72 +39,136 @@ task_t* task_at(int id) {
 int task_current_id(void) { return g_current; }
 
 static int alloc_slot(void) {
-	for (int i = 0; i < MAX_TASKS; i++) {
-		if (g_tasks[i] == 0) return i;
-	}
-	return -1;
+	if (g_free_slot_count == 0) return -1;
+	return g_free_slots[--g_free_slot_count];
+}
+
+static void free_slot(int id) {
+	g_free_slots[g_free_slot_count++] = id;
+}
+
+static void* stack_get(void) {
+	if (g_stack_cache_count > 0) return g_stack_cache[--g_stack_cache_count];
+	return (void*)pmm_alloc_frames(KSTACK_FRAMES);
+}
+
+static void stack_put(void* stack) {
+	// at most MAX_TASKS stacks ever exist, so the cache cannot overflow
+	g_stack_cache[g_stack_cache_count++] = stack;
 }
 
 void task_init(void) {
 	for (int i = 0; i < MAX_TASKS; i++) g_tasks[i] = 0;
 	g_current = -1;
+
+	// hand out low ids first
+	g_free_slot_count = 0;
+	for (int i = MAX_TASKS - 1; i >= 0; i--) free_slot(i);
 }
 
 static void build_initial_context(task_t* t) {
 	uint8_t* base = (uint8_t*)t->kstack_base;
 	uint32_t sp = (uint32_t)(base + t->kstack_size);
 
+	// matches the callee-saved frame popped by ctx_switch
 	sp -= 4; *(uint32_t*)sp = (uint32_t)task_trampoline;	/* ret */
-	sp -= 4; *(uint32_t*)sp = 0x00000002;			/* eflags */
-
-	sp -= 4; *(uint32_t*)sp = 0; /* eax */
-	sp -= 4; *(uint32_t*)sp = 0; /* ecx */
-	sp -= 4; *(uint32_t*)sp = 0; /* edx */
-	sp -= 4; *(uint32_t*)sp = 0; /* ebx */
-	sp -= 4; *(uint32_t*)sp = 0; /* esp dummy */
 	sp -= 4; *(uint32_t*)sp = 0; /* ebp */
+	sp -= 4; *(uint32_t*)sp = 0; /* ebx */
 	sp -= 4; *(uint32_t*)sp = 0; /* esi */
 	sp -= 4; *(uint32_t*)sp = 0; /* edi */
 
 	t->esp = sp;
 }
 
-int task_create(void (*entry)(void), const char* name) {
-	int id = alloc_slot();
-	if (id < 0) return -1;
-
-	task_t* t = (task_t*)kmalloc(sizeof(task_t));
-	if (!t) return -1;
-
-	void* stack = kmalloc(KSTACK_SIZE);
+static int create_task(void (*entry)(void), void (*entry_arg)(void*), void* arg, const char* name) {
+	uint32_t f = irq_save();
+	void* stack = stack_get();
 	if (!stack) {
-		kfree(t);
+		irq_restore(f);
 		return -1;
 	}
 
+	int id = alloc_slot();
+	if (id < 0) {
+		stack_put(stack);
+		irq_restore(f);
+		return -1;
+	}
+
+	task_t* t = &g_task_pool[id];
+
 	t->entry = entry;
-	t->name = name;
-	t->state = TASK_READY;
+	t->entry_arg = entry_arg;
+	t->arg = arg;
+	// the caller's string may not outlive the task
+	kstrncpy0(t->name_buf, name ? name : "?", sizeof(t->name_buf));
+	t->name = t->name_buf;
 	t->kstack_base = stack;
 	t->kstack_size = KSTACK_SIZE;
 	t->esp = 0;
+	t->id = id;
+	t->gen = ++g_spawns;
+	t->pinned = 0;
+	t->priority = SCHED_DEFAULT_PRIORITY;
+	t->base_priority = SCHED_DEFAULT_PRIORITY;
+	t->boost = 0;
+	t->on_rq = 0;
+	t->rq_next = 0;
+	t->rq_prev = 0;
+	t->wake_tick = 0;
+	t->sleep_next = 0;
+	t->run_tsc = 0;
+	t->switches_in = 0;
+	t->vol_switches = 0;
+	t->invol_switches = 0;
+	t->fpu_used = 0;
 
 	build_initial_context(t);
 
 	g_tasks[id] = t;
+	sched_enqueue(t);
+	irq_restore(f);
 
 	return id;
 }
 
+int task_create(void (*entry)(void), const char* name) {
+	return create_task(entry, 0, 0, name);
+}
+
+// arg is handed to entry as is, the caller keeps it alive for the task
+int task_create_arg(void (*entry)(void* arg), void* arg, const char* name) {
+	return create_task(0, entry, arg, name);
+}
+
 static void cleanup_task_slot(int id) {
 	task_t* t = g_tasks[id];
 	if (!t) return;
 
 	overlays_hb_remove(id);
 
-	kfree(t->kstack_base);
-	kfree(t);
+	uint32_t f = irq_save();
+	fpu_forget(t);
+	stack_put(t->kstack_base);
+	t->kstack_base = 0;
 	g_tasks[id] = 0;
+	free_slot(id);
+	irq_restore(f);
+}
+
+// shell, wraith, idle and the overlay compositor keep the system alive
+static int is_system_task(const task_t* t) {
+	return t->name && (streq(t->name, "shell") || streq(t->name, "wraith") || streq(t->name, "idle") ||
+		streq(t->name, "overlay"));
+}
+
+static task_t* g_wraith = 0;
+
+static int zombies_pending(void) {
+	for (int i = 0; i < MAX_TASKS; i++) {
+		if (g_tasks[i] && g_tasks[i]->state == TASK_ZOMBIE) return 1;
+	}
+	return 0;
 }
 
 int task_kill(int id) {
@@ -99,21 +179,42 @@ int task_kill(int id) {
 	// never kill current task from shell
 	if (id == g_current) return 0;
 
-	// cannot kill shell or wraith tasks
-	if (t->name && (streq(t->name, "shell") || streq(t->name, "wraith"))) return 0;
+	// cannot kill system tasks, or ones that hold something others wait on
+	if (is_system_task(t) || t->pinned) return 0;
 
+	uint32_t f = irq_save();
+	sched_dequeue(t);
 	t->state = TASK_ZOMBIE;
+	sched_wake(g_wraith);
+	irq_restore(f);
 	return 1;
 }
 
+// a pinned task still exits on its own, it just cannot be killed
+void task_pin(int id, int pinned) {
+	task_t* t = task_at(id);
+	if (t) t->pinned = pinned ? 1u : 0u;
+}
+
 void task_exit(void) {
-	for (;;) yield();
+	// never returns, interrupts come back with the next task's EFLAGS
+	(void)irq_save();
+	task_t* t = g_tasks[g_current];
+	if (t && !is_system_task(t)) {
+		t->state = TASK_ZOMBIE;
+		sched_wake(g_wraith);
+	}
+	for (;;) schedule();
 }
 
 static void task_trampoline(void) {
+	// the scheduler switched here with interrupts off and there is no
+	// irq_restore on this stack to turn them back on
+	__asm__ volatile ("sti");
+
 	task_t* t = g_tasks[g_current];
-	void (*fn)(void) = t ? t->entry : 0;
-	if (fn) fn();
+	if (t && t->entry_arg) t->entry_arg(t->arg);
+	else if (t && t->entry) t->entry();
 	task_exit();
 }
 
@@ -123,37 +224,102 @@ char task_state_char(task_state_t s) {
 		case TASK_RUNNING: return '*';
 		case TASK_BLOCKED: return 'B';
 		case TASK_DEAD:	return 'D';
+		case TASK_SLEEPING: return 'S';
 		default: return '?';
 	}
 }
 
+static void write_col_u32(uint32_t v, int width) {
+	int digits = 1;
+	for (uint32_t x = v; x >= 10; x /= 10) digits++;
+	terminal_write_u32(v);
+	while (digits++ < width) terminal_putc(' ');
+}
+
+// parts per thousand, shifted down to 32 bits first since there is no
+// 64-bit divide in a freestanding build
+static uint32_t share_permille(uint64_t part, uint64_t total) {
+	if (part > total) part = total;
+	while (total >> 22) { part >>= 1; total >>= 1; }
+	if (total == 0) return 0;
+	return (uint32_t)part * 1000u / (uint32_t)total;
+}
+
+static void write_col_share(uint32_t pm, int width) {
+	int len = 4; // "d.d%"
+	for (uint32_t x = pm / 10; x >= 10; x /= 10) len++;
+	terminal_write_u32(pm / 10);
+	terminal_putc('.');
+	terminal_write_u32(pm % 10);
+	terminal_putc('%');
+	while (len++ < width) terminal_putc(' ');
+}
+
 void task_print_to_console(void) {
-	terminal_write("ID STATE NAME\n");
+	uint64_t uptime = sched_uptime_tsc();
+
+	terminal_batch_begin();
+	terminal_write("ID  STATE PRI CPU    SW     NAME\n");
 	for (int i = 0; i < MAX_TASKS; i++) {
 		task_t* t = g_tasks[i];
 		if (!t) continue;
 
-		// print ID
-		char tmp[12];
-		int p = 0;
-		uint32_t v = (uint32_t)i;
-
-		if (v == 0) tmp[p++] = '0';
-		else {
-			char r[12];
-			int rp = 0;
-			while (v > 0 && rp < 11) { r[rp++] = (char)('0' + (v % 10)); v /= 10; }
-			while (rp > 0) tmp[p++] = r[--rp];
-		}
-		tmp[p] = '\0';
-
-		terminal_write(tmp);
-		terminal_write("  ");
+		write_col_u32((uint32_t)i, 4);
 		terminal_putc(task_state_char(t->state));
 		terminal_write("     ");
+		write_col_u32(t->priority, 4);
+		write_col_share(share_permille(sched_task_runtime(t), uptime), 7);
+		write_col_u32(t->switches_in, 7);
 		terminal_write(t->name ? t->name : "?");
 		terminal_putc('\n');
 	}
+	terminal_batch_end();
+}
+
+void task_print_top(uint32_t sample_ms) {
+	// slots are reused for new tasks, so match on the spawn count
+	uint32_t seen[MAX_TASKS];
+	uint64_t before[MAX_TASKS];
+
+	for (int i = 0; i < MAX_TASKS; i++) {
+		task_t* t = g_tasks[i];
+		seen[i] = t ? t->gen : 0;
+		before[i] = t ? sched_task_runtime(t) : 0;
+	}
+	uint64_t start = sched_uptime_tsc();
+	uint32_t switches = sched_switch_count();
+
+	task_sleep_ms(sample_ms);
+
+	uint64_t uptime = sched_uptime_tsc();
+	uint64_t window = uptime - start;
+
+	terminal_batch_begin();
+	write_col_u32(sched_switch_count() - switches, 0);
+	terminal_write(" switches in ");
+	write_col_u32(sample_ms, 0);
+	terminal_write(" ms\n");
+
+	terminal_write("ID  PRI NOW    TOTAL  IN     VOL    INV    NAME\n");
+	for (int i = 0; i < MAX_TASKS; i++) {
+		task_t* t = g_tasks[i];
+		if (!t) continue;
+
+		uint64_t run = sched_task_runtime(t);
+		// a task spawned into a reused slot started from zero
+		uint64_t delta = (t->gen == seen[i] && run >= before[i]) ? run - before[i] : run;
+
+		write_col_u32((uint32_t)i, 4);
+		write_col_u32(t->priority, 4);
+		write_col_share(share_permille(delta, window), 7);
+		write_col_share(share_permille(run, uptime), 7);
+		write_col_u32(t->switches_in, 7);
+		write_col_u32(t->vol_switches, 7);
+		write_col_u32(t->invol_switches, 7);
+		terminal_write(t->name ? t->name : "?");
+		terminal_putc('\n');
+	}
+	terminal_batch_end();
 }
 
 int hb_instance_index(const char* hb_name, int my_id) {
@@ -169,14 +335,19 @@ int hb_instance_index(const char* hb_name, int my_id) {
 	return -1;
 }
 
-void task_delay(volatile uint32_t loops) {
-	for (volatile uint32_t i = 0; i < loops; i++) {
-		__asm__ volatile ("pause");
-		if ((i & 0x3FFF) == 0) yield();
-	}
+void task_sleep_ms(uint32_t ms) {
+	task_t* t = task_at(g_current);
+	if (!t) return;
+
+	uint32_t f = irq_save();
+	sched_sleep_until(t, pit_ticks() + pit_ms_to_ticks(ms));
+	schedule();
+	irq_restore(f);
 }
 
 void task_wraith(void) {
+	g_wraith = g_tasks[g_current];
+
 	for (;;) {
 		// reap zombies
 		for (int i = 0; i < MAX_TASKS; i++) {
@@ -184,17 +355,22 @@ void task_wraith(void) {
 			if (!t) continue;
 			if (t->state != TASK_ZOMBIE) continue;
 
-			// don't reap shell or wraith by mistake
-			if (t->name && (streq(t->name, "shell") || streq(t->name, "wraith"))) {
-				t->state = TASK_READY;
+			// don't reap system tasks by mistake
+			if (is_system_task(t)) {
+				sched_enqueue(t);
 				continue;
 			}
 
 			cleanup_task_slot(i);
 		}
 
-		// wait
-		task_delay(200000);
+		// wait for task_kill or task_exit to hand us a zombie
+		uint32_t f = irq_save();
+		if (!zombies_pending()) {
+			sched_block(g_wraith);
+			schedule();
+		}
+		irq_restore(f);
 	}
 }
 
@@ -0,0 +1,116 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel/trace.h"
+#include "kernel/task.h"
+#include "arsc/i386/cpu.h"
+
+uint32_t g_trace_mask = 0;
+
+static trace_event_t g_ring[TRACE_RECORDS];
+static uint32_t g_seq = 0;	// number of the next event
+static uint32_t g_first = 0;	// first event since trace_clear
+
+void trace_record(trace_type_t type, uint32_t a, uint32_t b, uint32_t c) {
+	uint32_t f = irq_save();
+	trace_event_t* e = &g_ring[g_seq++ & (TRACE_RECORDS - 1u)];
+	e->tsc = cpu_rdtsc();
+	e->a = a;
+	e->b = b;
+	e->c = c;
+	e->type = (uint16_t)type;
+	e->task = (uint16_t)task_current_id();
+	irq_restore(f);
+}
+
+void trace_set_mask(uint32_t mask) {
+	g_trace_mask = mask & TRACE_ALL;
+}
+
+void trace_clear(void) {
+	uint32_t f = irq_save();
+	g_first = g_seq;
+	irq_restore(f);
+}
+
+static uint32_t oldest_locked(void) {
+	uint32_t held = g_seq - g_first;
+	return (held > TRACE_RECORDS) ? g_seq - TRACE_RECORDS : g_first;
+}
+
+uint32_t trace_oldest(void) {
+	uint32_t f = irq_save();
+	uint32_t v = oldest_locked();
+	irq_restore(f);
+	return v;
+}
+
+uint32_t trace_head(void) {
+	return g_seq;
+}
+
+uint32_t trace_read(uint32_t* cursor, trace_event_t* out, uint32_t max, uint32_t* lost) {
+	uint32_t f = irq_save();
+	uint32_t oldest = oldest_locked();
+
+	// differences, so the numbering may wrap. a cursor from before the
+	// last clear starts over at it
+	uint32_t behind = g_seq - *cursor;
+	if (behind > g_seq - g_first) {
+		*cursor = g_first;
+		behind = g_seq - g_first;
+	}
+	if (behind > g_seq - oldest) {
+		if (lost) *lost += behind - (g_seq - oldest);
+		*cursor = oldest;
+	}
+
+	uint32_t n = 0;
+	while (*cursor != g_seq && n < max) {
+		out[n++] = g_ring[*cursor & (TRACE_RECORDS - 1u)];
+		(*cursor)++;
+	}
+	irq_restore(f);
+	return n;
+}
+
+const char* trace_type_name(uint32_t type) {
+	switch (type) {
+		case TRACE_SWITCH:    return "switch";
+		case TRACE_DISK:      return "disk";
+		case TRACE_VFS_PHASE: return "vfs";
+		case TRACE_HEAP_SLOW: return "heap";
+		default: return "?";
+	}
+}
+
+static size_t put_hex(char* out, size_t at, size_t cap, uint64_t v, int digits) {
+	static const char hex[] = "0123456789abcdef";
+	for (int i = digits - 1; i >= 0 && at + 1 < cap; i--) {
+		out[at++] = hex[(v >> (i * 4)) & 0xFu];
+	}
+	return at;
+}
+
+static size_t put_str(char* out, size_t at, size_t cap, const char* s) {
+	while (*s && at + 1 < cap) out[at++] = *s++;
+	return at;
+}
+
+size_t trace_format(const trace_event_t* e, char* out, size_t cap) {
+	if (cap == 0) return 0;
+	size_t at = 0;
+	at = put_hex(out, at, cap, e->tsc, 16);
+	at = put_str(out, at, cap, " ");
+	at = put_hex(out, at, cap, e->task, 4);
+	at = put_str(out, at, cap, " ");
+	at = put_str(out, at, cap, trace_type_name(e->type));
+	at = put_str(out, at, cap, " ");
+	at = put_hex(out, at, cap, e->a, 8);
+	at = put_str(out, at, cap, " ");
+	at = put_hex(out, at, cap, e->b, 8);
+	at = put_str(out, at, cap, " ");
+	at = put_hex(out, at, cap, e->c, 8);
+	at = put_str(out, at, cap, "\n");
+	out[at] = '\0';
+	return at;
+}
@@ -0,0 +1,63 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "lib/crc32.h"
+
+#define CRC32_POLY 0xEDB88320u
+
+// buffers are usually bytes, read them a word at a time anyway
+typedef uint32_t __attribute__((may_alias)) crc_word_t;
+
+// slice-by-8: table k maps a byte to its crc after k more zero bytes, so
+// eight input bytes fold in with eight lookups and no per-bit work
+static uint32_t g_table[8][256];
+static int g_ready = 0;
+
+static void crc32_build(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int b = 0; b < 8; b++) c = (c & 1u) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		g_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int k = 1; k < 8; k++) {
+			uint32_t prev = g_table[k - 1][i];
+			g_table[k][i] = (prev >> 8) ^ g_table[0][prev & 0xFFu];
+		}
+	}
+	// building twice is harmless, so no lock for the first caller
+	g_ready = 1;
+}
+
+uint32_t crc32_update(uint32_t crc, const void* p, size_t n) {
+	if (!g_ready) crc32_build();
+
+	const uint8_t* b = (const uint8_t*)p;
+	uint32_t c = ~crc;
+
+	// byte at a time up to 4-byte alignment
+	while (n > 0 && ((uintptr_t)b & 3u)) {
+		c = (c >> 8) ^ g_table[0][(c ^ *b++) & 0xFFu];
+		n--;
+	}
+
+	while (n >= 8) {
+		uint32_t lo = *(const crc_word_t*)b ^ c;
+		uint32_t hi = *(const crc_word_t*)(b + 4);
+		c = g_table[7][lo & 0xFFu] ^ g_table[6][(lo >> 8) & 0xFFu] ^
+		    g_table[5][(lo >> 16) & 0xFFu] ^ g_table[4][lo >> 24] ^
+		    g_table[3][hi & 0xFFu] ^ g_table[2][(hi >> 8) & 0xFFu] ^
+		    g_table[1][(hi >> 16) & 0xFFu] ^ g_table[0][hi >> 24];
+		b += 8;
+		n -= 8;
+	}
+
+	while (n > 0) {
+		c = (c >> 8) ^ g_table[0][(c ^ *b++) & 0xFFu];
+		n--;
+	}
+	return ~c;
+}
+
+uint32_t crc32(const void* p, size_t n) {
+	return crc32_update(0, p, n);
+}
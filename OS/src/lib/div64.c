@@ -0,0 +1,20 @@
+#include <stdint.h>
+#include "lib/div64.h"
+
+// shift and subtract, one quotient bit per round
+uint64_t udiv64(uint64_t n, uint64_t d, uint64_t* rem) {
+	if (d == 0) {
+		if (rem) *rem = n;
+		return 0;
+	}
+	uint64_t q = 0, r = 0;
+	for (int i = 63; i >= 0; i--) {
+		r = (r << 1) | ((n >> i) & 1u);
+		if (r >= d) {
+			r -= d;
+			q |= (uint64_t)1 << i;
+		}
+	}
+	if (rem) *rem = r;
+	return q;
+}
@@ -1,6 +1,27 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "lib/str.h"
+#include "arsc/i386/cpu.h"
+#include "arsc/i386/fpu.h"
+
+// short runs stay in plain byte loops, longer ones go through the string
+// instructions a dword at a time, and big copies use 16-byte SSE moves
+// when the CPU has them. the SSE loop runs with interrupts off, one block
+// at a time, so no handler can land while xmm0-3 hold a caller's bytes
+#define KMEM_WORD_MIN 64
+#define KMEM_SSE_MIN 512
+#define KMEM_SSE_BLOCK 4096
+
+// overlapping moves whose regions are at least this far apart go through
+// kmemcpy in pieces; closer ones use a descending dword loop
+#define KMEM_MOVE_GAP_MIN 64
+
+// needles shorter than this are cheaper to find with the plain scan
+#define KSTRSTR_SKIP_MIN 4
+// how far past the current window kstrstr checks for the terminator
+#define KSTRSTR_LOOKAHEAD 256
+
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32_t;
 
 int streq(const char* a, const char* b) {
 	size_t i = 0;
@@ -56,8 +77,43 @@ int kstrncmp(const char* a, const char* b, size_t n) {
 	return 0;
 }
 
+static inline void copy_bytes(unsigned char** d, const unsigned char** s, size_t n) {
+	__asm__ volatile ("rep movsb" : "+D"(*d), "+S"(*s), "+c"(n) : : "memory");
+}
+
+static inline void copy_dwords(unsigned char** d, const unsigned char** s, size_t n) {
+	__asm__ volatile ("rep movsl" : "+D"(*d), "+S"(*s), "+c"(n) : : "memory");
+}
+
+// whole 64-byte groups, destination already 16-byte aligned
+__attribute__((target("sse")))
+static void copy_sse(unsigned char* d, const unsigned char* s, size_t groups) {
+	for (; groups > 0; groups--, d += 64, s += 64) {
+		__asm__ volatile (
+			"movups   (%0), %%xmm0\n\t"
+			"movups 16(%0), %%xmm1\n\t"
+			"movups 32(%0), %%xmm2\n\t"
+			"movups 48(%0), %%xmm3\n\t"
+			"movaps %%xmm0,   (%1)\n\t"
+			"movaps %%xmm1, 16(%1)\n\t"
+			"movaps %%xmm2, 32(%1)\n\t"
+			"movaps %%xmm3, 48(%1)"
+			: : "r"(s), "r"(d) : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+	}
+}
+
 void* kmemset(void* dst, int v, size_t n) {
 	unsigned char* p = (unsigned char*)dst;
+	if (n >= KMEM_WORD_MIN) {
+		size_t head = (size_t)(-(uintptr_t)p & 3u);
+		n -= head;
+		__asm__ volatile ("rep stosb" : "+D"(p), "+c"(head) : "a"(v) : "memory");
+
+		size_t words = n >> 2;
+		uint32_t fill = (uint32_t)(unsigned char)v * 0x01010101u;
+		__asm__ volatile ("rep stosl" : "+D"(p), "+c"(words) : "a"(fill) : "memory");
+		n &= 3u;
+	}
 	for (size_t i = 0; i < n; i++) p[i] = (unsigned char)v;
 	return dst;
 }
@@ -65,7 +121,31 @@ void* kmemset(void* dst, int v, size_t n) {
 void* kmemcpy(void* dst, const void* src, size_t n) {
 	unsigned char* d = (unsigned char*)dst;
 	const unsigned char* s2 = (const unsigned char*)src;
-	for (size_t i = 0; i < n; i++) d[i] = s2[i];
+	if (n < KMEM_WORD_MIN) {
+		for (size_t i = 0; i < n; i++) d[i] = s2[i];
+		return dst;
+	}
+
+	size_t head = (size_t)(-(uintptr_t)d & 3u);
+	if (n >= KMEM_SSE_MIN && fpu_has_sse()) head = (size_t)(-(uintptr_t)d & 15u);
+	n -= head;
+	copy_bytes(&d, &s2, head);
+
+	if (n >= KMEM_SSE_MIN && fpu_has_sse()) {
+		while (n >= 64) {
+			size_t block = (n < KMEM_SSE_BLOCK) ? n : KMEM_SSE_BLOCK;
+			size_t groups = block >> 6;
+			uint32_t f = irq_save();
+			copy_sse(d, s2, groups);
+			irq_restore(f);
+			d += groups << 6;
+			s2 += groups << 6;
+			n -= groups << 6;
+		}
+	}
+
+	copy_dwords(&d, &s2, n >> 2);
+	copy_bytes(&d, &s2, n & 3u);
 	return dst;
 }
 
@@ -73,23 +153,82 @@ void* kmemmove(void* dst, const void* src, size_t n) {
 	unsigned char* d = (unsigned char*)dst;
 	const unsigned char* s2 = (const unsigned char*)src;
 	if (d == s2 || n == 0) return dst;
-	if (d < s2) {
-		for (size_t i = 0; i < n; i++) d[i] = s2[i];
-	} else {
+
+	// a forward copy only reads ahead of what it has written
+	if (d < s2 || d >= s2 + n) return kmemcpy(dst, src, n);
+
+	if (n < KMEM_WORD_MIN) {
 		for (size_t i = n; i > 0; i--) d[i - 1] = s2[i - 1];
+		return dst;
+	}
+
+	// overlapping with dst above src: copy from the top down. a piece no
+	// longer than the distance between the two never overlaps itself, so
+	// far apart regions can still use the forward copy
+	size_t gap = (size_t)(d - s2);
+	if (gap >= KMEM_MOVE_GAP_MIN) {
+		while (n > 0) {
+			size_t piece = (n < gap) ? n : gap;
+			n -= piece;
+			kmemcpy(d + n, s2 + n, piece);
+		}
+		return dst;
 	}
+
+	// each load sits below everything already stored
+	for (; n >= 4; n -= 4) *(unaligned_u32_t*)(d + n - 4) = *(const unaligned_u32_t*)(s2 + n - 4);
+	for (; n > 0; n--) d[n - 1] = s2[n - 1];
 	return dst;
 }
 
+int kmemcmp(const void* a, const void* b, size_t n) {
+	const unsigned char* x = (const unsigned char*)a;
+	const unsigned char* y = (const unsigned char*)b;
+	for (size_t i = 0; i < n; i++) {
+		if (x[i] != y[i]) return (int)x[i] - (int)y[i];
+	}
+	return 0;
+}
+
 const char* kstrstr(const char* haystack, const char* needle) {
 	if (!haystack || !needle) return 0;
 	if (needle[0] == '\0') return haystack;
-	for (size_t i = 0; haystack[i]; i++) {
-		size_t j = 0;
-		while (needle[j] && haystack[i + j] && haystack[i + j] == needle[j]) j++;
-		if (needle[j] == '\0') return &haystack[i];
+
+	size_t m = kstrlen(needle);
+	if (m < KSTRSTR_SKIP_MIN) {
+		for (size_t i = 0; haystack[i]; i++) {
+			size_t j = 0;
+			while (needle[j] && haystack[i + j] && haystack[i + j] == needle[j]) j++;
+			if (needle[j] == '\0') return &haystack[i];
+		}
+		return 0;
+	}
+
+	// Horspool: compare at the window's last byte and on a miss slide by
+	// how far that byte sits from the needle's end. shifts are capped at
+	// 255, which only ever slides less than allowed. the haystack length is
+	// found as the window advances, so an early match never walks all of it
+	uint8_t shift[256];
+	kmemset(shift, (m < 255) ? (int)m : 255, sizeof(shift));
+	for (size_t i = 0; i + 1 < m; i++) {
+		size_t dist = m - 1 - i;
+		shift[(unsigned char)needle[i]] = (uint8_t)((dist < 255) ? dist : 255);
+	}
+
+	unsigned char last = (unsigned char)needle[m - 1];
+	size_t known = 0;	// haystack bytes seen to be before the terminator
+	for (size_t i = 0;;) {
+		if (i + m > known) {
+			size_t want = i + m - known + KSTRSTR_LOOKAHEAD;
+			size_t got = kstrnlen(haystack + known, want);
+			known += got;
+			if (i + m > known) return 0;
+		}
+
+		unsigned char c = (unsigned char)haystack[i + m - 1];
+		if (c == last && kmemcmp(haystack + i, needle, m - 1) == 0) return &haystack[i];
+		i += shift[c];
 	}
-	return 0;
 }
 
 size_t kstrnlen(const char* s, size_t max) {
@@ -1,108 +1,413 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "mm/heap.h"
+#include "mm/pmm.h"
+#include "arsc/i386/cpu.h"
+#include "kernel/trace.h"
 
-extern uint8_t end;
+// small requests are rounded up to a power-of-two size class and served
+// from a per-class free list. anything larger than HEAP_SMALL_MAX goes on
+// the large path, which keeps blocks in address order so they can be
+// coalesced on free.
+#define HEAP_MIN_SHIFT		4u	// 16 byte smallest class
+#define HEAP_NUM_CLASSES	8u	// 16, 32, ... 2048
+#define HEAP_SMALL_MAX		(1u << (HEAP_MIN_SHIFT + HEAP_NUM_CLASSES - 1u))
+#define HEAP_CLASS_LARGE	0xFFu
+
+// the heap grows in chunks of whole frames taken from the PMM
+#define HEAP_GROW_FRAMES	16u
+
+// guard mode
+#define HEAP_F_GUARD		0x01u
+#define HEAP_GUARD_BYTES	16u
+#define HEAP_GUARD_BYTE		0xFDu
+#define HEAP_ALLOC_POISON	0xCDu
+#define HEAP_FREE_POISON	0xDDu
 
 typedef struct heap_block {
-	size_t size;
-	int free;
-	struct heap_block* next;
-	struct heap_block* prev;
+	size_t size;			// payload bytes
+	uint8_t cls;			// size class, or HEAP_CLASS_LARGE
+	uint8_t free;
+	uint8_t tag;			// heap_tag_t of the last owner
+	uint8_t flags;
+	struct heap_block* next;	// small: free list link, large: next block by address
+	struct heap_block* prev;	// large: previous block by address
 } heap_block_t;
 
-static heap_block_t* g_head = 0;
-static uintptr_t g_brk = 0;
+// free large blocks keep their free list links in the (unused) payload
+typedef struct heap_free_links {
+	heap_block_t* next_free;
+	heap_block_t* prev_free;
+} heap_free_links_t;
+
+static heap_block_t* g_class_free[HEAP_NUM_CLASSES];
+
+static heap_block_t* g_large_head = 0;
+static heap_block_t* g_large_tail = 0;
+static heap_block_t* g_large_free = 0;
+
+static uintptr_t g_brk = 0;	// next free byte in the current chunk
+static uintptr_t g_limit = 0;	// end of the current chunk
+
+static heap_stats_t g_stats;
+static int g_guard = 0;
+
+static const char* const g_tag_names[HEAP_TAG_COUNT] = {
+	"other", "vfs", "scribe", "shell"
+};
 
 static inline uintptr_t align16(uintptr_t x) {
 	return (x + 15u) & ~((uintptr_t)15u);
 }
 
+static inline void* block_payload(heap_block_t* blk) {
+	return (void*)((uintptr_t)blk + sizeof(heap_block_t));
+}
+
+static inline heap_free_links_t* block_links(heap_block_t* blk) {
+	return (heap_free_links_t*)block_payload(blk);
+}
+
+static inline uintptr_t block_end(heap_block_t* blk) {
+	return (uintptr_t)blk + sizeof(heap_block_t) + blk->size;
+}
+
+static unsigned size_class(size_t bytes) {
+	if (bytes <= (1u << HEAP_MIN_SHIFT)) return 0;
+	unsigned bits = 32u - (unsigned)__builtin_clz((unsigned)(bytes - 1u));
+	return bits - HEAP_MIN_SHIFT;
+}
+
+static inline size_t class_size(unsigned cls) {
+	return (size_t)1u << (cls + HEAP_MIN_SHIFT);
+}
+
+static uintptr_t grab_frames(size_t need, size_t* out_frames) {
+	size_t frames = (need + PMM_FRAME_SIZE - 1u) / PMM_FRAME_SIZE;
+	size_t want = (frames < HEAP_GROW_FRAMES) ? HEAP_GROW_FRAMES : frames;
+
+	uintptr_t chunk = pmm_alloc_frames(want);
+	if (!chunk && want != frames) {
+		want = frames;
+		chunk = pmm_alloc_frames(want);
+	}
+	*out_frames = want;
+	return chunk;
+}
+
+// make sure [align16(g_brk), +need) is backed by frames, moving to a
+// fresh chunk if the current one cannot be extended in place
+static int heap_reserve(size_t need) {
+	uintptr_t base = align16(g_brk);
+	if (g_limit && base + need <= g_limit) return 1;
+
+	size_t frames = 0;
+	if (g_limit) {
+		uintptr_t chunk = grab_frames((size_t)(base + need - g_limit), &frames);
+		if (chunk == g_limit) {
+			g_limit += (uintptr_t)frames * PMM_FRAME_SIZE;
+			return 1;
+		}
+		if (chunk) pmm_free_frames(chunk, frames);
+	}
+
+	uintptr_t chunk = grab_frames(need, &frames);
+	if (!chunk) return 0;
+	g_stats.chunks++;
+
+	// hand back the untouched tail of the old chunk
+	if (g_limit) {
+		uintptr_t spare = (g_brk + PMM_FRAME_SIZE - 1u) & ~((uintptr_t)PMM_FRAME_SIZE - 1u);
+		if (spare < g_limit) pmm_free_frames(spare, (size_t)((g_limit - spare) / PMM_FRAME_SIZE));
+	}
+
+	g_brk = chunk;
+	g_limit = chunk + (uintptr_t)frames * PMM_FRAME_SIZE;
+	return 1;
+}
+
+// the slow path: nothing on a free list fits, so carve fresh space
 static heap_block_t* request_block(size_t size) {
+	uint64_t t0 = cpu_rdtsc();
+	uintptr_t limit = g_limit;
 	size = (size_t)align16((uintptr_t)size);
+	if (!heap_reserve(sizeof(heap_block_t) + size)) return 0;
+	if (trace_on(TRACE_HEAP_SLOW)) {
+		trace_record(TRACE_HEAP_SLOW, (uint32_t)size, g_limit != limit, trace_cycles_since(t0, cpu_rdtsc()));
+	}
 
 	uintptr_t base = align16(g_brk);
 	heap_block_t* blk = (heap_block_t*)base;
 	blk->size = size;
+	blk->cls = HEAP_CLASS_LARGE;
 	blk->free = 0;
+	blk->tag = HEAP_TAG_OTHER;
+	blk->flags = 0;
 	blk->next = 0;
 	blk->prev = 0;
 
 	g_brk = base + sizeof(heap_block_t) + size;
+	g_stats.carved_bytes += (uint32_t)(sizeof(heap_block_t) + size);
 	return blk;
 }
 
+static void large_free_push(heap_block_t* blk) {
+	g_stats.free_blocks++;
+	g_stats.free_bytes += (uint32_t)blk->size;
+
+	heap_free_links_t* l = block_links(blk);
+	l->prev_free = 0;
+	l->next_free = g_large_free;
+	if (g_large_free) block_links(g_large_free)->prev_free = blk;
+	g_large_free = blk;
+}
+
+static void large_free_unlink(heap_block_t* blk) {
+	g_stats.free_blocks--;
+	g_stats.free_bytes -= (uint32_t)blk->size;
+
+	heap_free_links_t* l = block_links(blk);
+	if (l->prev_free) block_links(l->prev_free)->next_free = l->next_free;
+	else g_large_free = l->next_free;
+	if (l->next_free) block_links(l->next_free)->prev_free = l->prev_free;
+}
+
+static void large_append(heap_block_t* blk) {
+	blk->next = 0;
+	blk->prev = g_large_tail;
+	if (g_large_tail) g_large_tail->next = blk;
+	else g_large_head = blk;
+	g_large_tail = blk;
+}
+
+static void large_unlink(heap_block_t* blk) {
+	if (blk->prev) blk->prev->next = blk->next;
+	else g_large_head = blk->next;
+	if (blk->next) blk->next->prev = blk->prev;
+	else g_large_tail = blk->prev;
+}
+
 static void split_block(heap_block_t* blk, size_t want) {
 	want = (size_t)align16((uintptr_t)want);
-	if (blk->size < want + sizeof(heap_block_t) + 16) return;
+	// only split when the remainder is still worth keeping on the large path
+	if (blk->size < want + sizeof(heap_block_t) + HEAP_SMALL_MAX) return;
 
-	uintptr_t blk_base = (uintptr_t)blk;
-	uintptr_t new_base = blk_base + sizeof(heap_block_t) + want;
-	new_base = align16(new_base);
+	uintptr_t new_base = (uintptr_t)blk + sizeof(heap_block_t) + want;
 
 	heap_block_t* newblk = (heap_block_t*)new_base;
-	newblk->size = (blk->size + (blk_base + sizeof(heap_block_t)) - (new_base + sizeof(heap_block_t)));
+	newblk->size = blk->size - want - sizeof(heap_block_t);
+	newblk->cls = HEAP_CLASS_LARGE;
 	newblk->free = 1;
+	newblk->tag = HEAP_TAG_OTHER;
+	newblk->flags = 0;
 
 	newblk->next = blk->next;
 	newblk->prev = blk;
 	if (newblk->next) newblk->next->prev = newblk;
+	else g_large_tail = newblk;
 	blk->next = newblk;
 
 	blk->size = want;
+	large_free_push(newblk);
 }
 
-static void coalesce(heap_block_t* blk) {
+static heap_block_t* coalesce(heap_block_t* blk) {
+	// small blocks carved from the bump region sit between large blocks,
+	// so list neighbours are only merged when they are physically adjacent
+
 	// merge forward
-	if (blk->next && blk->next->free) {
-		heap_block_t* n = blk->next;
+	heap_block_t* n = blk->next;
+	if (n && n->free && block_end(blk) == (uintptr_t)n) {
+		large_free_unlink(n);
 		blk->size += sizeof(heap_block_t) + n->size;
-		blk->next = n->next;
-		if (blk->next) blk->next->prev = blk;
+		large_unlink(n);
 	}
 	// merge backward
-	if (blk->prev && blk->prev->free) {
-		heap_block_t* p = blk->prev;
+	heap_block_t* p = blk->prev;
+	if (p && p->free && block_end(p) == (uintptr_t)blk) {
+		large_free_unlink(p);
 		p->size += sizeof(heap_block_t) + blk->size;
-		p->next = blk->next;
-		if (p->next) p->next->prev = p;
+		large_unlink(blk);
+		blk = p;
 	}
+	return blk;
+}
+
+static void* kmalloc_small(size_t bytes) {
+	unsigned cls = size_class(bytes);
+
+	heap_block_t* blk = g_class_free[cls];
+	if (blk) {
+		g_class_free[cls] = blk->next;
+		g_stats.free_blocks--;
+		g_stats.free_bytes -= (uint32_t)blk->size;
+	} else {
+		blk = request_block(class_size(cls));
+		if (!blk) return 0;
+		blk->cls = (uint8_t)cls;
+	}
+
+	blk->free = 0;
+	blk->next = 0;
+	return block_payload(blk);
+}
+
+static void* kmalloc_large(size_t bytes) {
+	for (heap_block_t* b = g_large_free; b; b = block_links(b)->next_free) {
+		if (b->size >= bytes) {
+			large_free_unlink(b);
+			b->free = 0;
+			split_block(b, bytes);
+			return block_payload(b);
+		}
+	}
+
+	// grow a free tail block in place instead of leaving it stranded
+	heap_block_t* tail = g_large_tail;
+	if (tail && tail->free && block_end(tail) == g_brk &&
+	    heap_reserve(bytes - tail->size) && block_end(tail) == g_brk) {
+		large_free_unlink(tail);
+		g_brk += bytes - tail->size;
+		g_stats.carved_bytes += (uint32_t)(bytes - tail->size);
+		tail->size = bytes;
+		tail->free = 0;
+		return block_payload(tail);
+	}
+
+	heap_block_t* blk = request_block(bytes);
+	if (!blk) return 0;
+	large_append(blk);
+	return block_payload(blk);
+}
+
+static inline size_t block_capacity(heap_block_t* blk) {
+	return (blk->cls == HEAP_CLASS_LARGE) ? blk->size : class_size(blk->cls);
+}
+
+static int guard_intact(heap_block_t* blk) {
+	const uint8_t* g = (const uint8_t*)block_payload(blk) + block_capacity(blk) - HEAP_GUARD_BYTES;
+	for (size_t i = 0; i < HEAP_GUARD_BYTES; i++) {
+		if (g[i] != HEAP_GUARD_BYTE) return 0;
+	}
+	return 1;
+}
+
+static void guard_fault(void* ptr) {
+	g_stats.guard_faults++;
+	g_stats.last_fault = (uintptr_t)ptr;
 }
 
 void heap_init(void) {
-	uintptr_t start = align16((uintptr_t)&end);
-	g_head = 0;
-	g_brk = start;
+	for (unsigned i = 0; i < HEAP_NUM_CLASSES; i++) g_class_free[i] = 0;
+	g_large_head = 0;
+	g_large_tail = 0;
+	g_large_free = 0;
+	g_brk = 0;
+	g_limit = 0;
+
+	uint8_t* st = (uint8_t*)&g_stats;
+	for (size_t i = 0; i < sizeof(g_stats); i++) st[i] = 0;
 }
 
 void* kmalloc(size_t bytes) {
+	return kmalloc_tagged(bytes, HEAP_TAG_OTHER);
+}
+
+void* kmalloc_tagged(size_t bytes, heap_tag_t tag) {
 	if (bytes == 0) return 0;
+	if ((unsigned)tag >= HEAP_TAG_COUNT) tag = HEAP_TAG_OTHER;
+
+	uint32_t f = irq_save();
+	int guard = g_guard;
 	bytes = (size_t)align16((uintptr_t)bytes);
+	if (guard) bytes += HEAP_GUARD_BYTES;
 
-	for (heap_block_t* b = g_head; b; b = b->next) {
-		if (b->free && b->size >= bytes) {
-			b->free = 0;
-			split_block(b, bytes);
-			return (void*)((uintptr_t)b + sizeof(heap_block_t));
-		}
+	void* p = (bytes <= HEAP_SMALL_MAX) ? kmalloc_small(bytes) : kmalloc_large(bytes);
+	if (!p) {
+		irq_restore(f);
+		return 0;
 	}
 
-	heap_block_t* blk = request_block(bytes);
-	if (!g_head) {
-		g_head = blk;
-	} else {
-		heap_block_t* tail = g_head;
-		while (tail->next) tail = tail->next;
-		tail->next = blk;
-		blk->prev = tail;
+	heap_block_t* blk = (heap_block_t*)((uintptr_t)p - sizeof(heap_block_t));
+	size_t cap = block_capacity(blk);
+	blk->tag = (uint8_t)tag;
+	blk->flags = guard ? HEAP_F_GUARD : 0;
+
+	if (guard) {
+		uint8_t* b = (uint8_t*)p;
+		for (size_t i = 0; i < cap - HEAP_GUARD_BYTES; i++) b[i] = HEAP_ALLOC_POISON;
+		for (size_t i = cap - HEAP_GUARD_BYTES; i < cap; i++) b[i] = HEAP_GUARD_BYTE;
 	}
-	return (void*)((uintptr_t)blk + sizeof(heap_block_t));
+
+	g_stats.live_blocks++;
+	g_stats.live_bytes += (uint32_t)cap;
+	if (g_stats.live_bytes > g_stats.high_water) g_stats.high_water = g_stats.live_bytes;
+	g_stats.tag_allocs[tag]++;
+	g_stats.tag_live_bytes[tag] += (uint32_t)cap;
+	irq_restore(f);
+	return p;
 }
 
 void kfree(void* ptr) {
 	if (!ptr) return;
 	heap_block_t* blk = (heap_block_t*)((uintptr_t)ptr - sizeof(heap_block_t));
+
+	uint32_t f = irq_save();
+	if (blk->free) {
+		// double free
+		guard_fault(ptr);
+		irq_restore(f);
+		return;
+	}
+
+	size_t cap = block_capacity(blk);
+	if ((blk->flags & HEAP_F_GUARD) && !guard_intact(blk)) guard_fault(ptr);
+	if (blk->flags & HEAP_F_GUARD) {
+		uint8_t* b = (uint8_t*)ptr;
+		for (size_t i = 0; i < cap; i++) b[i] = HEAP_FREE_POISON;
+	}
+
+	g_stats.live_blocks--;
+	g_stats.live_bytes -= (uint32_t)cap;
+	g_stats.tag_live_bytes[blk->tag] -= (uint32_t)cap;
+
 	blk->free = 1;
-	coalesce(blk);
+	blk->flags = 0;
+
+	if (blk->cls != HEAP_CLASS_LARGE) {
+		blk->next = g_class_free[blk->cls];
+		g_class_free[blk->cls] = blk;
+		g_stats.free_blocks++;
+		g_stats.free_bytes += (uint32_t)blk->size;
+		irq_restore(f);
+		return;
+	}
+
+	blk = coalesce(blk);
+	large_free_push(blk);
+	irq_restore(f);
+}
+
+void heap_get_stats(heap_stats_t* out) {
+	if (!out) return;
+	uint32_t f = irq_save();
+	*out = g_stats;
+
+	uint32_t largest = 0;
+	for (heap_block_t* b = g_large_free; b; b = block_links(b)->next_free) {
+		if (b->size > largest) largest = (uint32_t)b->size;
+	}
+	for (unsigned i = 0; i < HEAP_NUM_CLASSES; i++) {
+		if (g_class_free[i] && class_size(i) > largest) largest = (uint32_t)class_size(i);
+	}
+	out->largest_free = largest;
+	irq_restore(f);
+}
+
+const char* heap_tag_name(heap_tag_t tag) {
+	if ((unsigned)tag >= HEAP_TAG_COUNT) return "?";
+	return g_tag_names[tag];
 }
 
+void heap_set_guard(int on) { g_guard = on ? 1 : 0; }
+int heap_guard_enabled(void) { return g_guard; }
@@ -0,0 +1,149 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "mm/pmm.h"
+#include "kernel/multiboot.h"
+
+extern uint8_t end;
+
+// used when GRUB gives us no memory information at all
+#define PMM_FALLBACK_TOP (16u * 1024u * 1024u)
+
+// one bit per frame, 1 = used. the bitmap lives right after the kernel image
+static uint32_t* g_bitmap = 0;
+static size_t g_frame_count = 0;
+static size_t g_free_count = 0;
+static size_t g_hint = 0; // no free frame below this index
+
+static inline uintptr_t align_up(uintptr_t x, uintptr_t a) {
+	return (x + a - 1u) & ~(a - 1u);
+}
+
+static inline int frame_used(size_t f) {
+	return (g_bitmap[f >> 5] >> (f & 31u)) & 1u;
+}
+
+static inline void frame_set(size_t f) {
+	g_bitmap[f >> 5] |= (1u << (f & 31u));
+}
+
+static inline void frame_clear(size_t f) {
+	g_bitmap[f >> 5] &= ~(1u << (f & 31u));
+}
+
+static void mark_range(uint64_t base, uint64_t len, int used) {
+	uint64_t top = base + len;
+	if (top > (uint64_t)g_frame_count * PMM_FRAME_SIZE) top = (uint64_t)g_frame_count * PMM_FRAME_SIZE;
+
+	// free ranges shrink inward to whole frames, reserved ranges grow outward
+	size_t first, last;
+	if (used) {
+		first = (size_t)(base / PMM_FRAME_SIZE);
+		last = (size_t)((top + PMM_FRAME_SIZE - 1u) / PMM_FRAME_SIZE);
+	} else {
+		first = (size_t)((base + PMM_FRAME_SIZE - 1u) / PMM_FRAME_SIZE);
+		last = (size_t)(top / PMM_FRAME_SIZE);
+	}
+
+	for (size_t f = first; f < last; f++) {
+		if (used && !frame_used(f)) { frame_set(f); g_free_count--; }
+		else if (!used && frame_used(f)) { frame_clear(f); g_free_count++; }
+	}
+}
+
+static const multiboot_mmap_entry_t* mmap_next(const multiboot_mmap_entry_t* e) {
+	return (const multiboot_mmap_entry_t*)((uintptr_t)e + e->size + sizeof(e->size));
+}
+
+static uint64_t usable_top(uint32_t magic, const multiboot_info_t* mbi) {
+	if (magic != MULTIBOOT_BOOTLOADER_MAGIC || !mbi) return PMM_FALLBACK_TOP;
+
+	uint64_t top = 0;
+	if (mbi->flags & MULTIBOOT_INFO_MMAP) {
+		uintptr_t mend = mbi->mmap_addr + mbi->mmap_length;
+		for (const multiboot_mmap_entry_t* e = (const multiboot_mmap_entry_t*)mbi->mmap_addr;
+		     (uintptr_t)e < mend; e = mmap_next(e)) {
+			if (e->type != MULTIBOOT_MEMORY_AVAILABLE) continue;
+			uint64_t t = e->addr + e->len;
+			if (t > top) top = t;
+		}
+	} else if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+		top = 0x100000ull + (uint64_t)mbi->mem_upper * 1024u;
+	}
+
+	if (top == 0) return PMM_FALLBACK_TOP;
+	// no paging yet, so only the low 4 GiB is addressable
+	if (top > 0xFFFFF000ull) top = 0xFFFFF000ull;
+	return top;
+}
+
+void pmm_init(uint32_t magic, const multiboot_info_t* mbi) {
+	uint64_t top = usable_top(magic, mbi);
+
+	g_frame_count = (size_t)(top / PMM_FRAME_SIZE);
+	g_bitmap = (uint32_t*)align_up((uintptr_t)&end, PMM_FRAME_SIZE);
+
+	size_t words = (g_frame_count + 31u) / 32u;
+	for (size_t i = 0; i < words; i++) g_bitmap[i] = 0xFFFFFFFFu;
+	g_free_count = 0;
+
+	if (magic == MULTIBOOT_BOOTLOADER_MAGIC && mbi && (mbi->flags & MULTIBOOT_INFO_MMAP)) {
+		uintptr_t mend = mbi->mmap_addr + mbi->mmap_length;
+		for (const multiboot_mmap_entry_t* e = (const multiboot_mmap_entry_t*)mbi->mmap_addr;
+		     (uintptr_t)e < mend; e = mmap_next(e)) {
+			if (e->type == MULTIBOOT_MEMORY_AVAILABLE) mark_range(e->addr, e->len, 0);
+		}
+	} else {
+		mark_range(0x100000u, top - 0x100000u, 0);
+	}
+
+	// low memory, kernel image and the bitmap itself
+	uintptr_t bitmap_end = (uintptr_t)g_bitmap + words * sizeof(uint32_t);
+	mark_range(0, bitmap_end, 1);
+
+	// keep what GRUB handed us readable
+	if (magic == MULTIBOOT_BOOTLOADER_MAGIC && mbi) {
+		mark_range((uintptr_t)mbi, sizeof(*mbi), 1);
+		if (mbi->flags & MULTIBOOT_INFO_MMAP) mark_range(mbi->mmap_addr, mbi->mmap_length, 1);
+		if (mbi->flags & MULTIBOOT_INFO_CMDLINE) mark_range(mbi->cmdline, PMM_FRAME_SIZE, 1);
+	}
+
+	g_hint = 0;
+}
+
+uintptr_t pmm_alloc_frames(size_t count) {
+	if (count == 0 || count > g_free_count) return 0;
+
+	size_t run = 0;
+	size_t start = 0;
+	for (size_t f = g_hint; f < g_frame_count; f++) {
+		// skip full words quickly
+		if ((f & 31u) == 0 && g_bitmap[f >> 5] == 0xFFFFFFFFu) {
+			run = 0;
+			f += 31u;
+			continue;
+		}
+
+		if (frame_used(f)) { run = 0; continue; }
+		if (run == 0) start = f;
+		if (++run == count) {
+			for (size_t i = start; i < start + count; i++) frame_set(i);
+			g_free_count -= count;
+			if (start == g_hint) g_hint = start + count;
+			return (uintptr_t)start * PMM_FRAME_SIZE;
+		}
+	}
+	return 0;
+}
+
+void pmm_free_frames(uintptr_t addr, size_t count) {
+	size_t first = addr / PMM_FRAME_SIZE;
+	for (size_t f = first; f < first + count && f < g_frame_count; f++) {
+		if (!frame_used(f)) continue;
+		frame_clear(f);
+		g_free_count++;
+	}
+	if (first < g_hint) g_hint = first;
+}
+
+size_t pmm_total_count(void) { return g_frame_count; }
+size_t pmm_free_count(void) { return g_free_count; }
@@ -6,99 +6,171 @@
 
 #include "kernel/task.h"
 #include "kernel/sched.h"
+#include "mm/heap.h"
+#include "fs/vfs.h"
+#include "arsc/i386/cpu.h"
 
 #define MAX_TRACK 64	// same as max tasks
 #define MAX_SHOW  10	// number of tasks to display at a time
 
+// the overlay rows are composed, not drawn by whoever changed something:
+// producers only store counters, and the overlay task rebuilds both rows
+// every OVERLAY_PERIOD_MS, writing just the cells that differ from what is
+// already on screen. live system metrics sit in a fixed field on the right
+#define OVERLAY_PERIOD_MS 100
+#define METRICS_COL (VGA_WIDTH - 18)
+
 static uint8_t  g_hb_active[2][MAX_TRACK];
 static uint32_t g_hb_count[2][MAX_TRACK];
+static volatile uint32_t g_hb_version = 0;	// bumped by every producer
+
+static char g_shown[2][VGA_WIDTH];	// cells currently on the overlay rows
+static int g_shown_valid = 0;
+static uint32_t g_drawn_version = 0;
+
+typedef struct {
+	uint32_t ready;
+	uint32_t heap_kib;
+	int fs_dirty;
+} overlay_metrics_t;
 
-static void clear_overlay_rows(void) {
-	terminal_clear_row(OVERLAY_ROW0);
-	terminal_clear_row(OVERLAY_ROW1);
+static overlay_metrics_t g_drawn_metrics;
+
+static void put_str(char* line, size_t* col, size_t limit, const char* s) {
+	while (*s && *col < limit) line[(*col)++] = *s++;
 }
 
-static size_t write_u32_at(size_t row, size_t col, uint32_t v) {
-	char buf[12];
-	int i = 0;
-	if (v == 0) { buf[i++] = '0'; }
-	else {
-		char tmp[12];
-		int t = 0;
-		while (v > 0 && t < 11) { tmp[t++] = (char)('0' + (v % 10)); v /= 10; }
-		while (t > 0) buf[i++] = tmp[--t];
-	}
-	buf[i] = '\0';
-	terminal_write_at(row, col, buf);
-	return (size_t)i;
+static void put_u32(char* line, size_t* col, size_t limit, uint32_t v) {
+	char tmp[12];
+	int t = 0;
+	if (v == 0) tmp[t++] = '0';
+	while (v > 0 && t < 11) { tmp[t++] = (char)('0' + (v % 10)); v /= 10; }
+	while (t > 0 && *col < limit) line[(*col)++] = tmp[--t];
 }
 
-static void redraw_line(int hb_kind, size_t row) {
-	terminal_clear_row(row);
+static size_t u32_digits(uint32_t v) {
+	size_t n = 1;
+	while (v >= 10) { v /= 10; n++; }
+	return n;
+}
 
-	if (hb_kind == 0) terminal_write_at(row, 0, "HB0: ");
-	else              terminal_write_at(row, 0, "HB1: ");
+static void compose_heartbeats(int hb_kind, char* line) {
+	size_t col = 0;
+	put_str(line, &col, METRICS_COL, (hb_kind == 0) ? "HB0: " : "HB1: ");
 
-	size_t col = 5;
 	int shown = 0;
-
 	for (int id = 0; id < MAX_TRACK && shown < MAX_SHOW; id++) {
 		if (!g_hb_active[hb_kind][id]) continue;
 
-		// format is [id:count]
-		if (col + 1 >= VGA_WIDTH) break;
-		terminal_putc_at(row, col++, '[');
+		// format is [id:count], and only whole entries are shown
+		uint32_t count = g_hb_count[hb_kind][id];
+		size_t width = 4 + u32_digits((uint32_t)id) + u32_digits(count);
+		if (col + width >= METRICS_COL) break;
+
+		put_str(line, &col, METRICS_COL, "[");
+		put_u32(line, &col, METRICS_COL, (uint32_t)id);
+		put_str(line, &col, METRICS_COL, ":");
+		put_u32(line, &col, METRICS_COL, count);
+		put_str(line, &col, METRICS_COL, "] ");
+		shown++;
+	}
+}
 
-		col += write_u32_at(row, col, (uint32_t)id);
+static void compose_metrics(const overlay_metrics_t* m, char* row0, char* row1) {
+	size_t col = METRICS_COL;
+	put_str(row0, &col, VGA_WIDTH, "rq ");
+	put_u32(row0, &col, VGA_WIDTH, m->ready);
+	put_str(row0, &col, VGA_WIDTH, "  heap ");
+	put_u32(row0, &col, VGA_WIDTH, m->heap_kib);
+	put_str(row0, &col, VGA_WIDTH, "K");
 
-		if (col + 1 >= VGA_WIDTH) break;
-		terminal_putc_at(row, col++, ':');
+	col = METRICS_COL;
+	put_str(row1, &col, VGA_WIDTH, m->fs_dirty ? "fs dirty" : "fs clean");
+}
 
-		col += write_u32_at(row, col, g_hb_count[hb_kind][id]);
+static void sample_metrics(overlay_metrics_t* m) {
+	heap_stats_t hs;
+	heap_get_stats(&hs);
 
-		if (col + 2 >= VGA_WIDTH) break;
-		terminal_putc_at(row, col++, ']');
-		terminal_putc_at(row, col++, ' ');
+	m->ready = (uint32_t)sched_ready_count();
+	m->heap_kib = (hs.live_bytes + 1023u) / 1024u;
+	m->fs_dirty = vfs_is_dirty();
+}
 
-		shown++;
+static void commit_row(int r, size_t row, const char* line) {
+	for (size_t c = 0; c < VGA_WIDTH; c++) {
+		if (g_shown_valid && g_shown[r][c] == line[c]) continue;
+		g_shown[r][c] = line[c];
+		terminal_putc_at(row, c, line[c]);
 	}
 }
 
+void overlays_refresh(void) {
+	overlay_metrics_t m;
+	sample_metrics(&m);
+
+	uint32_t version = g_hb_version;
+	if (g_shown_valid && version == g_drawn_version &&
+	    m.ready == g_drawn_metrics.ready && m.heap_kib == g_drawn_metrics.heap_kib &&
+	    m.fs_dirty == g_drawn_metrics.fs_dirty) return;
+
+	char row0[VGA_WIDTH];
+	char row1[VGA_WIDTH];
+	kmemset(row0, ' ', sizeof(row0));
+	kmemset(row1, ' ', sizeof(row1));
+
+	compose_heartbeats(0, row0);
+	compose_heartbeats(1, row1);
+	compose_metrics(&m, row0, row1);
+
+	commit_row(0, OVERLAY_ROW0, row0);
+	commit_row(1, OVERLAY_ROW1, row1);
+	g_shown_valid = 1;
+	g_drawn_version = version;
+	g_drawn_metrics = m;
+}
+
 void overlays_redraw(void) {
-	clear_overlay_rows();
-	redraw_line(0, OVERLAY_ROW0);
-	redraw_line(1, OVERLAY_ROW1);
+	// repaint every cell on the next refresh
+	g_shown_valid = 0;
 }
 
 void overlays_hb_tick(int hb_kind, int task_id, uint32_t counter) {
 	if (hb_kind < 0 || hb_kind > 1) return;
 	if (task_id < 0 || task_id >= MAX_TRACK) return;
 
+	// several heartbeat tasks bump the version, keep each bump whole
+	uint32_t f = irq_save();
 	g_hb_active[hb_kind][task_id] = 1;
 	g_hb_count[hb_kind][task_id] = counter;
-
-	// redraw rows when changes occur
-	redraw_line(0, OVERLAY_ROW0);
-	redraw_line(1, OVERLAY_ROW1);
+	g_hb_version++;
+	irq_restore(f);
 }
 
 void overlays_hb_remove(int task_id) {
 	if (task_id < 0 || task_id >= MAX_TRACK) return;
 
+	uint32_t f = irq_save();
 	g_hb_active[0][task_id] = 0;
 	g_hb_active[1][task_id] = 0;
 	g_hb_count[0][task_id] = 0;
 	g_hb_count[1][task_id] = 0;
+	g_hb_version++;
+	irq_restore(f);
+}
 
-	redraw_line(0, OVERLAY_ROW0);
-	redraw_line(1, OVERLAY_ROW1);
+void task_overlay(void) {
+	for (;;) {
+		overlays_refresh();
+		task_sleep_ms(OVERLAY_PERIOD_MS);
+	}
 }
 
 void task_heartbeat0(void) {
 	uint32_t n = 0;
 	for (;;) {
 		overlays_hb_tick(0, task_current_id(), n++);
-		task_delay(800000);
+		task_sleep_ms(400);
 	}
 }
 
@@ -106,7 +178,7 @@ void task_heartbeat1(void) {
 	uint32_t n = 0;
 	for (;;) {
 		overlays_hb_tick(1, task_current_id(), n++);
-		task_delay(1100000);
+		task_sleep_ms(550);
 	}
 }
 